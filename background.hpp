@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BACKGROUND_SSE2 1
+#endif
+
+// Background models for 8-bit grayscale frames.
+//
+// Besides OpenCV's MOG2 there are two models that cost a few instructions per pixel:
+//   median   approximate running median: every frame the background moves one gray level
+//            towards the pixel, so it follows the median of the recent frames
+//   average  exponential average in 8.8 fixed point, moving by (pixel - average) / 2^k
+//            per frame for a history of 2^k frames
+// Both mark a pixel as foreground when it is more than a threshold away from the
+// background, and both update 16 or 32 pixels at a time with SSE2/AVX2.
+//
+// Any model can run on a downscaled frame, its mask is then scaled back up. The state of a
+// model can be saved and loaded, so a rerun on the same setup starts with a trained
+// background instead of a second or two of noise.
+
+enum class BackgroundKind { Mog2, Median, Average };
+
+inline const char* backgroundKindName(BackgroundKind kind)
+{
+    switch (kind) {
+    case BackgroundKind::Median:
+        return "median";
+    case BackgroundKind::Average:
+        return "average";
+    default:
+        return "mog2";
+    }
+}
+
+inline bool parseBackgroundKind(const std::string& name, BackgroundKind& kind)
+{
+    for (BackgroundKind known : {BackgroundKind::Mog2, BackgroundKind::Median, BackgroundKind::Average}) {
+        if (name == backgroundKindName(known)) {
+            kind = known;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct BackgroundSettings
+{
+    BackgroundKind kind = BackgroundKind::Mog2;
+    int scale = 1;      // the model sees frames downscaled by this factor
+    int threshold = 20; // gray levels from the background a foreground pixel is (median, average)
+    int history = 0;    // frames the model remembers, 0 for its default (500 for MOG2, 64 for average)
+};
+
+// One row of the median model: foreground where |frame - background| > threshold, then
+// move the background one level towards the frame
+inline void updateMedianRow(const uint8_t* frame, uint8_t* background, uint8_t* foreground, int width,
+                            int threshold)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i limit = _mm256_set1_epi8(static_cast<char>(threshold + 1));
+    for (; x + 32 <= width; x += 32) {
+        __m256i f = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(frame + x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(background + x));
+        __m256i above = _mm256_subs_epu8(f, b);
+        __m256i below = _mm256_subs_epu8(b, f);
+        __m256i diff = _mm256_or_si256(above, below);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(foreground + x),
+                            _mm256_cmpeq_epi8(_mm256_max_epu8(diff, limit), diff));
+        b = _mm256_subs_epu8(_mm256_adds_epu8(b, _mm256_min_epu8(above, one)), _mm256_min_epu8(below, one));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(background + x), b);
+    }
+#elif defined(BACKGROUND_SSE2)
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold + 1));
+    for (; x + 16 <= width; x += 16) {
+        __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(frame + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + x));
+        __m128i above = _mm_subs_epu8(f, b);
+        __m128i below = _mm_subs_epu8(b, f);
+        __m128i diff = _mm_or_si128(above, below);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(foreground + x), _mm_cmpeq_epi8(_mm_max_epu8(diff, limit), diff));
+        b = _mm_subs_epu8(_mm_adds_epu8(b, _mm_min_epu8(above, one)), _mm_min_epu8(below, one));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(background + x), b);
+    }
+#endif
+    for (; x < width; ++x) {
+        int diff = frame[x] - background[x];
+        foreground[x] = std::abs(diff) > threshold ? 255 : 0;
+        background[x] = static_cast<uint8_t>(background[x] + (diff > 0) - (diff < 0));
+    }
+}
+
+// One row of the average model. background is the average times 256; with shift k it
+// becomes background - background / 2^k + frame * 2^(8-k), which is exact for k <= 8 and
+// never leaves 16 bits.
+inline void updateAverageRow(const uint8_t* frame, uint16_t* background, uint8_t* foreground, int width, int shift,
+                             int threshold)
+{
+    int x = 0;
+#if defined(__AVX2__) || defined(BACKGROUND_SSE2)
+    const __m128i decay = _mm_cvtsi32_si128(shift);
+    const __m128i gain = _mm_cvtsi32_si128(8 - shift);
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold + 1));
+#endif
+#if defined(__AVX2__)
+    const __m256i round = _mm256_set1_epi16(128);
+    for (; x + 16 <= width; x += 16) {
+        __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(frame + x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(background + x));
+        __m256i level = _mm256_srli_epi16(_mm256_add_epi16(b, round), 8);
+        __m128i l = _mm_packus_epi16(_mm256_castsi256_si128(level), _mm256_extracti128_si256(level, 1));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(f, l), _mm_subs_epu8(l, f));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(foreground + x), _mm_cmpeq_epi8(_mm_max_epu8(diff, limit), diff));
+        __m256i wide = _mm256_sll_epi16(_mm256_cvtepu8_epi16(f), gain);
+        b = _mm256_add_epi16(_mm256_sub_epi16(b, _mm256_srl_epi16(b, decay)), wide);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(background + x), b);
+    }
+#elif defined(BACKGROUND_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    for (; x + 16 <= width; x += 16) {
+        __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(frame + x));
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + x));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + x + 8));
+        __m128i l = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(b0, round), 8),
+                                     _mm_srli_epi16(_mm_add_epi16(b1, round), 8));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(f, l), _mm_subs_epu8(l, f));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(foreground + x), _mm_cmpeq_epi8(_mm_max_epu8(diff, limit), diff));
+        __m128i wide0 = _mm_sll_epi16(_mm_unpacklo_epi8(f, zero), gain);
+        __m128i wide1 = _mm_sll_epi16(_mm_unpackhi_epi8(f, zero), gain);
+        b0 = _mm_add_epi16(_mm_sub_epi16(b0, _mm_srl_epi16(b0, decay)), wide0);
+        b1 = _mm_add_epi16(_mm_sub_epi16(b1, _mm_srl_epi16(b1, decay)), wide1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(background + x), b0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(background + x + 8), b1);
+    }
+#endif
+    for (; x < width; ++x) {
+        int diff = frame[x] - ((background[x] + 128) >> 8);
+        foreground[x] = std::abs(diff) > threshold ? 255 : 0;
+        background[x] = static_cast<uint16_t>(background[x] - (background[x] >> shift) + (frame[x] << (8 - shift)));
+    }
+}
+
+// Background model of a grayscale video, selected by BackgroundSettings. Frames must be
+// applied one at a time and in order.
+class BackgroundModel
+{
+public:
+    BackgroundModel() = default;
+    explicit BackgroundModel(const BackgroundSettings& settings) { configure(settings); }
+
+    // Change the settings, which starts the model over
+    void configure(const BackgroundSettings& settings)
+    {
+        m_settings = settings;
+        m_settings.scale = std::max(1, m_settings.scale);
+        m_settings.threshold = std::min(std::max(m_settings.threshold, 0), 254);
+        m_settings.history = std::max(0, m_settings.history);
+        reset();
+    }
+
+    const BackgroundSettings& settings() const { return m_settings; }
+
+    // Forget everything learned (or loaded) so far
+    void reset()
+    {
+        m_mog2.reset();
+        m_background.release();
+        m_seed.release();
+    }
+
+    // Learn from the next frame and write its foreground mask: 255 foreground, 0 background
+    // (and 127 for shadows with MOG2). The first frame of the median and average models
+    // becomes their background and has no foreground.
+    void apply(const cv::Mat& gray, cv::Mat& foreground)
+    {
+        CV_Assert(gray.type() == CV_8UC1);
+        foreground.create(gray.size(), CV_8UC1);
+        if (m_settings.scale == 1) {
+            applyModel(gray, foreground);
+            return;
+        }
+        cv::Size size(std::max(1, gray.cols / m_settings.scale), std::max(1, gray.rows / m_settings.scale));
+        cv::resize(gray, m_small, size, 0, 0, cv::INTER_AREA);
+        m_smallMask.create(size, CV_8UC1);
+        applyModel(m_small, m_smallMask);
+        cv::resize(m_smallMask, foreground, gray.size(), 0, 0, cv::INTER_NEAREST);
+    }
+
+    // Write the settings and the learned background to a FileStorage file (YAML, JSON or
+    // XML, by extension). MOG2 only exposes its background image, so that is what it saves.
+    bool save(const std::string& path) const
+    {
+        cv::Mat state = m_background;
+        if (m_settings.kind == BackgroundKind::Mog2 && m_mog2)
+            m_mog2->getBackgroundImage(state);
+        else if (m_settings.kind == BackgroundKind::Mog2)
+            state = m_seed;
+        if (state.empty())
+            return false;
+
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened())
+            return false;
+        fs << "kind" << backgroundKindName(m_settings.kind);
+        fs << "scale" << m_settings.scale;
+        fs << "threshold" << m_settings.threshold;
+        fs << "history" << m_settings.history;
+        fs << "background" << state;
+        return true;
+    }
+
+    // Start from a saved background. The file must hold the configured kind of model; if it
+    // was saved at another model size it is dropped on the first frame. A loaded MOG2 starts
+    // from the saved background image, it has to learn the variances again.
+    bool load(const std::string& path)
+    {
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened())
+            return false;
+        BackgroundKind kind;
+        std::string name = static_cast<std::string>(fs["kind"]);
+        if (!parseBackgroundKind(name, kind) || kind != m_settings.kind) {
+            std::cout << path << " holds a " << name << " background model, not "
+                      << backgroundKindName(m_settings.kind) << std::endl;
+            return false;
+        }
+        cv::Mat state;
+        fs["background"] >> state;
+        int type = kind == BackgroundKind::Average ? CV_16UC1 : CV_8UC1;
+        if (state.empty() || state.type() != type)
+            return false;
+
+        reset();
+        (kind == BackgroundKind::Mog2 ? m_seed : m_background) = state;
+        return true;
+    }
+
+private:
+    void applyModel(const cv::Mat& gray, cv::Mat& foreground)
+    {
+        const cv::Mat& state = m_settings.kind == BackgroundKind::Mog2 ? m_seed : m_background;
+        if (!state.empty() && state.size() != gray.size()) {
+            std::cout << "Background model is " << state.cols << "x" << state.rows << ", frames are " << gray.cols
+                      << "x" << gray.rows << ", starting over" << std::endl;
+            reset();
+        }
+
+        switch (m_settings.kind) {
+        case BackgroundKind::Mog2:
+            if (!m_mog2) {
+                m_mog2 = cv::createBackgroundSubtractorMOG2(m_settings.history > 0 ? m_settings.history : 500);
+                if (!m_seed.empty())
+                    m_mog2->apply(m_seed, foreground, 1.0);
+                m_seed.release();
+            }
+            m_mog2->apply(gray, foreground);
+            return;
+        case BackgroundKind::Median:
+            if (m_background.empty()) {
+                gray.copyTo(m_background);
+                foreground.setTo(cv::Scalar::all(0));
+                return;
+            }
+            for (int y = 0; y < gray.rows; ++y)
+                updateMedianRow(gray.ptr<uint8_t>(y), m_background.ptr<uint8_t>(y), foreground.ptr<uint8_t>(y),
+                                gray.cols, m_settings.threshold);
+            return;
+        case BackgroundKind::Average: {
+            if (m_background.empty()) {
+                gray.convertTo(m_background, CV_16U, 256.0);
+                foreground.setTo(cv::Scalar::all(0));
+                return;
+            }
+            int shift = averageShift();
+            for (int y = 0; y < gray.rows; ++y)
+                updateAverageRow(gray.ptr<uint8_t>(y), m_background.ptr<uint16_t>(y), foreground.ptr<uint8_t>(y),
+                                 gray.cols, shift, m_settings.threshold);
+            return;
+        }
+        }
+    }
+
+    // History of the average as a power of two, 2^1 to 2^8 frames
+    int averageShift() const
+    {
+        int history = m_settings.history > 0 ? m_settings.history : 64;
+        return std::min(std::max(static_cast<int>(std::lround(std::log2(history))), 1), 8);
+    }
+
+    BackgroundSettings m_settings;
+    cv::Ptr<cv::BackgroundSubtractorMOG2> m_mog2;
+    cv::Mat m_background; // median (8-bit) or average (16-bit, times 256)
+    cv::Mat m_seed;       // loaded MOG2 background, applied to the new model on the first frame
+    cv::Mat m_small;
+    cv::Mat m_smallMask;
+};
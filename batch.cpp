@@ -0,0 +1,524 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "detection.hpp"
+#include "frame_context.hpp"
+#include "pipeline.hpp"
+#include "tracing.hpp"
+#include "tracker.hpp"
+#include "trajectory_log.hpp"
+#include "work_pool.hpp"
+
+// Batch driver: segments, tracks and logs a whole set of videos (the headless coord
+// processing) with every file getting its own trajectory file. The files are processed
+// concurrently on one work-stealing pool, split into small tasks:
+//   decode   reads frames of one file ahead, while fewer than kInFlight are unfinished
+//   segment  converts, blurs, thresholds, labels and filters one frame
+//   track    runs the tracker and queues the log records of the segmented frames in order
+// Decoding is sequential per file, but the segmentation of its frames is taken by any
+// idle worker, so a long video keeps every core busy once the short ones are done.
+
+struct BatchOptions
+{
+    std::vector<std::string> inputs;
+    std::string outputDir = ".";
+    std::string format = "csv";
+    std::string summaryPath;
+    int threads = 0;
+    int files = 0;
+    int thresholdValue = 132;
+    int blurSize = 7;
+    int minContourSize = 50;
+    int maxContourSize = 10000;
+    int trackGate = 40;
+};
+
+void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options] INPUT...\n"
+              << "  INPUT is a video file, a directory (all videos in it) or a manifest (.txt, one path per\n"
+              << "  line, relative to the manifest, # starts a comment)\n"
+              << "  -o, --output-dir DIR    directory for the trajectory files (default .), existing ones are\n"
+              << "                          replaced\n"
+              << "      --format csv|bin|ptc  trajectory file format (default csv)\n"
+              << "      --summary PATH      write per-file and overall throughput to PATH (JSON or YAML)\n"
+              << "      --threads N         worker threads (default: all cores)\n"
+              << "      --files N           videos open at once (default: half the workers)\n"
+              << "      --threshold N       binary threshold value (0-255)\n"
+              << "      --blur N            Gaussian blur size (odd, 3-15)\n"
+              << "      --min-area N        minimum contour area\n"
+              << "      --max-area N        maximum contour area\n"
+              << "      --track-gate PX     tracking gate in pixels (default 40)\n"
+              << "  -h, --help              show this message\n";
+}
+
+bool parseBatchOptions(int argc, char** argv, BatchOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return false;
+        } else if ((arg == "-o" || arg == "--output-dir") && hasValue) {
+            options.outputDir = argv[++i];
+        } else if (arg == "--format" && hasValue) {
+            options.format = argv[++i];
+        } else if (arg == "--summary" && hasValue) {
+            options.summaryPath = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--files" && hasValue) {
+            options.files = std::atoi(argv[++i]);
+        } else if (arg == "--threshold" && hasValue) {
+            options.thresholdValue = std::atoi(argv[++i]);
+        } else if (arg == "--blur" && hasValue) {
+            options.blurSize = std::atoi(argv[++i]);
+        } else if (arg == "--min-area" && hasValue) {
+            options.minContourSize = std::atoi(argv[++i]);
+        } else if (arg == "--max-area" && hasValue) {
+            options.maxContourSize = std::atoi(argv[++i]);
+        } else if (arg == "--track-gate" && hasValue) {
+            options.trackGate = std::atoi(argv[++i]);
+        } else if (!arg.empty() && arg[0] != '-') {
+            options.inputs.push_back(arg);
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    // Same constraints the blur trackbar callback enforces
+    if (options.blurSize % 2 == 0)
+        ++options.blurSize;
+    if (options.blurSize < 3)
+        options.blurSize = 3;
+
+    if (options.format != "csv" && options.format != "bin" && options.format != "ptc") {
+        std::cout << "Unknown format: " << options.format << std::endl;
+        return false;
+    }
+    if (options.inputs.empty()) {
+        printUsage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+bool isVideoFile(const std::filesystem::path& path)
+{
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    for (const char* known : {".mov", ".mp4", ".m4v", ".avi", ".mkv", ".wmv", ".mpg", ".mpeg"})
+        if (extension == known)
+            return true;
+    return false;
+}
+
+// Add the videos an input names to videos, returns false if it names none
+bool collectVideos(const std::string& input, std::vector<std::string>& videos)
+{
+    namespace fs = std::filesystem;
+    fs::path path(input);
+    std::error_code error;
+    size_t before = videos.size();
+
+    if (fs::is_directory(path, error)) {
+        std::vector<std::string> found;
+        for (const auto& entry : fs::directory_iterator(path, error))
+            if (entry.is_regular_file(error) && isVideoFile(entry.path()))
+                found.push_back(entry.path().string());
+        std::sort(found.begin(), found.end());
+        videos.insert(videos.end(), found.begin(), found.end());
+    } else if (path.extension() == ".txt") {
+        std::ifstream manifest(path);
+        std::string line;
+        while (std::getline(manifest, line)) {
+            line.erase(0, line.find_first_not_of(" \t"));
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (line.empty() || line[0] == '#')
+                continue;
+            fs::path video(line);
+            videos.push_back((video.is_absolute() ? video : path.parent_path() / video).string());
+        }
+    } else {
+        videos.push_back(input);
+    }
+    return videos.size() > before;
+}
+
+// Segmentation parameters of the batch, the stages are the threshold ones of tracing.hpp
+TracingParams tracingParams(const BatchOptions& options)
+{
+    TracingParams params;
+    params.thresholdValue = options.thresholdValue;
+    params.blurSize = options.blurSize;
+    params.minArea = options.minContourSize;
+    params.maxArea = options.maxContourSize;
+    params.trackGate = options.trackGate;
+    return params;
+}
+
+// One video of the batch and where its processing is
+struct BatchFile
+{
+    // Frames decoded ahead of the tracker, frame n lives in jobs[n % kInFlight]
+    static constexpr int kInFlight = 8;
+
+    std::string input;
+    std::string output;
+    std::string error;
+    cv::VideoCapture video;
+    Tracker tracker;
+    TrajectoryLog log;
+    std::vector<FrameJob> jobs;
+    std::vector<char> segmented;
+
+    // Guarded by mutex
+    std::mutex mutex;
+    int decoded = 0;       // frames read
+    int tracked = 0;       // frames tracked and logged, always a prefix of the decoded ones
+    bool decoding = false; // a decode task is queued or running
+    bool draining = false; // a task is tracking the segmented frames
+    bool endOfVideo = false;
+    bool finished = false;
+
+    size_t records = 0;
+    std::chrono::steady_clock::time_point start;
+    double seconds = 0.0;
+
+    double fps() const { return seconds > 0.0 ? tracked / seconds : 0.0; }
+};
+
+// Schedules the decode, segment and track tasks of the batch on the pool, keeping a
+// limited number of files open at once
+class BatchRunner
+{
+public:
+    BatchRunner(const BatchOptions& options, std::vector<std::unique_ptr<BatchFile>>& files, int workers)
+        : m_options(options), m_params(tracingParams(options)), m_files(files), m_pool(workers)
+    {
+    }
+
+    void run(int openFiles)
+    {
+        for (int i = 0; i < openFiles; ++i)
+            startNextFile();
+        m_pool.wait();
+    }
+
+private:
+    // Open the next file that can be opened and queue its first decode
+    void startNextFile()
+    {
+        while (true) {
+            BatchFile* file = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_nextFile >= m_files.size())
+                    return;
+                file = m_files[m_nextFile++].get();
+            }
+
+            if (!file->video.open(file->input)) {
+                file->error = "cannot open video";
+                continue;
+            }
+            if (!file->log.open(file->output)) {
+                file->error = "cannot open " + file->output;
+                file->video.release();
+                continue;
+            }
+
+            file->tracker.setGate(static_cast<float>(m_options.trackGate));
+            file->jobs.resize(BatchFile::kInFlight);
+            file->segmented.assign(BatchFile::kInFlight, 0);
+            file->start = std::chrono::steady_clock::now();
+            file->decoding = true;
+            m_pool.submit([this, file] { decode(*file); });
+            return;
+        }
+    }
+
+    // Read frames until kInFlight of them wait for the tracker, which then queues the
+    // decode again. Only one decode task of a file exists at a time.
+    void decode(BatchFile& file)
+    {
+        while (true) {
+            int n = 0;
+            {
+                std::lock_guard<std::mutex> lock(file.mutex);
+                if (file.decoded - file.tracked >= BatchFile::kInFlight) {
+                    file.decoding = false;
+                    return;
+                }
+                n = file.decoded;
+            }
+
+            FrameJob& job = file.jobs[n % BatchFile::kInFlight];
+            job.context.beginFrame();
+            if (!file.video.read(job.frame)) {
+                bool done = false;
+                {
+                    std::lock_guard<std::mutex> lock(file.mutex);
+                    file.endOfVideo = true;
+                    file.decoding = false;
+                    done = finishedLocked(file);
+                }
+                if (done)
+                    finish(file);
+                return;
+            }
+            job.frameIndex = n;
+            job.positionMsec = file.video.get(cv::CAP_PROP_POS_MSEC);
+            {
+                std::lock_guard<std::mutex> lock(file.mutex);
+                ++file.decoded;
+            }
+            m_pool.submit([this, &file, n] { segment(file, n); });
+        }
+    }
+
+    // Segment one frame, then track it and whatever frames after it are ready, unless
+    // another task is already doing that
+    void segment(BatchFile& file, int n)
+    {
+        FrameJob& job = file.jobs[n % BatchFile::kInFlight];
+        convertToGray(job);
+        segmentThreshold(job.gray, job.context, m_params, m_gate);
+        {
+            std::lock_guard<std::mutex> lock(file.mutex);
+            file.segmented[n % BatchFile::kInFlight] = 1;
+            if (file.draining)
+                return;
+            file.draining = true;
+        }
+        track(file);
+    }
+
+    // Track and log the segmented frames in order, waking the decoder as slots free up
+    void track(BatchFile& file)
+    {
+        while (true) {
+            int n = 0;
+            {
+                std::lock_guard<std::mutex> lock(file.mutex);
+                n = file.tracked;
+                if (n == file.decoded || !file.segmented[n % BatchFile::kInFlight]) {
+                    file.draining = false;
+                    if (!finishedLocked(file))
+                        return;
+                    break;
+                }
+            }
+
+            FrameJob& job = file.jobs[n % BatchFile::kInFlight];
+            file.tracker.update(job.context.detections, n);
+            file.log.log(n, job.positionMsec, job.context.detections);
+
+            bool resumeDecode = false;
+            {
+                std::lock_guard<std::mutex> lock(file.mutex);
+                file.segmented[n % BatchFile::kInFlight] = 0;
+                ++file.tracked;
+                if (!file.decoding && !file.endOfVideo) {
+                    file.decoding = true;
+                    resumeDecode = true;
+                }
+            }
+            if (resumeDecode)
+                m_pool.submit([this, &file] { decode(file); });
+        }
+        finish(file);
+    }
+
+    // True exactly once, when the last frame of the file has been tracked
+    static bool finishedLocked(BatchFile& file)
+    {
+        if (file.finished || !file.endOfVideo || file.draining || file.tracked != file.decoded)
+            return false;
+        file.finished = true;
+        return true;
+    }
+
+    // Flush the trajectory file, free the frame buffers and start the next file
+    void finish(BatchFile& file)
+    {
+        file.records = file.log.records();
+        if (!file.log.close())
+            file.error = "error writing " + file.output;
+        file.video.release();
+        file.jobs = std::vector<FrameJob>();
+        file.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - file.start).count();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!file.error.empty())
+                std::cout << "Failed " << file.input << ": " << file.error << std::endl;
+            else
+                std::cout << "Finished " << file.input << ": " << file.tracked << " frames, " << file.records
+                          << " centroids" << std::endl;
+        }
+        startNextFile();
+    }
+
+    const BatchOptions& m_options;
+    TracingParams m_params;
+    MotionGate m_gate; // never enabled, the whole frame is segmented
+    std::vector<std::unique_ptr<BatchFile>>& m_files;
+    std::mutex m_mutex;
+    size_t m_nextFile = 0;
+    WorkStealingPool m_pool;
+};
+
+// Print the per-file table and the totals, and write them to path if one is given
+bool reportBatch(const std::vector<std::unique_ptr<BatchFile>>& files, double seconds, int workers,
+                 const std::string& path)
+{
+    size_t frames = 0;
+    size_t records = 0;
+    int failed = 0;
+    std::cout << std::left << std::setw(40) << "file" << std::right << std::setw(9) << "frames" << std::setw(12)
+              << "centroids" << std::setw(10) << "seconds" << std::setw(9) << "fps" << std::endl;
+    for (const auto& file : files) {
+        std::string name = std::filesystem::path(file->input).filename().string();
+        std::cout << std::left << std::setw(40) << name.substr(0, 39);
+        if (!file->error.empty()) {
+            std::cout << "  failed: " << file->error << std::endl;
+            ++failed;
+            continue;
+        }
+        frames += file->tracked;
+        records += file->records;
+        std::cout << std::right << std::setw(9) << file->tracked << std::setw(12) << file->records << std::fixed
+                  << std::setprecision(2) << std::setw(10) << file->seconds << std::setprecision(1) << std::setw(9)
+                  << file->fps() << std::endl;
+    }
+    double fps = seconds > 0.0 ? frames / seconds : 0.0;
+    std::cout << "Processed " << files.size() - failed << " of " << files.size() << " files, " << frames
+              << " frames in " << std::setprecision(2) << seconds << " s on " << workers << " threads ("
+              << std::setprecision(1) << fps << " frames/s)" << std::endl;
+
+    if (path.empty())
+        return true;
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+    fs << "threads" << workers;
+    fs << "files" << "[";
+    for (const auto& file : files) {
+        fs << "{" << "input" << file->input << "output" << file->output;
+        if (file->error.empty()) {
+            fs << "frames" << file->tracked << "records" << static_cast<int>(file->records) << "seconds"
+               << file->seconds << "fps" << file->fps();
+        } else {
+            fs << "error" << file->error;
+        }
+        fs << "}";
+    }
+    fs << "]";
+    fs << "frames" << static_cast<int>(frames);
+    fs << "records" << static_cast<int>(records);
+    fs << "seconds" << seconds;
+    fs << "fps" << fps;
+    return true;
+}
+
+// Name the trajectory file of every video after it, in dir. Videos with the same name (from
+// different directories, or differing only in extension) get their extension added and, if
+// that is not enough, a number, so no two of them write the same file. Names are compared
+// ignoring case, for the file systems that do.
+void assignOutputs(std::vector<std::unique_ptr<BatchFile>>& files, const std::string& dir, const std::string& format)
+{
+    namespace fs = std::filesystem;
+    auto key = [](std::string name) {
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return name;
+    };
+    std::map<std::string, int> stems;
+    for (const auto& file : files)
+        ++stems[key(fs::path(file->input).stem().string())];
+
+    std::set<std::string> taken;
+    for (auto& file : files) {
+        fs::path input(file->input);
+        std::string stem = input.stem().string();
+        std::string name = stem;
+        if (stems[key(stem)] > 1 && input.has_extension())
+            name += "_" + input.extension().string().substr(1);
+        std::string unique = name;
+        for (int n = 2; !taken.insert(key(unique)).second; ++n)
+            unique = name + "_" + std::to_string(n);
+        file->output = (fs::path(dir) / unique).string() + "." + format;
+        if (unique != stem)
+            std::cout << "Writing " << file->input << " to " << file->output << ", another video has its name"
+                      << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    BatchOptions options;
+    if (!parseBatchOptions(argc, argv, options))
+        return -1;
+
+    std::vector<std::string> videos;
+    for (const auto& input : options.inputs)
+        if (!collectVideos(input, videos))
+            std::cout << "No videos in " << input << std::endl;
+    if (videos.empty())
+        return -1;
+
+    namespace fs = std::filesystem;
+    std::error_code error;
+    fs::create_directories(options.outputDir, error);
+    std::vector<std::unique_ptr<BatchFile>> files;
+    for (const auto& video : videos) {
+        auto file = std::make_unique<BatchFile>();
+        file->input = video;
+        files.push_back(std::move(file));
+    }
+    assignOutputs(files, options.outputDir, options.format);
+
+    // The pool is the only parallelism; banded segmentation inside every task would only
+    // oversubscribe the cores
+    cv::setNumThreads(1);
+    int workers = pipelineWorkers(options.threads);
+    int openFiles = options.files > 0 ? options.files : std::max(1, workers / 2);
+
+    std::cout << "Processing " << files.size() << " files on " << workers << " threads, " << openFiles
+              << " at a time" << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    try {
+        BatchRunner runner(options, files, workers);
+        runner.run(openFiles);
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!reportBatch(files, seconds, workers, options.summaryPath)) {
+        std::cout << "Error writing " << options.summaryPath << std::endl;
+        return -1;
+    }
+    for (const auto& file : files)
+        if (!file->error.empty())
+            return 1;
+    return 0;
+}
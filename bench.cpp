@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "synthetic.hpp"
+
+// Benchmark harness: renders a deterministic synthetic video, runs each tracing program
+// headless on it with --stats and collects their fps, stage latency percentiles and
+// allocations per frame into one JSON file, so runs of different builds can be compared.
+// The programs must be built next to it (or in --bin-dir).
+
+struct BenchOptions
+{
+    SyntheticSpec spec;
+    std::vector<std::string> programs{"main", "tail", "coord", "nocircle"};
+    std::string binDir = ".";
+    std::string workDir;
+    std::string output = "bench.json";
+    int threads = 0;
+};
+
+void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options]\n"
+              << "      --width N           frame width (default 1280)\n"
+              << "      --height N          frame height (default 720)\n"
+              << "      --frames N          number of frames (default 300)\n"
+              << "      --organisms N       number of organisms (default 50)\n"
+              << "      --length PX         organism length in pixels (default 40)\n"
+              << "      --speed PX          organism speed in pixels per frame (default 2)\n"
+              << "      --noise SIGMA       pixel noise standard deviation (default 4)\n"
+              << "      --seed N            random seed (default 1)\n"
+              << "      --programs LIST     comma separated programs to run (default main,tail,coord,nocircle)\n"
+              << "      --bin-dir DIR       directory of the program binaries (default .)\n"
+              << "      --work-dir DIR      directory for the video and the program outputs (default: temp)\n"
+              << "      --threads N         worker threads passed to the programs\n"
+              << "  -o, --output PATH       results file (default bench.json)\n"
+              << "  -h, --help              show this message\n";
+}
+
+bool parseBenchOptions(int argc, char** argv, BenchOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return false;
+        } else if (arg == "--width" && hasValue) {
+            options.spec.width = std::max(16, std::atoi(argv[++i]));
+        } else if (arg == "--height" && hasValue) {
+            options.spec.height = std::max(16, std::atoi(argv[++i]));
+        } else if (arg == "--frames" && hasValue) {
+            options.spec.frames = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--organisms" && hasValue) {
+            options.spec.organisms = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--length" && hasValue) {
+            options.spec.length = std::atof(argv[++i]);
+        } else if (arg == "--speed" && hasValue) {
+            options.spec.speed = std::atof(argv[++i]);
+        } else if (arg == "--noise" && hasValue) {
+            options.spec.noise = std::atof(argv[++i]);
+        } else if (arg == "--seed" && hasValue) {
+            options.spec.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--programs" && hasValue) {
+            options.programs.clear();
+            std::stringstream list(argv[++i]);
+            std::string program;
+            while (std::getline(list, program, ','))
+                if (!program.empty())
+                    options.programs.push_back(program);
+        } else if (arg == "--bin-dir" && hasValue) {
+            options.binDir = argv[++i];
+        } else if (arg == "--work-dir" && hasValue) {
+            options.workDir = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if ((arg == "-o" || arg == "--output") && hasValue) {
+            options.output = argv[++i];
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string readFile(const std::filesystem::path& path)
+{
+    std::ifstream file(path);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    if (!parseBenchOptions(argc, argv, options))
+        return -1;
+
+    namespace fs = std::filesystem;
+    fs::path workDir = options.workDir.empty() ? fs::temp_directory_path() / "paramecium-bench"
+                                               : fs::path(options.workDir);
+    fs::create_directories(workDir);
+
+    const SyntheticSpec& spec = options.spec;
+    fs::path video = workDir / "synthetic.avi";
+    std::cout << "Rendering " << spec.frames << " frames of " << spec.width << "x" << spec.height << " with "
+              << spec.organisms << " organisms to " << video.string() << std::endl;
+    if (!writeSyntheticVideo(video.string(), spec)) {
+        std::cout << "Error writing " << video.string() << std::endl;
+        return -1;
+    }
+
+    std::cout << std::left << std::setw(10) << "program" << std::right << std::setw(9) << "fps" << std::setw(13)
+              << "heap/frame" << "  " << std::left << std::setw(12) << "stage" << std::right << std::setw(9) << "p50 ms"
+              << std::setw(10) << "p99 ms" << std::endl;
+    std::vector<std::string> reports;
+    bool allPassed = true;
+    for (const auto& program : options.programs) {
+        fs::path stats = workDir / (program + ".json");
+        fs::remove(stats);
+        std::stringstream command;
+        command << '"' << (fs::path(options.binDir) / program).string() << "\" --headless -i \"" << video.string()
+                << "\" -o \"" << (workDir / (program + ".csv")).string() << "\" --stats \"" << stats.string() << '"';
+        if (options.threads > 0)
+            command << " --threads " << options.threads;
+        command << " > \"" << (workDir / (program + ".log")).string() << "\" 2>&1";
+
+        cv::FileStorage report;
+        if (std::system(command.str().c_str()) != 0 || !report.open(stats.string(), cv::FileStorage::READ)) {
+            std::cout << std::left << std::setw(10) << program << "  failed, see "
+                      << (workDir / (program + ".log")).string() << std::endl;
+            allPassed = false;
+            continue;
+        }
+        reports.push_back(readFile(stats));
+
+        std::cout << std::left << std::setw(10) << program << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(9) << static_cast<double>(report["fps"]) << std::setw(13)
+                  << static_cast<double>(report["heap_allocations_per_frame"]) << std::endl;
+        cv::FileNode stages = report["stages"];
+        for (auto it = stages.begin(); it != stages.end(); ++it) {
+            const cv::FileNode& stage = *it;
+            std::cout << std::string(34, ' ') << std::left << std::setw(12) << static_cast<std::string>(stage["name"])
+                      << std::right << std::setprecision(3) << std::setw(9) << static_cast<double>(stage["p50_ms"])
+                      << std::setw(10) << static_cast<double>(stage["p99_ms"]) << std::endl;
+        }
+    }
+
+    // The per-program reports are JSON objects already, embed them as they are
+    std::ofstream output(options.output);
+    if (!output.is_open()) {
+        std::cout << "Error opening " << options.output << std::endl;
+        return -1;
+    }
+    output << "{\n  \"spec\": {\"width\": " << spec.width << ", \"height\": " << spec.height << ", \"frames\": "
+           << spec.frames << ", \"fps\": " << spec.fps << ", \"organisms\": " << spec.organisms
+           << ", \"length\": " << spec.length << ", \"speed\": " << spec.speed << ", \"noise\": " << spec.noise
+           << ", \"seed\": " << spec.seed << "},\n  \"runs\": [\n";
+    for (size_t i = 0; i < reports.size(); ++i)
+        output << reports[i] << (i + 1 < reports.size() ? ",\n" : "\n");
+    output << "  ]\n}\n";
+    std::cout << "Results written to " << options.output << std::endl;
+
+    return allPassed ? 0 : 1;
+}
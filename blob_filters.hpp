@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "blobs.hpp"
+
+// Blob acceptance filters, composed at compile time into one specialized loop per chain.
+//
+// Every filter has a cost tier (kCost). Tier 0 filters only read the columns of a BlobTable
+// (float arrays of area and bounding box size) and are evaluated for all blobs in a single
+// branch-free loop that the compiler can vectorize. The higher tiers look at the shape of a
+// blob, its runs or its outline, and only run on the blobs all cheaper filters accepted:
+// tier by tier, each filter dropping the blobs it rejects from the candidates. So a chain
+// always runs cheapest first and stops at the first filter that rejects a blob, whatever
+// order the filters are listed in; within a tier they run in the order given.
+//
+//   tier 0  AreaFilter, BoxFilter   table columns
+//   tier 1  AspectRatioFilter       minimum area rectangle of the run ends
+//   tier 2  SolidityFilter          convex hull of the run corners
+//   tier 3  CircularityFilter       traced outline
+
+// The blob statistics the tier 0 filters read, one array per column
+struct BlobTable
+{
+    std::vector<float> area;
+    std::vector<float> width;
+    std::vector<float> height;
+
+    size_t size() const { return area.size(); }
+
+    void assign(const std::vector<Blob>& blobs)
+    {
+        size_t count = blobs.size();
+        area.resize(count);
+        width.resize(count);
+        height.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            area[i] = static_cast<float>(blobs[i].area);
+            width[i] = static_cast<float>(blobs[i].bbox.width);
+            height[i] = static_cast<float>(blobs[i].bbox.height);
+        }
+    }
+
+    size_t capacity() const { return area.capacity() + width.capacity() + height.capacity(); }
+};
+
+// Buffers of a filter chain, kept from frame to frame
+struct FilterScratch
+{
+    BlobTable table;
+    std::vector<uint8_t> keep;
+    std::vector<int> candidates; // the blobs accepted so far, in ascending order
+    std::vector<cv::Point> points;
+    std::vector<cv::Point> hull;
+    std::vector<cv::Point> outline;
+
+    size_t capacity() const
+    {
+        return table.capacity() + keep.capacity() + candidates.capacity() + points.capacity() + hull.capacity() +
+               outline.capacity();
+    }
+};
+
+// Area strictly between minArea and maxArea, no upper limit if maxArea is 0
+struct AreaFilter
+{
+    static constexpr int kCost = 0;
+    float minArea;
+    float maxArea;
+
+    bool operator()(const BlobTable& table, size_t i) const
+    {
+        // & rather than && keeps the loop free of branches
+        return (table.area[i] > minArea) & ((maxArea <= 0.0f) | (table.area[i] < maxArea));
+    }
+};
+
+// Both bounding box sides in [minSide, maxSide], no upper limit if maxSide is 0
+struct BoxFilter
+{
+    static constexpr int kCost = 0;
+    float minSide;
+    float maxSide;
+
+    bool operator()(const BlobTable& table, size_t i) const
+    {
+        float shorter = std::min(table.width[i], table.height[i]);
+        float longer = std::max(table.width[i], table.height[i]);
+        return (shorter >= minSide) & ((maxSide <= 0.0f) | (longer <= maxSide));
+    }
+};
+
+// Elongated blobs: the aspect ratio of their minimum area rectangle differs from 1 by more
+// than threshold
+struct AspectRatioFilter
+{
+    static constexpr int kCost = 1;
+    double threshold;
+
+    bool operator()(const Blob& blob, BlobScratch& blobs, FilterScratch& scratch) const
+    {
+        // The run end points have the same convex hull as the outline
+        blobEndPoints(blob, blobs, scratch.points);
+        cv::Size2f size = cv::minAreaRect(scratch.points).size;
+        double aspectRatio = size.width / size.height;
+        return aspectRatio < 1.0 - threshold || aspectRatio > 1.0 + threshold;
+    }
+};
+
+// Solid blobs: the pixel count is at least minSolidity of the area of the convex hull. The
+// hull goes around the pixel corners, so a convex blob has a solidity close to 1.
+struct SolidityFilter
+{
+    static constexpr int kCost = 2;
+    double minSolidity;
+
+    bool operator()(const Blob& blob, BlobScratch& blobs, FilterScratch& scratch) const
+    {
+        scratch.points.clear();
+        for (int i = blob.firstRun; i >= 0; i = blobs.runs[i].next) {
+            const BlobRun& run = blobs.runs[i];
+            scratch.points.emplace_back(run.x0, run.y);
+            scratch.points.emplace_back(run.x1, run.y);
+            scratch.points.emplace_back(run.x0, run.y + 1);
+            scratch.points.emplace_back(run.x1, run.y + 1);
+        }
+        cv::convexHull(scratch.points, scratch.hull);
+        double hullArea = cv::contourArea(scratch.hull);
+        return hullArea > 0.0 && blob.area >= minSolidity * hullArea;
+    }
+};
+
+// Round blobs: 4 pi area / perimeter^2 of the outline is at least minCircularity (1 for a
+// circle, lower the more ragged or elongated)
+struct CircularityFilter
+{
+    static constexpr int kCost = 3;
+    double minCircularity;
+
+    bool operator()(const Blob& blob, BlobScratch& blobs, FilterScratch& scratch) const
+    {
+        traceBlobOutline(blob, blobs, scratch.outline);
+        double perimeter = cv::arcLength(scratch.outline, true);
+        if (perimeter <= 0.0)
+            return false;
+        return 4.0 * CV_PI * cv::contourArea(scratch.outline) >= minCircularity * perimeter * perimeter;
+    }
+};
+
+namespace filter_chain
+{
+    template <typename Filter>
+    inline bool testColumns(const Filter& filter, const BlobTable& table, size_t i)
+    {
+        if constexpr (Filter::kCost == 0)
+            return filter(table, i);
+        else
+            return true;
+    }
+
+    // Drop the candidates filter rejects, if it is in tier Tier
+    template <int Tier, typename Filter>
+    inline void testShapes(const Filter& filter, const std::vector<Blob>& blobs, BlobScratch& blobScratch,
+                           FilterScratch& scratch)
+    {
+        static_assert(Filter::kCost >= 0 && Filter::kCost <= 3, "filter tiers are 0 to 3");
+        if constexpr (Filter::kCost == Tier) {
+            std::vector<int>& candidates = scratch.candidates;
+            size_t kept = 0;
+            for (int index : candidates) {
+                if (filter(blobs[index], blobScratch, scratch))
+                    candidates[kept++] = index;
+            }
+            candidates.resize(kept);
+        }
+    }
+}
+
+// Run the filters over blobs, leaving the indices of the blobs all of them accept in
+// scratch.candidates (in ascending order). blobScratch must be the one blobs were
+// labelled with.
+template <typename... Filters>
+void runFilterChain(const std::vector<Blob>& blobs, BlobScratch& blobScratch, FilterScratch& scratch,
+                    const Filters&... filters)
+{
+    BlobTable& table = scratch.table;
+    table.assign(blobs);
+    size_t count = table.size();
+    scratch.keep.resize(count);
+    uint8_t* keep = scratch.keep.data();
+    for (size_t i = 0; i < count; ++i)
+        keep[i] = static_cast<uint8_t>((true & ... & filter_chain::testColumns(filters, table, i)));
+
+    scratch.candidates.clear();
+    for (size_t i = 0; i < count; ++i) {
+        if (keep[i])
+            scratch.candidates.push_back(static_cast<int>(i));
+    }
+
+    (filter_chain::testShapes<1>(filters, blobs, blobScratch, scratch), ...);
+    (filter_chain::testShapes<2>(filters, blobs, blobScratch, scratch), ...);
+    (filter_chain::testShapes<3>(filters, blobs, blobScratch, scratch), ...);
+}
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLOBS_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Connected components of a binary mask, found in one pass over its rows.
+//
+// Every row is cut into runs of non-zero pixels and each run is joined (union-find) with
+// the runs of the row above that touch it, 8-connected like cv::findContours. Area,
+// bounding box and moments are then summed per run in closed form, so apart from finding
+// the runs (and weighing them, when labelling with the gray frame) nothing is done per
+// pixel. Outlines are only traced on demand, for the components that are kept.
+//
+// Large masks can be cut into horizontal bands that are labelled in parallel; the runs on
+// either side of each seam are then joined the same way. A root is always the lowest run
+// index of its component and the bands are concatenated in row order, so the result is
+// the same as labelling the whole mask at once.
+
+// Pixels [x0, x1) of row y, next is the following run of the same blob or -1. weight and
+// weightX are the sums of 255 - gray level and of that times x over the run's pixels, when
+// the mask is labelled together with its gray frame.
+struct BlobRun
+{
+    int y;
+    int x0;
+    int x1;
+    int next;
+    int64_t weight;
+    int64_t weightX;
+};
+
+// One connected component
+struct Blob
+{
+    int area = 0; // pixel count
+    cv::Rect bbox;
+    int firstRun = -1;
+
+    // Raw moments of the pixel coordinates (exact, the sums stay well below 2^53)
+    double sumX = 0.0;
+    double sumY = 0.0;
+    double sumXX = 0.0;
+    double sumXY = 0.0;
+    double sumYY = 0.0;
+
+    // Sums of the pixel weights (255 - gray level, so the darkest pixels count most) and of
+    // the weighted coordinates, zero unless labelled with the gray frame
+    double weight = 0.0;
+    double weightX = 0.0;
+    double weightY = 0.0;
+
+    cv::Point2d centroid() const { return cv::Point2d(sumX / area, sumY / area); }
+
+    // Sub-pixel centroid weighted by darkness, the plain centroid without weights
+    cv::Point2f weightedCentroid() const
+    {
+        if (weight <= 0.0)
+            return cv::Point2f(centroid());
+        return cv::Point2f(static_cast<float>(weightX / weight), static_cast<float>(weightY / weight));
+    }
+
+    // Central second-order moments divided by the area (the pixel covariance)
+    void covariance(double& xx, double& xy, double& yy) const
+    {
+        cv::Point2d c = centroid();
+        xx = sumXX / area - c.x * c.x;
+        xy = sumXY / area - c.x * c.y;
+        yy = sumYY / area - c.y * c.y;
+    }
+};
+
+// Runs of one band of rows, with parent indices local to the band
+struct BlobBand
+{
+    std::vector<BlobRun> runs;
+    std::vector<int> parent;
+};
+
+// Buffers reused between frames
+struct BlobScratch
+{
+    std::vector<BlobRun> runs;
+    std::vector<int> parent;
+    std::vector<uint8_t> canvas;
+    std::vector<std::vector<cv::Point>> outlines;
+    std::vector<BlobBand> bands;
+
+    size_t capacity() const
+    {
+        size_t total = runs.capacity() + parent.capacity() + canvas.capacity() + bands.capacity();
+        for (const auto& band : bands)
+            total += band.runs.capacity() + band.parent.capacity();
+        return total;
+    }
+};
+
+// Root of a run, halving the path on the way
+inline int findBlobRoot(std::vector<int>& parent, int run)
+{
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+// Index of the lowest set bit, bits must not be 0
+inline int lowestBit(uint64_t bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+// Bit i set if p[i] != 0, for the count (at most 64) pixels from p
+inline uint64_t nonZeroBits(const uint8_t* p, int count)
+{
+    uint64_t bits = 0;
+    int i = 0;
+#if defined(BLOBS_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), zero));
+        bits |= static_cast<uint64_t>(~zeros & 0xffff) << i;
+    }
+#endif
+    for (; i < count; ++i)
+        bits |= static_cast<uint64_t>(p[i] != 0) << i;
+    return bits;
+}
+
+// Append the runs of non-zero pixels of one row. The row is read 64 pixels at a time as a
+// bit mask, so the cost goes with the number of runs rather than the number of pixels.
+inline void findRuns(const uint8_t* row, int y, int cols, std::vector<BlobRun>& runs, std::vector<int>& parent)
+{
+    bool inside = false;
+    int start = 0;
+    for (int x = 0; x < cols; x += 64) {
+        uint64_t bits = nonZeroBits(row + x, std::min(64, cols - x));
+        uint64_t edges = bits ^ ((bits << 1) | (inside ? 1 : 0));
+        while (edges != 0) {
+            int edge = x + lowestBit(edges);
+            edges &= edges - 1;
+            if (inside) {
+                runs.push_back({y, start, edge, -1, 0, 0});
+                parent.push_back(static_cast<int>(parent.size()));
+            } else {
+                start = edge;
+            }
+            inside = !inside;
+        }
+    }
+    if (inside) {
+        runs.push_back({y, start, cols, -1, 0, 0});
+        parent.push_back(static_cast<int>(parent.size()));
+    }
+}
+
+// Sum the darkness weights of the runs [begin, end) over their pixels of a gray row.
+// Organism runs are a few dozen pixels, so a plain loop is all this needs.
+inline void weighRuns(const uint8_t* gray, std::vector<BlobRun>& runs, int begin, int end)
+{
+    for (int r = begin; r < end; ++r) {
+        BlobRun& run = runs[r];
+        int64_t weight = 0;
+        int64_t weightX = 0;
+        for (int x = run.x0; x < run.x1; ++x) {
+            int w = 255 - gray[x];
+            weight += w;
+            weightX += w * x;
+        }
+        run.weight = weight;
+        run.weightX = weightX;
+    }
+}
+
+// 0^2 + 1^2 + ... + n^2
+inline int64_t sumOfSquares(int64_t n)
+{
+    return n * (n + 1) * (2 * n + 1) / 6;
+}
+
+// Join the runs [begin, end) of a row with the touching runs [previousBegin, previousEnd)
+// of the row above, keeping the lower index as the root
+inline void joinRuns(const std::vector<BlobRun>& runs, std::vector<int>& parent, int previousBegin, int previousEnd,
+                     int begin, int end)
+{
+    // Runs of the row above touch [x0, x1) if they overlap [x0 - 1, x1 + 1)
+    int p = previousBegin;
+    for (int c = begin; c < end; ++c) {
+        while (p < previousEnd && runs[p].x1 < runs[c].x0)
+            ++p;
+        // Join c to the root of every run it touches. c may already have been joined
+        // across a seam, so start from its own root.
+        int root = findBlobRoot(parent, c);
+        int q = p;
+        for (; q < previousEnd && runs[q].x0 <= runs[c].x1; ++q) {
+            int other = findBlobRoot(parent, q);
+            if (other < root) {
+                parent[root] = other;
+                root = other;
+            } else if (other > root) {
+                parent[other] = root;
+            }
+        }
+        // The last run touched may reach the next run of this row as well
+        if (q > p)
+            p = q - 1;
+    }
+}
+
+// Find and join the runs of rows [rowBegin, rowEnd) of mask, appending them to runs and
+// parent (indices relative to the start of runs). With a gray frame the runs are weighed
+// as they are found, in the same (possibly parallel) pass.
+inline void findBlobRuns(const cv::Mat& mask, int rowBegin, int rowEnd, std::vector<BlobRun>& runs,
+                         std::vector<int>& parent, const cv::Mat& gray)
+{
+    int previousBegin = 0;
+    int previousEnd = 0;
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        int begin = static_cast<int>(runs.size());
+        findRuns(mask.ptr<uint8_t>(y), y, mask.cols, runs, parent);
+        int end = static_cast<int>(runs.size());
+        if (!gray.empty())
+            weighRuns(gray.ptr<uint8_t>(y), runs, begin, end);
+        joinRuns(runs, parent, previousBegin, previousEnd, begin, end);
+        previousBegin = begin;
+        previousEnd = end;
+    }
+}
+
+// Turn the joined runs of the scratch into blobs, in raster order of their first pixel
+inline void collectBlobs(std::vector<Blob>& blobs, BlobScratch& scratch)
+{
+    std::vector<BlobRun>& runs = scratch.runs;
+    std::vector<int>& parent = scratch.parent;
+    blobs.clear();
+
+    // A run's parent always has a lower index, so one forward pass points every run at its
+    // root. The roots then get their blob index, stored as -1 - index to tell it apart.
+    int runCount = static_cast<int>(runs.size());
+    for (int i = 0; i < runCount; ++i)
+        parent[i] = parent[parent[i]];
+    for (int i = 0; i < runCount; ++i) {
+        if (parent[i] == i) {
+            parent[i] = -1 - static_cast<int>(blobs.size());
+            blobs.emplace_back();
+        } else {
+            parent[i] = parent[parent[i]];
+        }
+        int index = -1 - parent[i];
+
+        const BlobRun& run = runs[i];
+        Blob& blob = blobs[index];
+        int64_t n = run.x1 - run.x0;
+        int64_t first = run.x0;
+        int64_t last = run.x1 - 1;
+        double y = run.y;
+        double sumX = static_cast<double>(n * (first + last) / 2);
+        double sumXX = static_cast<double>(sumOfSquares(last) - sumOfSquares(first - 1));
+        blob.sumX += sumX;
+        blob.sumY += n * y;
+        blob.sumXX += sumXX;
+        blob.sumXY += y * sumX;
+        blob.sumYY += n * y * y;
+        blob.weight += static_cast<double>(run.weight);
+        blob.weightX += static_cast<double>(run.weightX);
+        blob.weightY += static_cast<double>(run.weight) * y;
+        // Runs come in row order, so only the horizontal extent needs a min / max
+        if (blob.area == 0) {
+            blob.bbox = cv::Rect(run.x0, run.y, run.x1 - run.x0, 1);
+        } else {
+            int right = std::max(blob.bbox.x + blob.bbox.width, run.x1);
+            blob.bbox.x = std::min(blob.bbox.x, run.x0);
+            blob.bbox.width = right - blob.bbox.x;
+            blob.bbox.height = run.y - blob.bbox.y + 1;
+        }
+        blob.area += static_cast<int>(n);
+    }
+
+    // Chain the runs of each blob, in row order
+    for (int i = runCount - 1; i >= 0; --i) {
+        int index = -1 - parent[i];
+        runs[i].next = blobs[index].firstRun;
+        blobs[index].firstRun = i;
+    }
+}
+
+// Label the connected components of an 8-bit mask and fill blobs with their statistics,
+// in raster order of their first pixel. gray, if given, is the frame the mask came from;
+// the blobs then also get the darkness weights for weightedCentroid().
+inline void extractBlobs(const cv::Mat& mask, std::vector<Blob>& blobs, BlobScratch& scratch,
+                         const cv::Mat& gray = cv::Mat())
+{
+    CV_Assert(mask.type() == CV_8UC1);
+    CV_Assert(gray.empty() || (gray.type() == CV_8UC1 && gray.size() == mask.size()));
+    scratch.runs.clear();
+    scratch.parent.clear();
+    findBlobRuns(mask, 0, mask.rows, scratch.runs, scratch.parent, gray);
+    collectBlobs(blobs, scratch);
+}
+
+// Same result as extractBlobs, with the runs of bandCount horizontal bands found and joined
+// in parallel (cv::parallel_for_) before the seams between them are joined
+inline void extractBlobs(const cv::Mat& mask, std::vector<Blob>& blobs, BlobScratch& scratch, int bandCount,
+                         const cv::Mat& gray = cv::Mat())
+{
+    CV_Assert(mask.type() == CV_8UC1);
+    CV_Assert(gray.empty() || (gray.type() == CV_8UC1 && gray.size() == mask.size()));
+    bandCount = std::max(1, std::min(bandCount, mask.rows));
+    if (bandCount == 1) {
+        extractBlobs(mask, blobs, scratch, gray);
+        return;
+    }
+
+    if (scratch.bands.size() < static_cast<size_t>(bandCount))
+        scratch.bands.resize(bandCount);
+    auto bandRow = [&](int band) { return static_cast<int>(static_cast<int64_t>(mask.rows) * band / bandCount); };
+    cv::parallel_for_(cv::Range(0, bandCount), [&](const cv::Range& range) {
+        for (int b = range.start; b < range.end; ++b) {
+            BlobBand& band = scratch.bands[b];
+            band.runs.clear();
+            band.parent.clear();
+            findBlobRuns(mask, bandRow(b), bandRow(b + 1), band.runs, band.parent, gray);
+        }
+    });
+
+    // Concatenate the bands in row order, shifting their parent indices
+    std::vector<BlobRun>& runs = scratch.runs;
+    std::vector<int>& parent = scratch.parent;
+    runs.clear();
+    parent.clear();
+    for (int b = 0; b < bandCount; ++b) {
+        const BlobBand& band = scratch.bands[b];
+        int offset = static_cast<int>(runs.size());
+        runs.insert(runs.end(), band.runs.begin(), band.runs.end());
+        for (int p : band.parent)
+            parent.push_back(p + offset);
+
+        // Join the first row of this band with the last row of the previous one
+        if (offset > 0 && !band.runs.empty() && band.runs.front().y == bandRow(b)) {
+            int previousEnd = offset;
+            int previousBegin = previousEnd;
+            while (previousBegin > 0 && runs[previousBegin - 1].y == bandRow(b) - 1)
+                --previousBegin;
+            int end = offset;
+            while (end < static_cast<int>(runs.size()) && runs[end].y == bandRow(b))
+                ++end;
+            joinRuns(runs, parent, previousBegin, previousEnd, offset, end);
+        }
+    }
+
+    collectBlobs(blobs, scratch);
+}
+
+// Both ends of every run of a blob. They have the same convex hull as the blob's outline,
+// so e.g. cv::minAreaRect gives the same result without tracing it.
+inline void blobEndPoints(const Blob& blob, const BlobScratch& scratch, std::vector<cv::Point>& points)
+{
+    points.clear();
+    for (int i = blob.firstRun; i >= 0; i = scratch.runs[i].next) {
+        const BlobRun& run = scratch.runs[i];
+        points.emplace_back(run.x0, run.y);
+        if (run.x1 - 1 > run.x0)
+            points.emplace_back(run.x1 - 1, run.y);
+    }
+}
+
+// Outer contour of a blob in image coordinates, as cv::findContours would trace it with
+// RETR_EXTERNAL and CHAIN_APPROX_SIMPLE. Only the blob's own runs are drawn, so other
+// blobs inside its bounding box do not interfere.
+inline void traceBlobOutline(const Blob& blob, BlobScratch& scratch, std::vector<cv::Point>& outline)
+{
+    // One pixel of margin around the bounding box
+    int width = blob.bbox.width + 2;
+    int height = blob.bbox.height + 2;
+    if (scratch.canvas.size() < static_cast<size_t>(width * height))
+        scratch.canvas.resize(width * height);
+    cv::Mat canvas(height, width, CV_8UC1, scratch.canvas.data());
+    canvas.setTo(0);
+    for (int i = blob.firstRun; i >= 0; i = scratch.runs[i].next) {
+        const BlobRun& run = scratch.runs[i];
+        std::memset(canvas.ptr<uint8_t>(run.y - blob.bbox.y + 1) + run.x0 - blob.bbox.x + 1, 255, run.x1 - run.x0);
+    }
+
+    cv::findContours(canvas, scratch.outlines, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE,
+                     cv::Point(blob.bbox.x - 1, blob.bbox.y - 1));
+    if (scratch.outlines.empty())
+        outline.clear();
+    else
+        outline.assign(scratch.outlines[0].begin(), scratch.outlines[0].end());
+}
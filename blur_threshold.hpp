@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLUR_THRESHOLD_SSE2 1
+#endif
+
+// Fused Gaussian blur + threshold for 8-bit grayscale frames.
+//
+// cv::GaussianBlur on CV_8U with sigma 0 is computed in fixed point: the horizontal pass
+// sums kernel (8 fractional bits) times pixel into 16 bits, the vertical pass sums kernel
+// times those into 32 bits, and the result is rounded with (sum + 2^15) >> 16. The same
+// arithmetic is done here on strips of rows, so the output is bit-exact with the OpenCV
+// two-call path. For the threshold the rounding is folded into the comparison, so the
+// blurred frame is never written:
+//   ((sum + 2^15) >> 16) > t   <=>   sum >= ((t + 1) << 16) - 2^15
+
+// Scratch rows reused between calls
+struct BlurScratch
+{
+    std::vector<int16_t> rows;
+    std::vector<uint8_t> padded;
+
+    size_t capacity() const { return rows.capacity() + padded.capacity(); }
+};
+
+// Fixed-point kernels cv::GaussianBlur uses for 8-bit images with sigma 0, ksize 3..15
+inline const uint16_t* fixedGaussianKernel(int ksize)
+{
+    static const uint16_t k3[] = {64, 128, 64};
+    static const uint16_t k5[] = {16, 64, 96, 64, 16};
+    static const uint16_t k7[] = {8, 28, 56, 72, 56, 28, 8};
+    static const uint16_t k9[] = {4, 13, 30, 51, 60, 51, 30, 13, 4};
+    static const uint16_t k11[] = {2, 7, 17, 31, 45, 52, 45, 31, 17, 7, 2};
+    static const uint16_t k13[] = {1, 5, 10, 19, 30, 41, 44, 41, 30, 19, 10, 5, 1};
+    static const uint16_t k15[] = {1, 3, 6, 12, 20, 30, 36, 40, 36, 30, 20, 12, 6, 3, 1};
+    static const uint16_t* const kernels[] = {k3, k5, k7, k9, k11, k13, k15};
+
+    if (ksize < 3 || ksize > 15 || ksize % 2 == 0)
+        return nullptr;
+    return kernels[(ksize - 3) / 2];
+}
+
+// BORDER_REFLECT_101 index, same as cv::borderInterpolate
+inline int reflect101(int p, int len)
+{
+    if (len == 1)
+        return 0;
+    while (p < 0 || p >= len)
+        p = p < 0 ? -p : 2 * len - 2 - p;
+    return p;
+}
+
+// The horizontal sums (at most 255 * 256) are stored minus 2^15 so they fit in int16 and
+// the vertical pass can use signed 16x16->32 multiply-adds. The kernel sums to 256, so the
+// vertical sum comes out exactly 2^23 low, which the outputs add back.
+const int32_t kBlurRowBias = 32768;
+const int32_t kBlurSumBias = kBlurRowBias * 256;
+
+// Output of the fused kernel: threshold (THRESH_BINARY or THRESH_BINARY_INV, maxval 255) or
+// the blurred pixel. Both take the biased vertical sum.
+struct ThresholdOutput
+{
+    int32_t limit;
+    uint8_t flip; // 0xff for THRESH_BINARY_INV
+
+    ThresholdOutput(int thresh, bool inverse)
+        : limit((std::min(std::max(thresh, -1), 255) + 1) * 65536 - 32768 - kBlurSumBias),
+          flip(inverse ? 0xff : 0) {}
+    uint8_t operator()(int32_t sum) const { return (sum >= limit ? 255 : 0) ^ flip; }
+};
+
+struct BlurOutput
+{
+    uint8_t operator()(int32_t sum) const { return static_cast<uint8_t>((sum + kBlurSumBias + 32768) >> 16); }
+};
+
+// Horizontal pass of one row, writing width biased 16-bit sums. src points at the pixel
+// ksize / 2 left of the first output column. The kernel is symmetric, so mirrored pixels
+// are added before multiplying (2 * 255 * 128 still fits in 16 bits).
+inline void blurRowHorizontal(const uint8_t* src, int16_t* dst, int width, const uint16_t* kernel, int ksize)
+{
+    const int radius = ksize / 2;
+    int x = 0;
+#if defined(__AVX2__)
+    __m256i taps[8];
+    for (int i = 0; i <= radius; ++i)
+        taps[i] = _mm256_set1_epi16(static_cast<short>(kernel[i]));
+    const __m256i bias = _mm256_set1_epi16(static_cast<short>(0x8000));
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t* p = src + x;
+        __m256i sum = _mm256_mullo_epi16(
+            _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + radius))), taps[radius]);
+        for (int i = 0; i < radius; ++i) {
+            __m256i left = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)));
+            __m256i right = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + ksize - 1 - i)));
+            sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(_mm256_add_epi16(left, right), taps[i]));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_xor_si256(sum, bias));
+    }
+#elif defined(BLUR_THRESHOLD_SSE2)
+    __m128i taps[8];
+    for (int i = 0; i <= radius; ++i)
+        taps[i] = _mm_set1_epi16(static_cast<short>(kernel[i]));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t* p = src + x;
+        __m128i center = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + radius));
+        __m128i sumLo = _mm_mullo_epi16(_mm_unpacklo_epi8(center, zero), taps[radius]);
+        __m128i sumHi = _mm_mullo_epi16(_mm_unpackhi_epi8(center, zero), taps[radius]);
+        for (int i = 0; i < radius; ++i) {
+            __m128i left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + ksize - 1 - i));
+            __m128i pairLo = _mm_add_epi16(_mm_unpacklo_epi8(left, zero), _mm_unpacklo_epi8(right, zero));
+            __m128i pairHi = _mm_add_epi16(_mm_unpackhi_epi8(left, zero), _mm_unpackhi_epi8(right, zero));
+            sumLo = _mm_add_epi16(sumLo, _mm_mullo_epi16(pairLo, taps[i]));
+            sumHi = _mm_add_epi16(sumHi, _mm_mullo_epi16(pairHi, taps[i]));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_xor_si128(sumLo, bias));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x + 8), _mm_xor_si128(sumHi, bias));
+    }
+#endif
+    for (; x < width; ++x) {
+        int32_t sum = kernel[radius] * src[x + radius];
+        for (int i = 0; i < radius; ++i)
+            sum += kernel[i] * (src[x + i] + src[x + ksize - 1 - i]);
+        dst[x] = static_cast<int16_t>(sum - kBlurRowBias);
+    }
+}
+
+// Vertical pass over ksize rows of horizontal sums, writing width output pixels. Mirrored
+// rows are interleaved and multiplied by the shared tap with one multiply-add.
+template <typename Output>
+void blurRowVertical(const int16_t* const* rows, uint8_t* dst, int width, const uint16_t* kernel, int ksize,
+                     const Output& output)
+{
+    const int radius = ksize / 2;
+    int x = 0;
+#if defined(__AVX2__)
+    __m256i taps[8];
+    for (int j = 0; j < radius; ++j)
+        taps[j] = _mm256_set1_epi32(kernel[j] | (kernel[j] << 16));
+    taps[radius] = _mm256_set1_epi32(kernel[radius]);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; x + 16 <= width; x += 16) {
+        __m256i center = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[radius] + x));
+        __m256i sumA = _mm256_madd_epi16(_mm256_unpacklo_epi16(center, zero), taps[radius]);
+        __m256i sumB = _mm256_madd_epi16(_mm256_unpackhi_epi16(center, zero), taps[radius]);
+        for (int j = 0; j < radius; ++j) {
+            __m256i top = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[j] + x));
+            __m256i bottom = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[ksize - 1 - j] + x));
+            sumA = _mm256_add_epi32(sumA, _mm256_madd_epi16(_mm256_unpacklo_epi16(top, bottom), taps[j]));
+            sumB = _mm256_add_epi32(sumB, _mm256_madd_epi16(_mm256_unpackhi_epi16(top, bottom), taps[j]));
+        }
+        __m128i bytes;
+        if constexpr (std::is_same<Output, ThresholdOutput>::value) {
+            __m256i limit = _mm256_set1_epi32(output.limit - 1);
+            __m256i packed = _mm256_packs_epi32(_mm256_cmpgt_epi32(sumA, limit), _mm256_cmpgt_epi32(sumB, limit));
+            packed = _mm256_xor_si256(packed, _mm256_set1_epi8(static_cast<char>(output.flip)));
+            bytes = _mm_packs_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+        } else {
+            __m256i round = _mm256_set1_epi32(kBlurSumBias + 32768);
+            sumA = _mm256_srli_epi32(_mm256_add_epi32(sumA, round), 16);
+            sumB = _mm256_srli_epi32(_mm256_add_epi32(sumB, round), 16);
+            __m256i packed = _mm256_packs_epi32(sumA, sumB);
+            bytes = _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), bytes);
+    }
+#elif defined(BLUR_THRESHOLD_SSE2)
+    __m128i taps[8];
+    for (int j = 0; j < radius; ++j)
+        taps[j] = _mm_set1_epi32(kernel[j] | (kernel[j] << 16));
+    taps[radius] = _mm_set1_epi32(kernel[radius]);
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= width; x += 8) {
+        __m128i center = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[radius] + x));
+        __m128i sumA = _mm_madd_epi16(_mm_unpacklo_epi16(center, zero), taps[radius]);
+        __m128i sumB = _mm_madd_epi16(_mm_unpackhi_epi16(center, zero), taps[radius]);
+        for (int j = 0; j < radius; ++j) {
+            __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[j] + x));
+            __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[ksize - 1 - j] + x));
+            sumA = _mm_add_epi32(sumA, _mm_madd_epi16(_mm_unpacklo_epi16(top, bottom), taps[j]));
+            sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_unpackhi_epi16(top, bottom), taps[j]));
+        }
+        __m128i bytes;
+        if constexpr (std::is_same<Output, ThresholdOutput>::value) {
+            __m128i limit = _mm_set1_epi32(output.limit - 1);
+            __m128i packed = _mm_packs_epi32(_mm_cmpgt_epi32(sumA, limit), _mm_cmpgt_epi32(sumB, limit));
+            bytes = _mm_xor_si128(_mm_packs_epi16(packed, packed), _mm_set1_epi8(static_cast<char>(output.flip)));
+        } else {
+            __m128i round = _mm_set1_epi32(kBlurSumBias + 32768);
+            sumA = _mm_srli_epi32(_mm_add_epi32(sumA, round), 16);
+            sumB = _mm_srli_epi32(_mm_add_epi32(sumB, round), 16);
+            __m128i packed = _mm_packs_epi32(sumA, sumB);
+            bytes = _mm_packus_epi16(packed, packed);
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), bytes);
+    }
+#endif
+    for (; x < width; ++x) {
+        int32_t sum = kernel[radius] * rows[radius][x];
+        for (int j = 0; j < radius; ++j)
+            sum += kernel[j] * (rows[j][x] + rows[ksize - 1 - j][x]);
+        dst[x] = output(sum);
+    }
+}
+
+// Blur the pixels of roi (in image coordinates) and write output(sum) for each of them.
+// Pixels outside roi are read as blur support, with BORDER_REFLECT_101 at the image edges,
+// so the roi comes out exactly as it would from a full-frame call.
+// Columns are processed in blocks so the ksize rows of horizontal sums stay in cache.
+template <typename Output>
+void blurRegion(const uint8_t* src, size_t srcStep, int rows, int cols, uint8_t* dst, size_t dstStep,
+                int ksize, cv::Rect roi, const Output& output, BlurScratch& scratch)
+{
+    const uint16_t* kernel = fixedGaussianKernel(ksize);
+    const int radius = ksize / 2;
+    const int blockWidth = 2048;
+
+    roi &= cv::Rect(0, 0, cols, rows);
+    if (roi.width <= 0 || roi.height <= 0)
+        return;
+
+    int bufferWidth = std::min(blockWidth, roi.width);
+    if (scratch.rows.size() < static_cast<size_t>(ksize * bufferWidth))
+        scratch.rows.resize(ksize * bufferWidth);
+    if (scratch.padded.size() < static_cast<size_t>(bufferWidth + 2 * radius))
+        scratch.padded.resize(bufferWidth + 2 * radius);
+
+    const int16_t* window[15];
+
+    for (int x0 = roi.x; x0 < roi.x + roi.width; x0 += blockWidth) {
+        int width = std::min(blockWidth, roi.x + roi.width - x0);
+        int left = x0 - radius;
+        int right = x0 + width + radius;
+        bool interior = left >= 0 && right <= cols;
+
+        // Horizontal sums of source row reflect101(v), stored in slot v mod ksize. At the
+        // image edges the row is copied with its reflected border first.
+        auto horizontal = [&](int v) {
+            const uint8_t* row = src + reflect101(v, rows) * srcStep;
+            const uint8_t* start = row + left;
+            if (!interior) {
+                uint8_t* padded = scratch.padded.data();
+                int begin = std::max(left, 0);
+                int end = std::min(right, cols);
+                for (int i = left; i < begin; ++i)
+                    padded[i - left] = row[reflect101(i, cols)];
+                std::memcpy(padded + begin - left, row + begin, end - begin);
+                for (int i = end; i < right; ++i)
+                    padded[i - left] = row[reflect101(i, cols)];
+                start = padded;
+            }
+            int slot = ((v % ksize) + ksize) % ksize;
+            blurRowHorizontal(start, scratch.rows.data() + slot * bufferWidth, width, kernel, ksize);
+        };
+
+        for (int v = roi.y - radius; v < roi.y + radius; ++v)
+            horizontal(v);
+
+        for (int y = roi.y; y < roi.y + roi.height; ++y) {
+            horizontal(y + radius);
+            int slot = (((y - radius) % ksize) + ksize) % ksize;
+            for (int j = 0; j < ksize; ++j) {
+                window[j] = scratch.rows.data() + slot * bufferWidth;
+                if (++slot == ksize)
+                    slot = 0;
+            }
+            blurRowVertical(window, dst + y * dstStep + x0, width, kernel, ksize, output);
+        }
+    }
+}
+
+// dst = threshold(GaussianBlur(src, ksize x ksize, 0), thresh, 255, type) for the pixels
+// inside roi, type being cv::THRESH_BINARY or cv::THRESH_BINARY_INV. dst must already be
+// allocated with the size of src.
+inline void gaussianBlurThreshold(const cv::Mat& src, cv::Mat& dst, int ksize, int thresh, int type,
+                                  const cv::Rect& roi, BlurScratch& scratch)
+{
+    CV_Assert(src.type() == CV_8UC1 && dst.type() == CV_8UC1 && dst.size() == src.size());
+    CV_Assert(type == cv::THRESH_BINARY || type == cv::THRESH_BINARY_INV);
+    if (!fixedGaussianKernel(ksize)) {
+        cv::Mat blurred;
+        cv::GaussianBlur(src, blurred, cv::Size(ksize, ksize), 0);
+        cv::threshold(blurred(roi), dst(roi), thresh, 255, type);
+        return;
+    }
+    blurRegion(src.data, src.step, src.rows, src.cols, dst.data, dst.step, ksize, roi,
+               ThresholdOutput(thresh, type == cv::THRESH_BINARY_INV), scratch);
+}
+
+// Whole-frame version, same result as cv::GaussianBlur followed by cv::threshold
+inline void gaussianBlurThreshold(const cv::Mat& src, cv::Mat& dst, int ksize, int thresh, int type,
+                                  BlurScratch& scratch)
+{
+    dst.create(src.size(), CV_8UC1);
+    gaussianBlurThreshold(src, dst, ksize, thresh, type, cv::Rect(0, 0, src.cols, src.rows), scratch);
+}
+
+// The blurred frame on its own, bit-exact with cv::GaussianBlur(src, dst, Size(ksize, ksize), 0)
+inline void gaussianBlur8u(const cv::Mat& src, cv::Mat& dst, int ksize, BlurScratch& scratch)
+{
+    CV_Assert(src.type() == CV_8UC1);
+    if (!fixedGaussianKernel(ksize)) {
+        cv::GaussianBlur(src, dst, cv::Size(ksize, ksize), 0);
+        return;
+    }
+    dst.create(src.size(), CV_8UC1);
+    blurRegion(src.data, src.step, src.rows, src.cols, dst.data, dst.step, ksize, cv::Rect(0, 0, src.cols, src.rows),
+               BlurOutput(), scratch);
+}
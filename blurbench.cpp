@@ -0,0 +1,86 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <opencv2/opencv.hpp>
+#include "blur_threshold.hpp"
+
+// Micro-benchmark of the fused blur + threshold against cv::GaussianBlur followed by
+// cv::threshold, for every blur size the trackbar allows. Also checks that both give the
+// same mask. Uses the first frame of the input video, or a synthetic frame if there is none.
+
+template <typename Fn>
+double millisecondsPerCall(int iterations, Fn&& fn)
+{
+    fn(); // warm up buffers and caches
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    std::string input = "./peak_procedure.mov";
+    int iterations = 200;
+    int thresholdValue = 132;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            thresholdValue = std::atoi(argv[++i]);
+        } else if (arg == "-h" || arg == "--help") {
+            std::cout << "Usage: " << argv[0] << " [--iterations N] [--threshold N] [input]" << std::endl;
+            return 0;
+        } else {
+            input = arg;
+        }
+    }
+
+    cv::Mat frame;
+    cv::VideoCapture video(input);
+    if (video.isOpened())
+        video.read(frame);
+    cv::Mat gray;
+    if (frame.empty()) {
+        std::cout << "Could not read " << input << ", using a synthetic 1920x1080 frame" << std::endl;
+        gray.create(1080, 1920, CV_8UC1);
+        cv::randu(gray, 0, 256);
+        cv::GaussianBlur(gray, gray, cv::Size(9, 9), 0);
+    } else {
+        cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    }
+
+    // The fused kernel runs on one thread, compare it with single-threaded OpenCV
+    cv::setNumThreads(1);
+
+    std::cout << "Frame " << gray.cols << "x" << gray.rows << ", threshold " << thresholdValue << ", "
+              << iterations << " iterations" << std::endl;
+    std::cout << "ksize   opencv ms   fused ms   speedup   exact" << std::endl;
+
+    cv::Mat blurred, reference, fused, difference;
+    BlurScratch scratch;
+    bool allExact = true;
+    for (int ksize = 3; ksize <= 15; ksize += 2) {
+        double opencvTime = millisecondsPerCall(iterations, [&] {
+            cv::GaussianBlur(gray, blurred, cv::Size(ksize, ksize), 0);
+            cv::threshold(blurred, reference, thresholdValue, 255, cv::THRESH_BINARY_INV);
+        });
+        double fusedTime = millisecondsPerCall(iterations, [&] {
+            gaussianBlurThreshold(gray, fused, ksize, thresholdValue, cv::THRESH_BINARY_INV, scratch);
+        });
+
+        cv::compare(reference, fused, difference, cv::CMP_NE);
+        bool exact = cv::countNonZero(difference) == 0;
+        allExact = allExact && exact;
+
+        std::cout << std::setw(5) << ksize << std::fixed << std::setprecision(3) << std::setw(12) << opencvTime
+                  << std::setw(11) << fusedTime << std::setprecision(2) << std::setw(9) << opencvTime / fusedTime
+                  << "x" << std::setw(8) << (exact ? "yes" : "NO") << std::endl;
+    }
+
+    return allExact ? 0 : 1;
+}
@@ -1,203 +1,186 @@
 #include <iostream>
-#include <fstream>
 #include <opencv2/opencv.hpp>
+#include "alloc_counter.hpp"
+#include "detection.hpp"
+#include "options.hpp"
+#include "pipeline.hpp"
+#include "track_analytics.hpp"
+#include "tracing.hpp"
+#include "tracker.hpp"
+#include "trajectory_log.hpp"
+
+// Segments like main, gives the detections persistent track IDs and logs their centroids.
+// The stages and the display are in tracing.hpp, this is the front end.
 
-// Global variables
-cv::Mat g_frame;
-cv::Mat g_thresholded;
-cv::Mat g_contourImage;
-cv::Mat g_outlinesImage;
-int g_thresholdValue = 132;
-int g_blurSize = 7;
-int g_fgMaskBlurSize = 13;
-int g_minContourSize = 50;
-int g_maxContourSize = 10000;
-int g_centroidID = 1;
-int g_mouseX = 0;
-int g_mouseY = 0;
-
-// Background Subtraction variables
-cv::Ptr<cv::BackgroundSubtractor> g_backgroundSubtractor;
-
-// Log file
-std::ofstream g_logFile;
-
-// Vector to store centroids
-std::vector<cv::Point> g_centroids;
-
-// Variables for time calculation
-double g_videoStartTime = 0.0;
-double g_frameDuration = 0.0;
-
-// Function to threshold the image and find contours
-void processImage()
+// Callback function for key events
+void onKey(int key, TrajectoryLog& log)
 {
-    cv::Mat blurred;
-    cv::GaussianBlur(g_frame, blurred, cv::Size(g_blurSize, g_blurSize), 0);
-
-    cv::threshold(blurred, g_thresholded, g_thresholdValue, 255, cv::THRESH_BINARY_INV);
-
-    std::vector<std::vector<cv::Point>> contours;
-    cv::findContours(g_thresholded, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
-
-    g_contourImage = cv::Mat::zeros(g_frame.size(), CV_8UC3);
-    cv::Scalar contourColor = cv::Scalar(0, 165, 255);
-    cv::Scalar centroidColor = cv::Scalar(0, 0, 255);
-
-    cv::cvtColor(g_frame, g_outlinesImage, cv::COLOR_GRAY2BGR);
-
-    for (const auto& contour : contours) {
-        if ((cv::contourArea(contour) > g_minContourSize) && (cv::contourArea(contour) < g_maxContourSize)) {
-            cv::Scalar color = cv::Scalar(rand() % 256, rand() % 256, rand() % 256);
-            cv::drawContours(g_contourImage, std::vector<std::vector<cv::Point>>{contour}, -1, color, cv::FILLED);
-
-            cv::drawContours(g_outlinesImage, std::vector<std::vector<cv::Point>>{contour}, -1, contourColor, 2);
-
-            cv::Moments moments = cv::moments(contour);
-            cv::Point centroid(moments.m10 / moments.m00, moments.m01 / moments.m00);
-
-            cv::circle(g_outlinesImage, centroid, 3, centroidColor, cv::FILLED);
-
-            if (g_logFile.is_open()) {
-                double timestamp = (cv::getTickCount() - g_videoStartTime) / cv::getTickFrequency();
-                int minutes = static_cast<int>(timestamp / 60);
-                int seconds = static_cast<int>(timestamp) % 60;
-
-                g_logFile << g_centroidID << ", " << centroid.x << ", " << centroid.y << ", "
-                          << minutes << ":" << seconds << std::endl;
-
-                std::cout << "Centroid logged: ID=" << g_centroidID << ", X=" << centroid.x << ", Y=" << centroid.y
-                          << ", Time=" << minutes << ":" << seconds << std::endl;
-
-                g_centroidID++;
+    if (key == 's') {
+        if (log.isOpen()) {
+            if (log.close())
+                std::cout << "Log file closed." << std::endl;
+            else
+                std::cout << "Error writing log.csv, the log is incomplete!" << std::endl;
+        } else {
+            if (log.open("log.csv", WriteMode::Append, true)) {
+                std::cout << "Log file opened." << std::endl;
+            } else {
+                std::cout << "Error opening log file!" << std::endl;
             }
         }
     }
-
-    cv::Mat result;
-    cv::cvtColor(g_frame, result, cv::COLOR_GRAY2BGR);
-    cv::addWeighted(result, 0.5, g_contourImage, 0.5, 0.0, result);
-
-    cv::imshow("Segmented Image", result);
-    cv::imshow("Threshold", g_thresholded);
-    cv::imshow("marked", g_outlinesImage);
-}
-
-// Callback function for the threshold trackbar
-void onThresholdChange(int, void*)
-{
-    processImage();
-}
-
-// Callback function for the blur trackbar
-void onBlurSizeChange(int, void*)
-{
-    if (g_blurSize % 2 == 0)
-        ++g_blurSize;
-
-    if (g_blurSize < 3)
-        g_blurSize = 3;
-
-    cv::setTrackbarPos("Blur Size", "Segmented Image", g_blurSize);
-    processImage();
 }
 
-// Callback function for the foreground mask blur trackbar
-void onFgMaskBlurSizeChange(int, void*)
+// Headless: the tracer's stages are followed by tracking, which needs the frames in order so
+// it gets a single worker, and the centroids go to the trajectory log (binary if the output
+// file ends in .bin, CSV otherwise) in frame order.
+int runHeadless(PacedSource& source, Tracer& tracer, TrackAnalytics& analytics, const Options& options)
 {
-    if (g_fgMaskBlurSize % 2 == 0)
-        ++g_fgMaskBlurSize;
-
-    if (g_fgMaskBlurSize < 3)
-        g_fgMaskBlurSize = 3;
+    TrajectoryLog log;
+    if (!log.open(options.output)) {
+        std::cout << "Error opening log file!" << std::endl;
+        return -1;
+    }
 
-    cv::setTrackbarPos("Foreground Mask Blur Size", "Segmented Image", g_fgMaskBlurSize);
-    processImage();
+    HeadlessHooks hooks;
+    hooks.addStages = [&](Pipeline<FrameJob>& pipeline) {
+        pipeline.addStage("track", [&](FrameJob& job) {
+            tracer.track(job.context.detections, job.frameIndex, job.positionMsec);
+            analytics.update(job.context.detections, job.frameIndex);
+            analytics.tick();
+        }, 1);
+    };
+    hooks.write = [&](const FrameJob& job) { log.log(job.frameIndex, job.positionMsec, job.context.detections); };
+    hooks.finish = [&] {
+        size_t logged = log.records();
+        bool written = log.close();
+        analytics.close();
+        if (!written) {
+            std::cout << "Error writing " << options.output << ", the log is incomplete!" << std::endl;
+            return false;
+        }
+        std::cout << "Logged " << logged << " centroids" << std::endl;
+        return true;
+    };
+    return runHeadless("coord", source, tracer, headlessSettings(options), hooks);
 }
 
-// Callback function for the minimum contour size trackbar
-void onMinContourSizeChange(int, void*)
+int main(int argc, char** argv)
 {
-    processImage();
-}
+    Options options;
+    if (!parseOptions(argc, argv, options))
+        return -1;
 
-void onMaxContourSize(int, void*)
-{
-    processImage();
-}
+    TracingParams params = tracingParams(options);
+    params.tracking = true;
+    Tracer tracer(params);
+    configureMetrics(options.metricsPath, options.metricsInterval);
+    if (!configureMotionGate(tracer.gate, options))
+        return -1;
 
-// Mouse callback function
-void onMouse(int event, int x, int y, int flags, void* userdata)
-{
-    if (event == cv::EVENT_MOUSEMOVE) {
-        g_mouseX = x;
-        g_mouseY = y;
+    // The video file, replayed in real time or a camera with --source
+    PacedSource source;
+    if (!source.open(options.input, options.sourceMode)) {
+        std::cout << "Error opening video file!" << std::endl;
+        return -1;
     }
-}
-
-// Callback function for key events
-void onKey(int key)
-{
-    if (key == 's') {
-        if (g_logFile.is_open()) {
-            g_logFile.close();
-            std::cout << "Log file closed." << std::endl;
-        } else {
-            g_logFile.open("log.csv", std::ios::app);
-            if (g_logFile.is_open()) {
-                std::cout << "Log file opened." << std::endl;
-                g_logFile << "ID, X, Y, Time" << std::endl;
-                g_videoStartTime = cv::getTickCount();
-            } else {
-                std::cout << "Error opening log file!" << std::endl;
-            }
-        }
+    cv::VideoCapture& video = source.video();
+
+    // Speed, MSD and turning angle statistics of the tracks (--analytics)
+    TrackAnalytics analytics;
+    if (!options.analyticsPath.empty()) {
+        double videoFps = video.get(cv::CAP_PROP_FPS);
+        analytics.configure(1000.0 / (videoFps > 0.0 ? videoFps : 30.0), tracer.tracker.maxMissed() + 1,
+                            options.analyticsPath, options.analyticsInterval);
     }
-}
 
-int main()
-{
-    g_backgroundSubtractor = cv::createBackgroundSubtractorMOG2();
-    cv::VideoCapture video("./peak_procedure.mov");
+    if (options.headless)
+        return runHeadless(source, tracer, analytics, options);
 
-    if (!video.isOpened()) {
-        std::cout << "Error opening video file!" << std::endl;
+    if (!parseOverlayViews(options.views, tracer.views)) {
+        std::cout << "Unknown view in " << options.views << std::endl;
         return -1;
     }
 
+    // The trackbar callbacks invalidate these stages, so build them first
+    tracer.buildView([&tracer] { showSegmentation(tracer, true); });
+
     cv::namedWindow("Video", cv::WINDOW_NORMAL);
-    cv::namedWindow("Segmented Image", cv::WINDOW_NORMAL);
+    cv::namedWindow(tracer.window, cv::WINDOW_NORMAL);
 
-    cv::createTrackbar("Threshold", "Segmented Image", &g_thresholdValue, 255, onThresholdChange);
-    cv::createTrackbar("Blur Size", "Segmented Image", &g_blurSize, 15, onBlurSizeChange);
-    cv::createTrackbar("Foreground Mask Blur Size", "Segmented Image", &g_fgMaskBlurSize, 15,
-                       onFgMaskBlurSizeChange);
-    cv::createTrackbar("Minimum Contour Size", "Segmented Image", &g_minContourSize, 500, onMinContourSizeChange);
-    cv::createTrackbar("Maximum Contour Size", "Segmented Image", &g_maxContourSize, 40000, onMaxContourSize);
+    TracingParams& p = tracer.params;
+    cv::createTrackbar("Threshold", tracer.window, &p.thresholdValue, 255, onThresholdTrackbar, &tracer);
+    cv::createTrackbar("Blur Size", tracer.window, &p.blurSize, 15, onBlurTrackbar, &tracer);
+    cv::createTrackbar("Foreground Mask Blur Size", tracer.window, &p.fgMaskBlurSize, 15, onFgMaskBlurTrackbar,
+                       &tracer);
+    cv::createTrackbar("Minimum Contour Size", tracer.window, &p.minArea, 500, onFilterTrackbar, &tracer);
+    cv::createTrackbar("Maximum Contour Size", tracer.window, &p.maxArea, 40000, onFilterTrackbar, &tracer);
+    cv::createTrackbar("Track Gate", tracer.window, &p.trackGate, 200, onTrackGateTrackbar, &tracer);
 
-    g_backgroundSubtractor = cv::createBackgroundSubtractorMOG2();
+    // Trajectory log, written on its own thread; s starts and stops it
+    TrajectoryLog log;
 
-    cv::setMouseCallback("Segmented Image", onMouse);
+    // Decoded frames go to their own buffer so neither it nor the gray frame is reallocated
+    cv::Mat decoded;
+    cv::Mat frame;
 
-    while (true) {
-        if (!video.read(g_frame))
-            break;
+    // Frame period of the video, to count the frames the loop is too slow for
+    double fps = video.get(cv::CAP_PROP_FPS);
+    double frameMsec = 1000.0 / (fps > 0.0 ? fps : 30.0);
+
+    bool paused = false;
+    int frameIndex = -1;
 
-        cv::cvtColor(g_frame, g_frame, cv::COLOR_BGR2GRAY);
+    while (true) {
+        METRICS_STOPWATCH(watch);
+        bool newFrame = !paused;
+        if (newFrame) {
+            double position;
+            std::chrono::steady_clock::time_point captureTime;
+            if (!source.read(decoded, frameIndex, position, captureTime))
+                break;
+            METRICS_FRAME(frameMsec);
+
+            cv::cvtColor(decoded, frame, cv::COLOR_BGR2GRAY);
+            tracer.setFrame(frame, frameIndex, position);
+            cv::imshow("Video", frame);
+        }
+        METRICS_LAP(watch, "read");
 
-        processImage();
+        // Re-run whatever the new frame or the trackbars invalidated
+        tracer.update();
+        METRICS_LAP(watch, "stages");
 
-        cv::imshow("Video", g_frame);
+        // Each frame is logged once, tuning on a paused frame does not log it again
+        if (newFrame) {
+            log.log(tracer.frameIndex(), tracer.frameTime(), tracer.context.detections);
+            analytics.update(tracer.context.detections, tracer.frameIndex());
+        }
+        analytics.tick();
+        METRICS_LAP(watch, "log");
 
         int key = cv::waitKey(1) & 0xFF;
+        METRICS_LAP(watch, "wait_key");
         if (key == 27) // ESC key
             break;
+        if (key == ' ') // Space pauses on the current frame
+            paused = !paused;
+        if (key == 'm') // m shows or hides the metrics overlay
+            toggleMetricsOverlay();
+
+        onKey(key, log);
 
-        onKey(key);
+        METRICS_TICK();
     }
 
+    bool written = log.close();
+    analytics.close();
     video.release();
     cv::destroyAllWindows();
 
+    if (!written) {
+        std::cout << "Error writing log.csv, the log is incomplete!" << std::endl;
+        return -1;
+    }
     return 0;
 }
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// A blob that passed the size filters
+struct Detection
+{
+    cv::Point2f centroid;  // intensity-weighted, sub-pixel
+    double area = 0.0;     // pixel count
+    int contourIndex = -1; // index into the frame's contour list, once outlines are built
+    int blobIndex = -1;    // index into the frame's blobs
+    int trackId = -1;      // persistent ID assigned by the tracker
+};
+
+// Write one CSV row per detection of a frame
+inline void writeDetections(std::ostream& output, int frameIndex, const std::vector<Detection>& detections)
+{
+    for (const auto& detection : detections) {
+        output << frameIndex << ", " << detection.centroid.x << ", " << detection.centroid.y << ", "
+               << detection.area << '\n';
+    }
+}
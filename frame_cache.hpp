@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Decoded grayscale frames of a video by index, for seeking and replaying in the viewers.
+//
+// Frames are kept in memory up to a byte budget, dropping the least recently used one
+// first. With a spill file, dropped frames are written there as PNG (lossless) and read
+// back from it instead of being decoded again. The file keeps its index across runs, so
+// re-analysing a video reads it from the file.
+//
+// The spill file is a 32-byte header, "PFCC" followed by the version, frame width, height
+// and the frame count of the video as uint32 and 12 bytes of zeros, then one record per
+// frame: int32 frame index, uint32 PNG size and the PNG. Every record decodes on its own,
+// so each one is a keyframe and the index of all of them is rebuilt by walking the records
+// at open. A file made for a video of another size or length is started over.
+class FrameCache
+{
+public:
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kHeaderSize = 32;
+
+    FrameCache() = default;
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+
+    // Serve the frames of video, keeping up to memoryBytes of them decoded. Dropped frames
+    // go to spillPath if it is not empty. Returns false if the spill file can't be opened.
+    bool open(cv::VideoCapture& video, size_t memoryBytes, const std::string& spillPath = std::string())
+    {
+        m_video = &video;
+        m_memoryBytes = memoryBytes;
+        m_frames.clear();
+        m_order.clear();
+        m_spillIndex.clear();
+        m_bytes = 0;
+        m_hits = m_spillReads = m_decodes = 0;
+        m_nextDecode = static_cast<int>(video.get(cv::CAP_PROP_POS_FRAMES));
+        m_frameCount = static_cast<int>(video.get(cv::CAP_PROP_FRAME_COUNT));
+        m_size = cv::Size(static_cast<int>(video.get(cv::CAP_PROP_FRAME_WIDTH)),
+                          static_cast<int>(video.get(cv::CAP_PROP_FRAME_HEIGHT)));
+        if (m_spill.is_open())
+            m_spill.close();
+        return spillPath.empty() || openSpill(spillPath);
+    }
+
+    // Frames in the video, 0 if the container doesn't say. Corrected once the end is read.
+    int frameCount() const { return m_frameCount; }
+
+    // Put frame index into gray, sharing the cached buffer, so gray must not be written to.
+    // Returns false past the end of the video.
+    bool read(int index, cv::Mat& gray)
+    {
+        if (index < 0 || (m_frameCount > 0 && index >= m_frameCount))
+            return false;
+
+        auto it = m_frames.find(index);
+        if (it != m_frames.end()) {
+            m_order.splice(m_order.begin(), m_order, it->second.position);
+            gray = it->second.frame;
+            ++m_hits;
+            return true;
+        }
+
+        cv::Mat frame;
+        if (readSpill(index, frame)) {
+            ++m_spillReads;
+        } else if (!decode(index, frame)) {
+            return false;
+        }
+        insert(index, frame);
+        gray = frame;
+        return true;
+    }
+
+    size_t hits() const { return m_hits; }
+    size_t spillReads() const { return m_spillReads; }
+    size_t decodes() const { return m_decodes; }
+    size_t memoryFrames() const { return m_frames.size(); }
+    size_t spilledFrames() const { return m_spillIndex.size(); }
+
+private:
+    // Frames read and dropped to reach a frame a little ahead rather than seeking, which
+    // restarts decoding at the previous keyframe of the video
+    static constexpr int kMaxReadAhead = 16;
+
+    struct Entry
+    {
+        cv::Mat frame;
+        std::list<int>::iterator position;
+    };
+
+    struct SpillRecord
+    {
+        std::streamoff offset;
+        uint32_t size;
+    };
+
+    bool decode(int index, cv::Mat& frame)
+    {
+        if (index < m_nextDecode || index > m_nextDecode + kMaxReadAhead) {
+            m_video->set(cv::CAP_PROP_POS_FRAMES, index);
+            m_nextDecode = index;
+        }
+        while (m_nextDecode <= index) {
+            if (!m_video->read(m_decoded)) {
+                // Ran off the end, now the real frame count is known
+                m_frameCount = m_nextDecode;
+                return false;
+            }
+            ++m_decodes;
+            cv::Mat gray;
+            cv::cvtColor(m_decoded, gray, cv::COLOR_BGR2GRAY);
+            if (m_nextDecode == index)
+                frame = gray;
+            else if (m_frames.find(m_nextDecode) == m_frames.end())
+                insert(m_nextDecode, gray);
+            ++m_nextDecode;
+        }
+        return true;
+    }
+
+    void insert(int index, const cv::Mat& frame)
+    {
+        m_order.push_front(index);
+        m_frames[index] = Entry{frame, m_order.begin()};
+        m_bytes += frame.total() * frame.elemSize();
+
+        // Always keep the frame just added
+        while (m_bytes > m_memoryBytes && m_order.size() > 1) {
+            int oldest = m_order.back();
+            auto it = m_frames.find(oldest);
+            writeSpill(oldest, it->second.frame);
+            m_bytes -= it->second.frame.total() * it->second.frame.elemSize();
+            m_frames.erase(it);
+            m_order.pop_back();
+        }
+    }
+
+    bool openSpill(const std::string& path)
+    {
+        uint32_t expected[4] = {kVersion, static_cast<uint32_t>(m_size.width), static_cast<uint32_t>(m_size.height),
+                                static_cast<uint32_t>(std::max(m_frameCount, 0))};
+        char header[kHeaderSize] = {};
+        bool reuse = false;
+        {
+            std::ifstream existing(path, std::ios::binary);
+            if (existing.read(header, kHeaderSize))
+                reuse = std::memcmp(header, "PFCC", 4) == 0 && std::memcmp(header + 4, expected, sizeof(expected)) == 0;
+        }
+
+        if (reuse) {
+            m_spill.open(path, std::ios::in | std::ios::out | std::ios::binary);
+            if (!m_spill.is_open())
+                return false;
+            // Index every complete record, a record cut short by a crash is overwritten
+            std::streamoff length = m_spill.seekg(0, std::ios::end).tellg();
+            std::streamoff offset = kHeaderSize;
+            int32_t fields[2];
+            while (offset + 8 <= length) {
+                m_spill.seekg(offset);
+                if (!m_spill.read(reinterpret_cast<char*>(fields), sizeof(fields)))
+                    break;
+                std::streamoff end = offset + 8 + static_cast<uint32_t>(fields[1]);
+                if (end > length)
+                    break;
+                m_spillIndex[fields[0]] = SpillRecord{offset + 8, static_cast<uint32_t>(fields[1])};
+                offset = end;
+            }
+            m_spill.clear();
+            m_spillEnd = offset;
+            return true;
+        }
+
+        m_spill.open(path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!m_spill.is_open())
+            return false;
+        std::memcpy(header, "PFCC", 4);
+        std::memcpy(header + 4, expected, sizeof(expected));
+        std::memset(header + 4 + sizeof(expected), 0, kHeaderSize - 4 - sizeof(expected));
+        m_spill.write(header, kHeaderSize);
+        m_spillEnd = kHeaderSize;
+        return static_cast<bool>(m_spill);
+    }
+
+    bool readSpill(int index, cv::Mat& frame)
+    {
+        auto it = m_spillIndex.find(index);
+        if (it == m_spillIndex.end())
+            return false;
+        m_png.resize(it->second.size);
+        m_spill.seekg(it->second.offset);
+        if (!m_spill.read(reinterpret_cast<char*>(m_png.data()), it->second.size)) {
+            m_spill.clear();
+            return false;
+        }
+        frame = cv::imdecode(m_png, cv::IMREAD_GRAYSCALE);
+        return !frame.empty();
+    }
+
+    void writeSpill(int index, const cv::Mat& frame)
+    {
+        if (!m_spill.is_open() || m_spillIndex.count(index))
+            return;
+        // Fastest zlib level, the frames are written during playback
+        if (!cv::imencode(".png", frame, m_png, {cv::IMWRITE_PNG_COMPRESSION, 1}))
+            return;
+        int32_t fields[2] = {index, static_cast<int32_t>(m_png.size())};
+        m_spill.seekp(m_spillEnd);
+        m_spill.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+        m_spill.write(reinterpret_cast<const char*>(m_png.data()), static_cast<std::streamsize>(m_png.size()));
+        if (!m_spill) {
+            m_spill.clear();
+            return;
+        }
+        m_spillIndex[index] = SpillRecord{m_spillEnd + 8, static_cast<uint32_t>(m_png.size())};
+        m_spillEnd += 8 + static_cast<std::streamoff>(m_png.size());
+    }
+
+    cv::VideoCapture* m_video = nullptr;
+    cv::Size m_size;
+    int m_frameCount = 0;
+    int m_nextDecode = 0;
+    cv::Mat m_decoded;
+
+    // Decoded frames, most recently used first in m_order
+    size_t m_memoryBytes = 0;
+    size_t m_bytes = 0;
+    std::unordered_map<int, Entry> m_frames;
+    std::list<int> m_order;
+
+    std::fstream m_spill;
+    std::streamoff m_spillEnd = 0;
+    std::unordered_map<int, SpillRecord> m_spillIndex;
+    std::vector<uchar> m_png;
+
+    size_t m_hits = 0;
+    size_t m_spillReads = 0;
+    size_t m_decodes = 0;
+};
+
+// Position of a viewer in a cached video: plays forward, pauses, steps, seeks and loops over
+// a range of frames. Keys: space pauses, ',' and '.' step back and forward (pausing), '['
+// and ']' set the start and end of the loop at the current frame, '\' clears the loop.
+class FramePlayer
+{
+public:
+    // Index of the frame to show in this iteration, frame() when it stays the same. Past the
+    // end of the video the cache read fails: playback is over, a step just stays put.
+    int next()
+    {
+        if (m_seek >= 0) {
+            int target = m_seek;
+            m_seek = -1;
+            return target;
+        }
+        if (m_paused && m_frame >= 0)
+            return m_frame;
+        int target = m_frame + 1;
+        if (looping() && (target > m_loopEnd || target < m_loopBegin))
+            target = m_loopBegin;
+        return target;
+    }
+
+    // The frame next() returned was read and shown
+    void shown(int frame) { m_frame = frame; }
+
+    int frame() const { return m_frame; }
+    bool paused() const { return m_paused; }
+    bool looping() const { return m_loopBegin >= 0 && m_loopEnd >= m_loopBegin; }
+
+    void seek(int frame) { m_seek = std::max(frame, 0); }
+
+    // Handle a playback key, returns false for other keys
+    bool handleKey(int key)
+    {
+        switch (key) {
+        case ' ':
+            m_paused = !m_paused;
+            return true;
+        case ',':
+            m_paused = true;
+            seek(m_frame - 1);
+            return true;
+        case '.':
+            m_paused = true;
+            seek(m_frame + 1);
+            return true;
+        case '[':
+            m_loopBegin = m_frame;
+            return true;
+        case ']':
+            m_loopEnd = m_frame;
+            return true;
+        case '\\':
+            m_loopBegin = m_loopEnd = -1;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+private:
+    int m_frame = -1;
+    int m_seek = -1;
+    bool m_paused = false;
+    int m_loopBegin = -1;
+    int m_loopEnd = -1;
+};
+
+// Callback of a frame trackbar driving player (passed as data), also called when playback
+// moves it
+inline void onSeekFrame(int position, void* data)
+{
+    FramePlayer* player = static_cast<FramePlayer*>(data);
+    if (position != player->frame())
+        player->seek(position);
+}
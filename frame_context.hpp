@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "blob_filters.hpp"
+#include "blobs.hpp"
+#include "blur_threshold.hpp"
+#include "detection.hpp"
+#include "metrics.hpp"
+#include "pyramid.hpp"
+
+// Buffers reused from frame to frame by the segmentation and drawing code. Every buffer
+// is sized on first use and then kept, so once the frame size and the number of blobs
+// have settled a frame is processed without (re)allocating any of them.
+struct FrameContext
+{
+    cv::Mat blurred;
+    cv::Mat foreground;
+    cv::Mat thresholded;
+    cv::Mat kernel;
+    BlurScratch blurScratch;
+    std::vector<BlurScratch> bandBlurScratch; // one per band, see bandCount()
+    std::vector<Blob> blobs;
+    BlobScratch blobScratch;
+    FilterScratch filterScratch;
+    std::vector<Detection> detections;
+
+    // Parts of the frame to segment when gating (see MotionGate), and the parts of
+    // thresholded the last regional blurThreshold() wrote, which the next one clears
+    std::vector<cv::Rect> regions;
+    std::vector<cv::Rect> maskRegions;
+
+    PyramidScratch pyramid; // downscaled pass of pyramidSegment()
+
+    // Drawing buffers, only used when displaying (see overlay.hpp). contours holds the
+    // outlines of the detections, see buildOutlines(); contourImage is an overlay layer and
+    // overlayRects the parts of it the last frame drew into.
+    std::vector<std::vector<cv::Point>> contours;
+    std::vector<const cv::Point*> outlineStarts;
+    std::vector<int> outlineCounts;
+    std::vector<cv::Rect> overlayRects;
+    cv::Mat contourImage;
+    cv::Mat outlinesImage;
+    cv::Mat result;
+
+    size_t allocations = 0;      // buffer (re)allocations since construction
+    size_t frameAllocations = 0; // buffer (re)allocations during the current frame
+
+    void beginFrame() { frameAllocations = 0; }
+
+    // Make sure mat has the given size and type, counting it if that needs an allocation
+    cv::Mat& buffer(cv::Mat& mat, cv::Size size, int type)
+    {
+        if (mat.size() != size || mat.type() != type) {
+            mat.create(size, type);
+            countAllocation();
+        }
+        return mat;
+    }
+
+    // Count the growth of a vector (or scratch buffer) whose capacity was capacityBefore
+    template <typename Container>
+    void trackCapacity(const Container& container, size_t capacityBefore)
+    {
+        if (container.capacity() != capacityBefore)
+            countAllocation();
+    }
+
+    // Blur gray into blurred. The interactive view keeps it, so a threshold change does not
+    // need a new blur.
+    void blur(const cv::Mat& gray, int ksize)
+    {
+        METRICS_SCOPE("blur");
+        buffer(blurred, gray.size(), CV_8UC1);
+        size_t scratchCapacity = blurScratch.capacity();
+        gaussianBlur8u(gray, blurred, ksize, blurScratch);
+        trackCapacity(blurScratch, scratchCapacity);
+    }
+
+    // Threshold the blurred frame into thresholded
+    void threshold(int thresh, int type)
+    {
+        METRICS_SCOPE("threshold");
+        buffer(thresholded, blurred.size(), CV_8UC1);
+        cv::threshold(blurred, thresholded, thresh, 255, type);
+        wroteWholeMask();
+    }
+
+    // Horizontal bands a frame of the given height is split into for segmentation: one per
+    // OpenCV thread, but none shorter than kMinBandRows so the seams stay cheap. Small frames
+    // get a single band and go through the serial code.
+    static constexpr int kMinBandRows = 256;
+    static int bandCount(int rows) { return std::max(1, std::min(cv::getNumThreads(), rows / kMinBandRows)); }
+
+    // Blur and threshold src into thresholded in one pass, without writing the blurred image.
+    // Large frames are done in parallel bands; each band reads the rows around it as blur
+    // support, so the mask is the same as from a single pass.
+    void blurThreshold(const cv::Mat& src, int ksize, int thresh, int type)
+    {
+        METRICS_SCOPE("blur_threshold");
+        buffer(thresholded, src.size(), CV_8UC1);
+        int bands = fixedGaussianKernel(ksize) ? bandCount(src.rows) : 1;
+        if (bands == 1) {
+            size_t scratchCapacity = blurScratch.capacity();
+            gaussianBlurThreshold(src, thresholded, ksize, thresh, type, blurScratch);
+            trackCapacity(blurScratch, scratchCapacity);
+            wroteWholeMask();
+            return;
+        }
+
+        if (bandBlurScratch.size() < static_cast<size_t>(bands)) {
+            bandBlurScratch.resize(bands);
+            countAllocation();
+        }
+        size_t scratchCapacity = bandBlurScratchCapacity();
+        cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& range) {
+            for (int b = range.start; b < range.end; ++b) {
+                int y0 = src.rows * b / bands;
+                int y1 = src.rows * (b + 1) / bands;
+                gaussianBlurThreshold(src, thresholded, ksize, thresh, type, cv::Rect(0, y0, src.cols, y1 - y0),
+                                      bandBlurScratch[b]);
+            }
+        });
+        if (bandBlurScratchCapacity() != scratchCapacity)
+            countAllocation();
+        wroteWholeMask();
+    }
+
+    // Blur and threshold only the given regions of src into thresholded, the rest of it is
+    // left empty. Within the regions the mask is the same as from a whole-frame call, and
+    // pixels outside roi (if not empty) are cleared.
+    void blurThreshold(const cv::Mat& src, int ksize, int thresh, int type, const std::vector<cv::Rect>& rects,
+                       const cv::Mat& roi)
+    {
+        METRICS_SCOPE("blur_threshold");
+        const uchar* data = thresholded.data;
+        buffer(thresholded, src.size(), CV_8UC1);
+        if (thresholded.data != data) {
+            thresholded.setTo(cv::Scalar::all(0));
+            maskRegions.clear();
+        }
+        for (const auto& rect : maskRegions)
+            thresholded(rect).setTo(cv::Scalar::all(0));
+
+        size_t scratchCapacity = blurScratch.capacity();
+        for (const auto& rect : rects) {
+            gaussianBlurThreshold(src, thresholded, ksize, thresh, type, rect, blurScratch);
+            METRICS_COUNT("segmented_pixels", rect.area());
+            if (!roi.empty()) {
+                cv::Mat part = thresholded(rect);
+                cv::bitwise_and(part, roi(rect), part);
+            }
+        }
+        trackCapacity(blurScratch, scratchCapacity);
+
+        size_t regionCapacity = maskRegions.capacity();
+        maskRegions.assign(rects.begin(), rects.end());
+        trackCapacity(maskRegions, regionCapacity);
+    }
+
+    // Label the connected components of mask into blobs, in parallel bands for large masks.
+    // With the gray frame the blobs also get their intensity-weighted centroids.
+    void labelBlobs(const cv::Mat& mask, const cv::Mat& gray = cv::Mat())
+    {
+        METRICS_SCOPE("label");
+        size_t blobCapacity = blobs.capacity();
+        size_t scratchCapacity = blobScratch.capacity();
+        extractBlobs(mask, blobs, blobScratch, bandCount(mask.rows), gray);
+        trackCapacity(blobs, blobCapacity);
+        trackCapacity(blobScratch, scratchCapacity);
+        METRICS_COUNT("blobs_found", blobs.size());
+    }
+
+    // Pyramid detection (see pyramid.hpp): find candidates in gray downscaled by factor,
+    // then blur, threshold and label only around them at full resolution. Leaves regions,
+    // thresholded and blobs as blurThreshold() and labelBlobs() would, minus the blobs cut
+    // by the edge of a region.
+    void pyramidSegment(const cv::Mat& gray, int factor, int ksize, int thresh, int type, double minArea,
+                        double maxArea, const cv::Mat& roi)
+    {
+        {
+            METRICS_SCOPE("pyramid");
+            const uchar* small = pyramid.small.data;
+            const uchar* smallMask = pyramid.smallMask.data;
+            size_t scratchCapacity = pyramid.capacity();
+            size_t regionCapacity = regions.capacity();
+            findPyramidRegions(gray, factor, ksize, thresh, type, minArea, maxArea, pyramid, regions);
+            if (pyramid.small.data != small || pyramid.smallMask.data != smallMask)
+                countAllocation();
+            trackCapacity(pyramid, scratchCapacity);
+            trackCapacity(regions, regionCapacity);
+        }
+        blurThreshold(gray, ksize, thresh, type, regions, roi);
+        labelBlobs(thresholded, gray);
+        dropCutBlobs(blobs, regions, gray.size());
+    }
+
+    // Trace the outline of every detection into contours and point contourIndex at it.
+    // Only the display needs outlines, so the other blobs are never traced.
+    void buildOutlines()
+    {
+        METRICS_SCOPE("outlines");
+        if (contours.size() < detections.size()) {
+            contours.resize(detections.size());
+            countAllocation();
+        }
+        for (size_t i = 0; i < detections.size(); ++i) {
+            traceBlobOutline(blobs[detections[i].blobIndex], blobScratch, contours[i]);
+            detections[i].contourIndex = static_cast<int>(i);
+        }
+    }
+
+    // The next regional blurThreshold() has to clear all of thresholded
+    void wroteWholeMask()
+    {
+        if (maskRegions.size() != 1 || maskRegions[0] != cv::Rect(0, 0, thresholded.cols, thresholded.rows)) {
+            size_t regionCapacity = maskRegions.capacity();
+            maskRegions.assign(1, cv::Rect(0, 0, thresholded.cols, thresholded.rows));
+            trackCapacity(maskRegions, regionCapacity);
+        }
+    }
+
+    size_t bandBlurScratchCapacity() const
+    {
+        size_t capacity = 0;
+        for (const auto& scratch : bandBlurScratch)
+            capacity += scratch.capacity();
+        return capacity;
+    }
+
+    void countAllocation()
+    {
+        ++allocations;
+        ++frameAllocations;
+    }
+};
+
+// Allocation counts collected over a run
+struct AllocationStats
+{
+    size_t frames = 0;
+    size_t allocations = 0;
+    size_t framesWithAllocations = 0;
+
+    void add(const FrameContext& context)
+    {
+        ++frames;
+        allocations += context.frameAllocations;
+        if (context.frameAllocations > 0)
+            ++framesWithAllocations;
+    }
+
+    void print(std::ostream& out) const
+    {
+        out << "Buffer allocations: " << allocations << " in " << framesWithAllocations << " of " << frames
+            << " frames" << std::endl;
+    }
+};
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Heap allocations of the program so far. Only programs that include alloc_counter.hpp
+// count them, for the others it stays 0.
+inline std::atomic<size_t> g_heapAllocations{0};
@@ -0,0 +1,384 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "pipeline.hpp"
+#include "run_report.hpp"
+
+// Real-time sources and latency control.
+//
+// A PacedSource delivers the frames of a video file or a camera together with the time each
+// one became available. In File mode that is whenever it is decoded, every frame in turn.
+// Replay plays a file the way a camera would deliver it, to test without hardware: frame n
+// becomes available n frame periods after the first, reading waits for it, and the frames
+// that went by while the program was busy are skipped. Camera reads a live device.
+//
+// A LatencyScheduler measures the latency from that moment to the sink, frame by frame, and
+// when it exceeds the budget makes the headless pipeline process less until it is back
+// within it: first segmenting at lower resolution (pyramid detection, if the pipeline can),
+// then only every 2nd, 4th or 8th frame. It also bounds the frames in flight, so they
+// cannot pile up in the queues.
+
+// Where the frames come from, see above
+enum class SourceMode
+{
+    File,
+    Replay,
+    Camera,
+};
+
+inline bool parseSourceMode(const std::string& name, SourceMode& mode)
+{
+    if (name == "file")
+        mode = SourceMode::File;
+    else if (name == "replay")
+        mode = SourceMode::Replay;
+    else if (name == "camera")
+        mode = SourceMode::Camera;
+    else
+        return false;
+    return true;
+}
+
+// A video file or camera read in one of the source modes
+class PacedSource
+{
+public:
+    // Open input: a video file, or in Camera mode a device index (e.g. 0) or stream URL
+    bool open(const std::string& input, SourceMode mode)
+    {
+        m_mode = mode;
+        bool isIndex = !input.empty() && std::all_of(input.begin(), input.end(), [](char c) {
+            return std::isdigit(static_cast<unsigned char>(c)) != 0;
+        });
+        if (mode == SourceMode::Camera && isIndex)
+            m_video.open(std::stoi(input));
+        else
+            m_video.open(input);
+        if (!m_video.isOpened())
+            return false;
+
+        // Keep only the newest frame of a camera, an old one just adds latency
+        if (mode == SourceMode::Camera)
+            m_video.set(cv::CAP_PROP_BUFFERSIZE, 1);
+        double fps = m_video.get(cv::CAP_PROP_FPS);
+        m_frameMsec = 1000.0 / (fps > 0.0 ? fps : 30.0);
+        m_next = 0;
+        m_skipped = 0;
+        return true;
+    }
+
+    cv::VideoCapture& video() { return m_video; }
+    SourceMode mode() const { return m_mode; }
+    double frameMsec() const { return m_frameMsec; }
+    bool paced() const { return m_mode != SourceMode::File; }
+
+    // Frames of a replayed file that went by unread
+    long long skipped() const { return m_skipped; }
+
+    // Grab the next frame without decoding it, in Replay mode the newest one the emulated
+    // camera has delivered (waiting for the next if it was taken already). captureTime is
+    // when it became available. retrieve() decodes it, a frame that is dropped never is.
+    bool grab(int& frameIndex, double& positionMsec, std::chrono::steady_clock::time_point& captureTime)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (m_next == 0)
+            m_start = now;
+
+        if (m_mode == SourceMode::Replay) {
+            double elapsedMsec = std::chrono::duration<double, std::milli>(now - m_start).count();
+            long long due = static_cast<long long>(elapsedMsec / m_frameMsec);
+            if (due < m_next) {
+                std::this_thread::sleep_until(m_start + toDuration(m_next * m_frameMsec));
+                due = m_next;
+            }
+            for (; m_next < due; ++m_next, ++m_skipped) {
+                if (!m_video.grab())
+                    return false;
+            }
+            if (!m_video.grab())
+                return false;
+            captureTime = m_start + toDuration(m_next * m_frameMsec);
+            positionMsec = m_next * m_frameMsec;
+        } else {
+            if (!m_video.grab())
+                return false;
+            captureTime = std::chrono::steady_clock::now();
+            positionMsec = m_mode == SourceMode::Camera
+                               ? std::chrono::duration<double, std::milli>(captureTime - m_start).count()
+                               : m_video.get(cv::CAP_PROP_POS_MSEC);
+        }
+        frameIndex = static_cast<int>(m_next++);
+        return true;
+    }
+
+    // Decode the frame grab() took
+    bool retrieve(cv::Mat& frame) { return m_video.retrieve(frame); }
+
+    // grab() and retrieve() the next frame
+    bool read(cv::Mat& frame, int& frameIndex, double& positionMsec,
+              std::chrono::steady_clock::time_point& captureTime)
+    {
+        return grab(frameIndex, positionMsec, captureTime) && retrieve(frame);
+    }
+
+private:
+    static std::chrono::steady_clock::duration toDuration(double msec)
+    {
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(msec));
+    }
+
+    cv::VideoCapture m_video;
+    SourceMode m_mode = SourceMode::File;
+    double m_frameMsec = 1000.0 / 30.0;
+    std::chrono::steady_clock::time_point m_start;
+    long long m_next = 0;
+    long long m_skipped = 0;
+};
+
+// Distribution of latencies in a fixed set of buckets, 16 per power of two microseconds, so
+// its percentiles are within 1/16 of the value and a run of any length takes no more memory
+class LatencyHistogram
+{
+public:
+    void add(float msec)
+    {
+        uint64_t us = msec > 0.0f ? static_cast<uint64_t>(msec * 1000.0 + 0.5) : 0;
+        ++m_buckets[bucketOf(us)];
+        ++m_count;
+        m_total += msec;
+        m_max = std::max(m_max, static_cast<double>(msec));
+    }
+
+    LatencySummary summary(const std::string& name) const
+    {
+        LatencySummary summary;
+        summary.name = name;
+        summary.samples = static_cast<size_t>(m_count);
+        if (m_count == 0)
+            return summary;
+        summary.mean = m_total / m_count;
+        summary.p50 = percentile(0.50);
+        summary.p90 = percentile(0.90);
+        summary.p99 = percentile(0.99);
+        summary.max = m_max;
+        return summary;
+    }
+
+private:
+    static constexpr int kSubBits = 4;
+    static constexpr uint64_t kSub = 1 << kSubBits;
+    static constexpr size_t kBuckets = 64 * kSub;
+
+    // Values below kSub get a bucket each, above that the kSubBits bits after the leading
+    // one pick the bucket within the power of two
+    static size_t bucketOf(uint64_t us)
+    {
+        if (us < kSub)
+            return static_cast<size_t>(us);
+        int msb = 0;
+        while (us >> (msb + 1))
+            ++msb;
+        return static_cast<size_t>((msb - kSubBits + 1) * kSub + ((us >> (msb - kSubBits)) & (kSub - 1)));
+    }
+
+    static uint64_t upperBound(size_t bucket)
+    {
+        if (bucket < kSub)
+            return bucket;
+        int msb = static_cast<int>(bucket / kSub) + kSubBits - 1;
+        uint64_t sub = bucket % kSub;
+        return ((kSub + sub + 1) << (msb - kSubBits)) - 1;
+    }
+
+    // Upper bound of the bucket holding the given fraction of the samples, in milliseconds
+    double percentile(double fraction) const
+    {
+        uint64_t rank = static_cast<uint64_t>(fraction * (m_count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += m_buckets[i];
+            if (seen >= rank)
+                return std::min(upperBound(i) / 1000.0, m_max);
+        }
+        return m_max;
+    }
+
+    std::array<uint64_t, kBuckets> m_buckets{};
+    uint64_t m_count = 0;
+    double m_total = 0.0;
+    double m_max = 0.0;
+};
+
+// Keeps the end-to-end latency within a budget, see above. admit() runs on the source
+// thread and finished() on the sink's, the level is the only state they share.
+class LatencyScheduler
+{
+public:
+    // budgetMsec 0 only measures. degradeFactor is the pyramid factor of the cheaper
+    // segmentation, 0 if the pipeline has none; maxInFlight bounds the admitted frames that
+    // have not reached the sink yet.
+    void configure(double budgetMsec, int degradeFactor, int maxInFlight)
+    {
+        m_budgetMsec = budgetMsec;
+        m_degradeFactor = degradeFactor;
+        m_maxInFlight = std::max(1, maxInFlight);
+        m_maxLevel = kMaxStrideLevel + (degradeFactor > 0 ? 1 : 0);
+    }
+
+    // Whether to process the next frame and, if so, with which pyramid factor (0 for the
+    // pipeline's own)
+    bool admit(int& pyramidFactor)
+    {
+        long long offered = m_offered++;
+        if (m_budgetMsec > 0.0) {
+            if (m_admitted - m_finished.load(std::memory_order_acquire) >= m_maxInFlight) {
+                ++m_dropped;
+                return false;
+            }
+            int level = m_level.load(std::memory_order_relaxed);
+            int strideLevel = std::max(0, level - (m_degradeFactor > 0 ? 1 : 0));
+            if (offered % (1LL << strideLevel) != 0) {
+                ++m_dropped;
+                return false;
+            }
+            pyramidFactor = level > 0 ? m_degradeFactor : 0;
+        } else {
+            pyramidFactor = 0;
+        }
+        if (pyramidFactor > 0)
+            ++m_degraded;
+        ++m_admitted;
+        return true;
+    }
+
+    // Write the latency of every frame to path (CSV) as the frames reach the sink. False if
+    // it can't be opened.
+    bool openLog(const std::string& path)
+    {
+        m_logPath = path;
+        m_log.open(path);
+        if (!m_log.is_open())
+            return false;
+        m_log << "Frame, Latency ms, Level\n";
+        return true;
+    }
+
+    // Close the log, false if writing it failed
+    bool closeLog()
+    {
+        if (!m_log.is_open())
+            return true;
+        m_log.close();
+        return !m_log.fail();
+    }
+
+    const std::string& logPath() const { return m_logPath; }
+
+    // A frame that became available at captureTime reached the sink
+    void finished(int frameIndex, std::chrono::steady_clock::time_point captureTime)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - captureTime;
+        float latency = std::chrono::duration<float, std::milli>(elapsed).count();
+        m_finished.fetch_add(1, std::memory_order_release);
+        int level = m_level.load(std::memory_order_relaxed);
+        m_latency.add(latency);
+        if (m_log.is_open())
+            m_log << frameIndex << ", " << latency << ", " << level << "\n";
+        if (m_budgetMsec <= 0.0)
+            return;
+
+        // Step up when over budget, but only once the frames admitted at the current level
+        // come through; step down after a while well within it
+        m_smoothed = m_firstSample ? latency : m_smoothed + kSmoothing * (latency - m_smoothed);
+        m_firstSample = false;
+        ++m_sinceChange;
+        if (m_smoothed > m_budgetMsec && level < m_maxLevel && m_sinceChange > m_maxInFlight) {
+            m_level.store(level + 1, std::memory_order_relaxed);
+            m_sinceChange = 0;
+        } else if (m_smoothed < kRecoverFraction * m_budgetMsec && level > 0 && m_sinceChange > kRecoverFrames) {
+            m_level.store(level - 1, std::memory_order_relaxed);
+            m_sinceChange = 0;
+        }
+    }
+
+    long long dropped() const { return m_dropped; }
+    long long degraded() const { return m_degraded; }
+
+    LatencySummary summary() const { return m_latency.summary("end_to_end"); }
+
+private:
+    static constexpr int kMaxStrideLevel = 3; // every 8th frame at most
+    static constexpr double kSmoothing = 0.1;
+    static constexpr double kRecoverFraction = 0.5;
+    static constexpr int kRecoverFrames = 60;
+
+    double m_budgetMsec = 0.0;
+    int m_degradeFactor = 0;
+    long long m_maxInFlight = 1;
+    int m_maxLevel = 0;
+    std::atomic<int> m_level{0};
+
+    // Source thread
+    long long m_offered = 0;
+    long long m_admitted = 0;
+    long long m_dropped = 0;
+    long long m_degraded = 0;
+
+    // Sink thread
+    std::atomic<long long> m_finished{0};
+    LatencyHistogram m_latency;
+    std::ofstream m_log;
+    std::string m_logPath;
+    bool m_firstSample = true;
+    double m_smoothed = 0.0;
+    int m_sinceChange = 0;
+};
+
+// Pipeline source reading from source, passing on the frames scheduler admits. The frames it
+// drops are only grabbed, not decoded.
+inline std::function<bool(FrameJob&)> pacedSource(PacedSource& source, LatencyScheduler& scheduler)
+{
+    return [&source, &scheduler](FrameJob& job) {
+        job.context.beginFrame();
+        while (source.grab(job.frameIndex, job.positionMsec, job.captureTime)) {
+            if (scheduler.admit(job.pyramidFactor))
+                return source.retrieve(job.frame);
+        }
+        return false;
+    };
+}
+
+// Add the latency of a run from a paced source to its report and print it, and close the
+// latency log. False if the log could not be written.
+inline bool finishLatency(RunReport& report, const PacedSource& source, LatencyScheduler& scheduler)
+{
+    if (!scheduler.closeLog()) {
+        std::cout << "Error writing " << scheduler.logPath() << std::endl;
+        return false;
+    }
+    if (!source.paced())
+        return true;
+
+    report.latency = scheduler.summary();
+    report.framesSkipped = source.skipped();
+    report.framesDropped = scheduler.dropped();
+    report.framesDegraded = scheduler.degraded();
+    std::cout << "End-to-end latency: p50 " << report.latency.p50 << " ms, p99 " << report.latency.p99
+              << " ms, max " << report.latency.max << " ms; " << report.framesSkipped << " frames went by unread, "
+              << report.framesDropped << " dropped, " << report.framesDegraded << " at lower resolution" << std::endl;
+    return true;
+}
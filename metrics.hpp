@@ -0,0 +1,367 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+// Hot-path instrumentation: scoped timers feeding latency histograms, and event counters.
+//
+// Only compiled in with -DPARAMECIUM_METRICS. Without it the macros expand to nothing and
+// the functions are empty inlines, so instrumented code is exactly as fast as before.
+//
+//     METRICS_SCOPE("label");                      // time the rest of the enclosing block
+//     METRICS_COUNT("blobs_found", blobs.size());  // add to a counter
+//     METRICS_STOPWATCH(watch);                    // time consecutive sections of a block:
+//     METRICS_LAP(watch, "blend");                 // time since the stopwatch or the last lap
+//     METRICS_FRAME(33.3);                         // count a displayed frame, and late ones
+//     METRICS_TICK();                              // dump the metrics if the interval passed
+//
+// Each call site looks its metric up once (function-local static) and then only does a
+// few relaxed atomic operations, so the timers can be used from every pipeline worker.
+// Names end up as JSON keys, so stick to letters, digits and underscores.
+
+#if defined(PARAMECIUM_METRICS)
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Histogram of durations in nanoseconds, with 4 buckets per power of two (at most 25% error)
+class MetricHistogram
+{
+public:
+    explicit MetricHistogram(const std::string& name) : m_name(name) {}
+
+    const std::string& name() const { return m_name; }
+
+    void record(uint64_t ns)
+    {
+        m_buckets[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_total.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = m_max.load(std::memory_order_relaxed);
+        while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    double mean() const
+    {
+        uint64_t n = count();
+        return n > 0 ? static_cast<double>(m_total.load(std::memory_order_relaxed)) / n : 0.0;
+    }
+
+    // Upper bound of the bucket holding the given fraction of the samples
+    uint64_t percentile(double fraction) const
+    {
+        uint64_t total = count();
+        if (total == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(fraction * (total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return std::min(upperBound(i), max());
+        }
+        return max();
+    }
+
+private:
+    static constexpr size_t kBuckets = 4 * 64;
+
+    // Values below 4 get a bucket each, above that the two bits after the leading one pick
+    // one of 4 buckets within the power of two
+    static size_t bucketOf(uint64_t ns)
+    {
+        if (ns < 4)
+            return static_cast<size_t>(ns);
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, ns);
+        int msb = static_cast<int>(index);
+#else
+        int msb = 63 - __builtin_clzll(ns);
+#endif
+        return static_cast<size_t>((msb - 1) * 4 + ((ns >> (msb - 2)) & 3));
+    }
+
+    static uint64_t upperBound(size_t bucket)
+    {
+        if (bucket < 4)
+            return bucket;
+        int msb = static_cast<int>(bucket / 4) + 1;
+        uint64_t sub = bucket % 4;
+        return ((4 + sub + 1) << (msb - 2)) - 1;
+    }
+
+    std::string m_name;
+    std::array<std::atomic<uint64_t>, kBuckets> m_buckets{};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_total{0};
+    std::atomic<uint64_t> m_max{0};
+};
+
+class MetricCounter
+{
+public:
+    explicit MetricCounter(const std::string& name) : m_name(name) {}
+
+    const std::string& name() const { return m_name; }
+    void add(uint64_t n) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::string m_name;
+    std::atomic<uint64_t> m_value{0};
+};
+
+// Records the time from construction to destruction
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(MetricHistogram& histogram)
+        : m_histogram(histogram), m_start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        m_histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    MetricHistogram& m_histogram;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Times consecutive sections, each lap records the time since the previous one
+class MetricsStopwatch
+{
+public:
+    MetricsStopwatch() : m_last(std::chrono::steady_clock::now()) {}
+
+    void lap(MetricHistogram& histogram)
+    {
+        auto now = std::chrono::steady_clock::now();
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last).count());
+        m_last = now;
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_last;
+};
+
+// All metrics of the program, in the order they were first used
+class MetricsRegistry
+{
+public:
+    MetricHistogram& histogram(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& histogram : m_histograms)
+            if (histogram.name() == name)
+                return histogram;
+        m_histograms.emplace_back(name);
+        return m_histograms.back();
+    }
+
+    MetricCounter& counter(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& counter : m_counters)
+            if (counter.name() == name)
+                return counter;
+        m_counters.emplace_back(name);
+        return m_counters.back();
+    }
+
+    // Dump every interval seconds: text to std::cout, and JSON (or YAML) to path if set
+    void configure(const std::string& path, double interval)
+    {
+        m_path = path;
+        m_interval = interval;
+    }
+
+    void showOverlay(bool show) { m_overlay = show; }
+    bool overlay() const { return m_overlay; }
+
+    // Count a frame of the interactive loop, and whether it came more than periodMsec
+    // after the previous one (a frame a live source would have dropped)
+    void frame(double periodMsec)
+    {
+        static MetricHistogram& interval = histogram("frame_interval");
+        static MetricCounter& frames = counter("frames");
+        static MetricCounter& late = counter("frames_late");
+        auto now = std::chrono::steady_clock::now();
+        if (frames.value() > 0) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_lastFrame).count();
+            interval.record(elapsed);
+            if (elapsed > periodMsec * 1e6)
+                late.add(1);
+        }
+        frames.add(1);
+        m_lastFrame = now;
+    }
+
+    void tick()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (m_interval <= 0.0 || std::chrono::duration<double>(now - m_lastDump).count() < m_interval)
+            return;
+        m_lastDump = now;
+        dump();
+    }
+
+    void dump()
+    {
+        std::cout << text() << std::flush;
+        if (!m_path.empty())
+            writeJson(m_path);
+    }
+
+    // One line per metric, latencies in microseconds
+    std::string text()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::ostringstream out;
+        char line[160];
+        for (const auto& histogram : m_histograms) {
+            std::snprintf(line, sizeof(line), "%-20s n=%-8llu p50=%9.1fus p99=%9.1fus max=%9.1fus\n",
+                          histogram.name().c_str(), static_cast<unsigned long long>(histogram.count()),
+                          histogram.percentile(0.50) / 1000.0, histogram.percentile(0.99) / 1000.0,
+                          histogram.max() / 1000.0);
+            out << line;
+        }
+        for (const auto& counter : m_counters) {
+            std::snprintf(line, sizeof(line), "%-20s %llu\n", counter.name().c_str(),
+                          static_cast<unsigned long long>(counter.value()));
+            out << line;
+        }
+        return out.str();
+    }
+
+    void writeJson(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened())
+            return;
+        fs << "timers" << "[";
+        for (const auto& histogram : m_histograms) {
+            fs << "{" << "name" << histogram.name() << "count" << static_cast<double>(histogram.count())
+               << "mean_ns" << histogram.mean() << "p50_ns" << static_cast<double>(histogram.percentile(0.50))
+               << "p90_ns" << static_cast<double>(histogram.percentile(0.90)) << "p99_ns"
+               << static_cast<double>(histogram.percentile(0.99)) << "max_ns" << static_cast<double>(histogram.max())
+               << "}";
+        }
+        fs << "]" << "counters" << "{";
+        for (const auto& counter : m_counters)
+            fs << counter.name() << static_cast<double>(counter.value());
+        fs << "}";
+    }
+
+    // Latencies and counters in the top left corner of image
+    void drawOverlay(cv::Mat& image)
+    {
+        std::string lines = text();
+        std::istringstream in(lines);
+        std::string line;
+        int y = 16;
+        while (std::getline(in, line)) {
+            cv::putText(image, line, cv::Point(8, y), cv::FONT_HERSHEY_PLAIN, 1.0, cv::Scalar::all(0), 3);
+            cv::putText(image, line, cv::Point(8, y), cv::FONT_HERSHEY_PLAIN, 1.0, cv::Scalar(0, 255, 255), 1);
+            y += 16;
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::deque<MetricHistogram> m_histograms; // deque: references stay valid as it grows
+    std::deque<MetricCounter> m_counters;
+    std::string m_path;
+    double m_interval = 0.0;
+    bool m_overlay = false;
+    std::chrono::steady_clock::time_point m_lastDump = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point m_lastFrame;
+};
+
+inline MetricsRegistry& metrics()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+#define METRICS_CONCAT_(a, b) a##b
+#define METRICS_CONCAT(a, b) METRICS_CONCAT_(a, b)
+#define METRICS_SCOPE(name)                                                                                 \
+    static MetricHistogram& METRICS_CONCAT(metricsHistogram, __LINE__) = metrics().histogram(name);         \
+    ScopedTimer METRICS_CONCAT(metricsTimer, __LINE__)(METRICS_CONCAT(metricsHistogram, __LINE__))
+#define METRICS_COUNT(name, n)                                                                              \
+    do {                                                                                                    \
+        static MetricCounter& metricsCounter = metrics().counter(name);                                     \
+        metricsCounter.add(static_cast<uint64_t>(n));                                                       \
+    } while (0)
+#define METRICS_STOPWATCH(watch) MetricsStopwatch watch
+#define METRICS_LAP(watch, name)                                                                            \
+    do {                                                                                                    \
+        static MetricHistogram& metricsHistogram = metrics().histogram(name);                               \
+        watch.lap(metricsHistogram);                                                                        \
+    } while (0)
+#define METRICS_FRAME(periodMsec) metrics().frame(periodMsec)
+#define METRICS_TICK() metrics().tick()
+
+inline constexpr bool kMetricsEnabled = true;
+
+inline void configureMetrics(const std::string& path, double interval)
+{
+    metrics().configure(path, interval);
+}
+
+inline void dumpMetrics()
+{
+    metrics().dump();
+}
+
+inline void toggleMetricsOverlay()
+{
+    metrics().showOverlay(!metrics().overlay());
+}
+
+inline void drawMetricsOverlay(cv::Mat& image)
+{
+    if (metrics().overlay())
+        metrics().drawOverlay(image);
+}
+
+#else
+
+#define METRICS_SCOPE(name) static_cast<void>(0)
+#define METRICS_COUNT(name, n) static_cast<void>(0)
+#define METRICS_STOPWATCH(watch) static_cast<void>(0)
+#define METRICS_LAP(watch, name) static_cast<void>(0)
+#define METRICS_FRAME(periodMsec) static_cast<void>(periodMsec)
+#define METRICS_TICK() static_cast<void>(0)
+
+inline constexpr bool kMetricsEnabled = false;
+
+inline void configureMetrics(const std::string& path, double)
+{
+    if (!path.empty())
+        std::cout << "Built without PARAMECIUM_METRICS, no metrics are written to " << path << std::endl;
+}
+
+inline void dumpMetrics() {}
+inline void toggleMetricsOverlay() {}
+inline void drawMetricsOverlay(cv::Mat&) {}
+
+#endif
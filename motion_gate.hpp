@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Region of interest and motion gating: which parts of a frame need segmenting.
+//
+// The frame is cut into square tiles. Tiles without any pixel of the region of interest
+// are never segmented. With motion gating each frame is also compared with the previous
+// one at a quarter of the resolution, and only the tiles where something changed during
+// the last holdFrames frames are segmented, together with their neighbours so an organism
+// that reaches into the next tile is still seen whole. The mask stays empty everywhere
+// else. Inside the segmented tiles it is exactly the full-frame mask: the blur reads its
+// support from around them.
+struct MotionGateSettings
+{
+    bool motion = false; // gate on frame differences, otherwise only on the region of interest
+    int tileSize = 64;   // pixels
+    int threshold = 12;  // gray level change of a downscaled pixel that counts as motion
+    int holdFrames = 15; // frames a tile stays active after its last motion
+};
+
+class MotionGate
+{
+public:
+    // roi is an 8-bit mask, non-zero inside the region of interest, scaled to the frame
+    // size if needed; empty for the whole frame
+    void configure(const MotionGateSettings& settings, const cv::Mat& roi = cv::Mat())
+    {
+        m_settings = settings;
+        m_settings.tileSize = std::max(8, m_settings.tileSize);
+        m_settings.holdFrames = std::max(0, m_settings.holdFrames);
+        m_roiSource = roi;
+        m_size = cv::Size();
+    }
+
+    // Whether frames are segmented only in parts
+    bool enabled() const { return m_settings.motion || !m_roiSource.empty(); }
+
+    // Region of interest at the size of the last frame, empty for the whole frame
+    const cv::Mat& roi() const { return m_roi; }
+
+    // Clear the pixels of mask outside the region of interest
+    void maskRoi(cv::Mat& mask)
+    {
+        resize(mask.size());
+        if (!m_roi.empty())
+            cv::bitwise_and(mask, m_roi, mask);
+    }
+
+    // Compare gray with the previous frame and list the parts to segment, as runs of
+    // active tiles per tile row, top to bottom. The first frame is segmented wherever the
+    // region of interest is. Keeps state between frames, so it has to see them in order.
+    void update(const cv::Mat& gray, std::vector<cv::Rect>& regions)
+    {
+        CV_Assert(gray.type() == CV_8UC1);
+        resize(gray.size());
+        ++m_frame;
+        if (m_settings.motion)
+            detectMotion(gray);
+
+        regions.clear();
+        int tile = m_settings.tileSize;
+        for (int ty = 0; ty < m_tilesY; ++ty) {
+            int runStart = -1;
+            for (int tx = 0; tx <= m_tilesX; ++tx) {
+                bool active = tx < m_tilesX && isActive(tx, ty);
+                if (active && runStart < 0) {
+                    runStart = tx;
+                } else if (!active && runStart >= 0) {
+                    cv::Rect run(runStart * tile, ty * tile, (tx - runStart) * tile, tile);
+                    regions.push_back(run & cv::Rect(0, 0, m_size.width, m_size.height));
+                    m_activeTiles += tx - runStart;
+                    runStart = -1;
+                }
+            }
+        }
+        m_totalTiles += static_cast<size_t>(m_tilesX) * m_tilesY;
+    }
+
+    // Share of the tiles segmented since configure()
+    double activeFraction() const { return m_totalTiles > 0 ? static_cast<double>(m_activeTiles) / m_totalTiles : 1.0; }
+
+private:
+    // Set up the tiles and the region of interest for frames of the given size
+    void resize(cv::Size size)
+    {
+        if (size == m_size)
+            return;
+        m_size = size;
+        int tile = m_settings.tileSize;
+        m_tilesX = (size.width + tile - 1) / tile;
+        m_tilesY = (size.height + tile - 1) / tile;
+        m_lastMotion.assign(static_cast<size_t>(m_tilesX) * m_tilesY, kNever);
+        m_inRoi.assign(m_lastMotion.size(), 1);
+        m_previous.release();
+
+        m_roi.release();
+        if (m_roiSource.empty())
+            return;
+        if (m_roiSource.size() != size)
+            cv::resize(m_roiSource, m_roi, size, 0, 0, cv::INTER_NEAREST);
+        else
+            m_roi = m_roiSource.clone();
+        for (int ty = 0; ty < m_tilesY; ++ty)
+            for (int tx = 0; tx < m_tilesX; ++tx) {
+                cv::Rect rect = cv::Rect(tx * tile, ty * tile, tile, tile) & cv::Rect(0, 0, size.width, size.height);
+                m_inRoi[ty * m_tilesX + tx] = cv::countNonZero(m_roi(rect)) > 0;
+            }
+    }
+
+    // Stamp the tiles with a changed pixel in the quarter-resolution difference
+    void detectMotion(const cv::Mat& gray)
+    {
+        cv::Size small(std::max(1, gray.cols / kScale), std::max(1, gray.rows / kScale));
+        cv::resize(gray, m_small, small, 0, 0, cv::INTER_AREA);
+        if (m_previous.size() != m_small.size()) {
+            std::fill(m_lastMotion.begin(), m_lastMotion.end(), m_frame);
+        } else {
+            if (m_tileOfColumn.size() != static_cast<size_t>(small.width)) {
+                m_tileOfColumn.resize(small.width);
+                for (int x = 0; x < small.width; ++x)
+                    m_tileOfColumn[x] = x * kScale / m_settings.tileSize;
+            }
+            cv::absdiff(m_small, m_previous, m_diff);
+            for (int y = 0; y < small.height; ++y) {
+                const uint8_t* row = m_diff.ptr<uint8_t>(y);
+                int* stamps = &m_lastMotion[static_cast<size_t>(y * kScale / m_settings.tileSize) * m_tilesX];
+                for (int x = 0; x < small.width; ++x)
+                    if (row[x] > m_settings.threshold)
+                        stamps[m_tileOfColumn[x]] = m_frame;
+            }
+        }
+        std::swap(m_small, m_previous);
+    }
+
+    // In the region of interest and, when gating on motion, near recent motion
+    bool isActive(int tx, int ty) const
+    {
+        if (!m_inRoi[ty * m_tilesX + tx])
+            return false;
+        if (!m_settings.motion)
+            return true;
+        for (int y = std::max(ty - 1, 0); y <= std::min(ty + 1, m_tilesY - 1); ++y)
+            for (int x = std::max(tx - 1, 0); x <= std::min(tx + 1, m_tilesX - 1); ++x)
+                if (m_frame - m_lastMotion[y * m_tilesX + x] <= m_settings.holdFrames)
+                    return true;
+        return false;
+    }
+
+    static constexpr int kScale = 4;
+    static constexpr int kNever = -(1 << 30);
+
+    MotionGateSettings m_settings;
+    cv::Mat m_roiSource;
+    cv::Mat m_roi;
+    cv::Size m_size;
+    int m_tilesX = 0;
+    int m_tilesY = 0;
+    std::vector<int> m_lastMotion; // frame of the last motion per tile
+    std::vector<char> m_inRoi;
+    std::vector<int> m_tileOfColumn;
+    cv::Mat m_small;
+    cv::Mat m_previous;
+    cv::Mat m_diff;
+    int m_frame = 0;
+    size_t m_activeTiles = 0;
+    size_t m_totalTiles = 0;
+};
+
+// Read a region of interest mask (any image, non-zero pixels are inside), empty on error
+inline cv::Mat loadRoiMask(const std::string& path)
+{
+    cv::Mat roi = cv::imread(path, cv::IMREAD_GRAYSCALE);
+    if (roi.empty()) {
+        std::cout << "Error reading region of interest " << path << std::endl;
+        return roi;
+    }
+    cv::threshold(roi, roi, 0, 255, cv::THRESH_BINARY);
+    return roi;
+}
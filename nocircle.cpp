@@ -1,163 +1,122 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
-
-// Global variables
-cv::Mat g_frame;
-cv::Mat g_fgMask;
-cv::Mat g_thresholded;
-cv::Mat g_contourImage;
-cv::Mat g_outlinesimage;
-int g_thresholdValue = 132;
-int g_blurSize = 7;
-int g_fgMaskBlurSize = 13;
-int g_minContourSize = 50;
-int g_maxContourSize = 10000;
-int g_aspectRatioThreshold = 80; // Added aspect ratio threshold variable
-
-
-double g_aspectRatioThresholdDouble = (double)g_aspectRatioThreshold / 100.0;
-// Background Subtraction variables
-cv::Ptr<cv::BackgroundSubtractor> g_backgroundSubtractor;
-
-// Function to calculate the aspect ratio of a contour
-double calculateAspectRatio(const std::vector<cv::Point>& contour);
-
-// Calculate aspect ratio of a contour
-double calculateAspectRatio(const std::vector<cv::Point>& contour)
-{
-    cv::RotatedRect boundingBox = cv::minAreaRect(contour);
-    cv::Size2f size = boundingBox.size;
-    double aspectRatio = size.width / size.height;
-    return aspectRatio;
-}
-
-// Function to threshold the image and find contours
-void processImage()
+#include "alloc_counter.hpp"
+#include "detection.hpp"
+#include "frame_cache.hpp"
+#include "options.hpp"
+#include "pipeline.hpp"
+#include "tracing.hpp"
+
+// Like main, but only keeps the elongated blobs: those whose minimum area rectangle has an
+// aspect ratio far enough from 1 (--aspect-ratio). The stages and the display are in
+// tracing.hpp, this is the front end.
+
+int main(int argc, char** argv)
 {
-    cv::Mat blurred;
-    cv::GaussianBlur(g_frame, blurred, cv::Size(g_blurSize, g_blurSize), 0);
-    cv::threshold(blurred, g_thresholded, g_thresholdValue, 255, cv::THRESH_BINARY_INV);
-
-    // Find contours in the thresholded image
-    std::vector<std::vector<cv::Point>> contours;
-    cv::findContours(g_thresholded, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
-
-    g_contourImage = cv::Mat::zeros(g_frame.size(), CV_8UC3);
-    cv::Scalar contourColor = cv::Scalar(0, 165, 255); // Orange color (BGR format)
-    cv::Scalar centroidColor = cv::Scalar(0, 0, 255); // Red color (BGR format)
+    Options options;
+    if (!parseOptions(argc, argv, options))
+        return -1;
 
-    cv::cvtColor(g_frame, g_outlinesimage, cv::COLOR_GRAY2BGR);
+    TracingParams params = tracingParams(options);
+    params.aspectRatioFilter = true;
+    Tracer tracer(params);
+    configureMetrics(options.metricsPath, options.metricsInterval);
+    if (!configureMotionGate(tracer.gate, options))
+        return -1;
 
-    // Filter contours based on size and aspect ratio, and draw them on the contour image
-    for (const auto& contour : contours)
+    PacedSource source;
+    if (!source.open(options.input, options.sourceMode))
     {
-        double aspectRatio = calculateAspectRatio(contour);
-        if ((cv::contourArea(contour) > g_minContourSize) &&
-            (cv::contourArea(contour) < g_maxContourSize) &&
-            (aspectRatio < 1.0 - g_aspectRatioThreshold) || (aspectRatio > 1.0 + g_aspectRatioThreshold) ) // Check aspect ratio
-        {
-            cv::Scalar color = cv::Scalar(rand() % 256, rand() % 256, rand() % 256);
-            cv::drawContours(g_contourImage, std::vector<std::vector<cv::Point>>{contour}, -1, color, cv::FILLED);
-
-            // Draw orange line along the contour on g_outlinesimage
-            cv::drawContours(g_outlinesimage, std::vector<std::vector<cv::Point>>{contour}, -1, contourColor, 2);
-
-            // Find centroid of the contour
-            cv::Moments moments = cv::moments(contour);
-            cv::Point centroid(moments.m10 / moments.m00, moments.m01 / moments.m00);
-
-            // Draw red dot as the centroid on g_outlinesimage
-            cv::circle(g_outlinesimage, centroid, 3, centroidColor, cv::FILLED);
-        }
+        std::cout << "Error opening video file!" << std::endl;
+        return -1;
     }
+    cv::VideoCapture& video = source.video();
 
-    cv::Mat result;
-    cv::cvtColor(g_frame, result, cv::COLOR_GRAY2BGR);
-    cv::addWeighted(result, 0.5, g_contourImage, 0.5, 0.0, result);
-
-    cv::imshow("Segmented Image", result);
-    cv::imshow("Threshold", g_thresholded);
-    cv::imshow("marked", g_outlinesimage);
-}
-
-// Callback function for the threshold trackbar
-void onThresholdChange(int, void*)
-{
-    processImage();
-}
-
-// Callback function for the blur trackbar
-void onBlurSizeChange(int, void*)
-{
-    if (g_blurSize % 2 == 0)
-        ++g_blurSize;
-    if (g_blurSize < 3)
-        g_blurSize = 3;
-    cv::setTrackbarPos("Blur Size", "Segmented Image", g_blurSize);
-    processImage();
-}
+    if (options.headless)
+        return runHeadless("nocircle", source, tracer, headlessSettings(options));
 
-// Callback function for the foreground mask blur trackbar
-void onFgMaskBlurSizeChange(int, void*)
-{
-    if (g_fgMaskBlurSize % 2 == 0)
-        ++g_fgMaskBlurSize;
-    if (g_fgMaskBlurSize < 3)
-        g_fgMaskBlurSize = 3;
-    cv::setTrackbarPos("Foreground Mask Blur Size", "Segmented Image", g_fgMaskBlurSize);
-    processImage();
-}
-
-// Callback function for the minimum contour size trackbar
-void onMinContourSizeChange(int, void*)
-{
-    processImage();
-}
-
-// Callback function for the maximum contour size trackbar
-void onMaxContourSizeChange(int, void*)
-{
-    processImage();
-}
-
-// Callback function for the aspect ratio threshold trackbar
-void onAspectRatioThresholdChange(int, void*)
-{
-    processImage();
-}
+    // The viewer seeks through the frame cache, which needs a file read at its own pace
+    if (source.paced())
+    {
+        std::cout << "nocircle only reads replayed or live video with --headless" << std::endl;
+        return -1;
+    }
 
-int main()
-{
-    g_backgroundSubtractor = cv::createBackgroundSubtractorMOG2();
-    cv::VideoCapture video("./peak_procedure.mov");
-    if (!video.isOpened())
+    if (!parseOverlayViews(options.views, tracer.views))
     {
-        std::cout << "Error opening video file!" << std::endl;
+        std::cout << "Unknown view in " << options.views << std::endl;
         return -1;
     }
 
+    // The trackbar callbacks invalidate these stages, so build them first
+    tracer.buildView([&tracer] { showSegmentation(tracer, false); });
+
     cv::namedWindow("Video", cv::WINDOW_NORMAL);
-    cv::namedWindow("Segmented Image", cv::WINDOW_NORMAL);
+    cv::namedWindow(tracer.window, cv::WINDOW_NORMAL);
+
+    TracingParams& p = tracer.params;
+    cv::createTrackbar("Threshold", tracer.window, &p.thresholdValue, 255, onThresholdTrackbar, &tracer);
+    cv::createTrackbar("Blur Size", tracer.window, &p.blurSize, 15, onBlurTrackbar, &tracer);
+    cv::createTrackbar("Foreground Mask Blur Size", tracer.window, &p.fgMaskBlurSize, 15, onFgMaskBlurTrackbar,
+                       &tracer);
+    cv::createTrackbar("Minimum Contour Size", tracer.window, &p.minArea, 500, onFilterTrackbar, &tracer);
+    cv::createTrackbar("Maximum Contour Size", tracer.window, &p.maxArea, 40000, onFilterTrackbar, &tracer);
+    cv::createTrackbar("Aspect Ratio Threshold", tracer.window, &p.aspectRatioThreshold, 120, onFilterTrackbar,
+                       &tracer);
+
+    // Grayscale frames are decoded once and cached for seeking and looping
+    FrameCache cache;
+    FramePlayer player;
+    int seekFrame = 0;
+    if (!cache.open(video, static_cast<size_t>(std::max(options.cacheMegabytes, 1)) << 20, options.cachePath))
+    {
+        std::cout << "Error opening " << options.cachePath << std::endl;
+        return -1;
+    }
+    if (cache.frameCount() > 1)
+        cv::createTrackbar("Frame", "Video", &seekFrame, cache.frameCount() - 1, onSeekFrame, &player);
 
-    cv::createTrackbar("Threshold", "Segmented Image", &g_thresholdValue, 255, onThresholdChange);
-    cv::createTrackbar("Blur Size", "Segmented Image", &g_blurSize, 15, onBlurSizeChange);
-    cv::createTrackbar("Foreground Mask Blur Size", "Segmented Image", &g_fgMaskBlurSize, 15, onFgMaskBlurSizeChange);
-    cv::createTrackbar("Minimum Contour Size", "Segmented Image", &g_minContourSize, 500, onMinContourSizeChange);
-    cv::createTrackbar("Maximum Contour Size", "Segmented Image", &g_maxContourSize, 40000, onMaxContourSizeChange);
-    cv::createTrackbar("Aspect Ratio Threshold", "Segmented Image", &g_aspectRatioThreshold, 120, onAspectRatioThresholdChange);
+    // Frame period of the video, to count the frames the loop is too slow for
+    double fps = video.get(cv::CAP_PROP_FPS);
+    double frameMsec = 1000.0 / (fps > 0.0 ? fps : 30.0);
 
+    cv::Mat frame;
     while (true)
     {
-        if (!video.read(g_frame))
-            break;
+        METRICS_STOPWATCH(watch);
+        int index = player.next();
+        if (index != player.frame())
+        {
+            if (cache.read(index, frame))
+            {
+                METRICS_FRAME(frameMsec);
+                player.shown(index);
+                tracer.setFrame(frame, index, index * frameMsec);
+                cv::imshow("Video", frame);
+                if (cache.frameCount() > 1)
+                    cv::setTrackbarPos("Frame", "Video", index);
+            }
+            else if (!player.paused() || player.frame() < 0)
+            {
+                break; // End of the video, stepping past it just stays on the last frame
+            }
+        }
+        METRICS_LAP(watch, "read");
 
-        cv::cvtColor(g_frame, g_frame, cv::COLOR_BGR2GRAY);
-        processImage();
+        // Re-run whatever the new frame or the trackbars invalidated
+        tracer.update();
+        METRICS_LAP(watch, "stages");
 
-        cv::imshow("Video", g_frame);
         int key = cv::waitKey(30);
+        METRICS_LAP(watch, "wait_key");
         if (key == 27)
             break;
+        // Space pauses, ',' and '.' step, '[' and ']' loop from and to the current frame
+        player.handleKey(key);
+        if (key == 'm') // m shows or hides the metrics overlay
+            toggleMetricsOverlay();
+
+        METRICS_TICK();
     }
 
     video.release();
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "live_source.hpp"
+#include "motion_gate.hpp"
+#include "tracing.hpp"
+
+// Command-line options shared by the tracing programs
+struct Options
+{
+    std::string input = "./peak_procedure.mov";
+    std::string output;
+    bool headless = false;
+    SourceMode sourceMode = SourceMode::File;
+    double latencyBudget = 0.0;
+    std::string latencyLogPath;
+    int thresholdValue = 132;
+    int blurSize = 7;
+    int fgMaskBlurSize = 13;
+    int minContourSize = 50;
+    int maxContourSize = 10000;
+    int aspectRatioThreshold = 80;
+    int minSide = 0;
+    int maxSide = 0;
+    int minSolidity = 0;
+    int minCircularity = 0;
+    std::string views = "segmented,marked,threshold";
+    int threads = 0;
+    double tailSeconds = 4.0;
+    std::string backgroundKind = "mog2";
+    int backgroundScale = 1;
+    int backgroundThreshold = 20;
+    int backgroundHistory = 0;
+    std::string backgroundPath;
+    std::string roiPath;
+    bool motionGate = false;
+    int motionTile = 64;
+    int motionThreshold = 12;
+    int motionHold = 15;
+    int pyramid = 1;
+    std::string analyticsPath;
+    double analyticsInterval = 10.0;
+    int cacheMegabytes = 512;
+    std::string cachePath;
+    std::string statsPath;
+    std::string metricsPath;
+    double metricsInterval = 5.0;
+};
+
+inline void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options] [input]\n"
+              << "  -i, --input PATH        video file to process (default ./peak_procedure.mov)\n"
+              << "  -o, --output PATH       output file for detections (required with --headless)\n"
+              << "      --headless          process without any windows, as fast as decoding allows\n"
+              << "      --source MODE       file (default), replay (play the file in real time, like a\n"
+              << "                          camera) or camera (input is a device index or stream URL)\n"
+              << "      --latency-budget MS  headless with replay or camera: process fewer frames, or at\n"
+              << "                          lower resolution, while a frame takes longer than MS to get through\n"
+              << "      --latency-log PATH  write the latency of every frame to PATH (CSV)\n"
+              << "      --config PATH       load threshold, blur and area limits from PATH (JSON or YAML, e.g.\n"
+              << "                          written by sweep); options after it override them\n"
+              << "      --threshold N       binary threshold value (0-255)\n"
+              << "      --blur N            Gaussian blur size (odd, 3-15)\n"
+              << "      --fg-blur N         foreground mask blur size (odd, 3-15)\n"
+              << "      --min-area N        minimum contour area\n"
+              << "      --max-area N        maximum contour area\n"
+              << "      --aspect-ratio N    aspect ratio threshold in percent\n"
+              << "      --min-side N        minimum bounding box side of a blob, in pixels\n"
+              << "      --max-side N        maximum bounding box side of a blob, in pixels\n"
+              << "      --min-solidity N    minimum percent of its convex hull a blob fills\n"
+              << "      --min-circularity N  minimum circularity of a blob in percent (100 for a circle)\n"
+              << "      --views LIST        windows to draw: any of segmented,marked,threshold (main, coord,\n"
+              << "                          nocircle; default all)\n"
+              << "      --tail SECONDS      length of the drawn tails, in seconds of video (tail)\n"
+              << "      --background MODEL  background model of tail: mog2 (default), median or average\n"
+              << "      --bg-scale N        run the background model at 1/N of the frame size (default 1)\n"
+              << "      --bg-threshold N    gray levels from the background that are foreground (median and\n"
+              << "                          average, default 20)\n"
+              << "      --bg-history N      frames the background model remembers (default 500 for mog2, 64\n"
+              << "                          for average)\n"
+              << "      --bg-model PATH     start from the background model saved in PATH, save it there at exit\n"
+              << "      --roi PATH          only segment where the mask image PATH is non-zero (main, coord,\n"
+              << "                          nocircle)\n"
+              << "      --motion            headless: only segment the tiles where the frame changed (main,\n"
+              << "                          coord, nocircle)\n"
+              << "      --motion-tile N     tile size in pixels for --motion (default 64)\n"
+              << "      --motion-threshold N  gray level change that counts as motion (default 12)\n"
+              << "      --motion-hold N     frames a tile is kept after its last motion (default 15)\n"
+              << "      --pyramid N         headless: find blobs at 1/N resolution (2 or 4) and segment only\n"
+              << "                          around them at full resolution (main, coord, nocircle)\n"
+              << "      --analytics PATH    keep speed, MSD and turning angle statistics of the tracks, print\n"
+              << "                          them and write them to PATH (JSON or YAML) during and at the\n"
+              << "                          end of the run (coord)\n"
+              << "      --analytics-interval SECONDS  how often to report them (default 10, 0 only at the end)\n"
+              << "      --cache-mb N        megabytes of decoded frames the viewer keeps for seeking and\n"
+              << "                          looping (default 512; main, nocircle)\n"
+              << "      --cache-file PATH   keep the frames that don't fit in PATH as PNG, also across runs\n"
+              << "      --threads N         worker threads for headless mode (default: all cores)\n"
+              << "      --stats PATH        write fps, stage latencies and allocations of a headless run\n"
+              << "                          to PATH (JSON or YAML)\n"
+              << "      --metrics PATH      dump stage timings and counters to PATH (JSON or YAML) and\n"
+              << "                          the console; needs a build with -DPARAMECIUM_METRICS\n"
+              << "      --metrics-interval SECONDS  how often to dump the metrics (default 5)\n"
+              << "  -h, --help              show this message\n";
+}
+
+// Set up gate from --roi and the --motion options, returns false if the mask can't be read
+inline bool configureMotionGate(MotionGate& gate, const Options& options)
+{
+    cv::Mat roi;
+    if (!options.roiPath.empty()) {
+        roi = loadRoiMask(options.roiPath);
+        if (roi.empty())
+            return false;
+    }
+    MotionGateSettings settings;
+    settings.motion = options.motionGate;
+    settings.tileSize = options.motionTile;
+    settings.threshold = options.motionThreshold;
+    settings.holdFrames = options.motionHold;
+    gate.configure(settings, roi);
+    return true;
+}
+
+// Set the segmentation options a config file (e.g. written by sweep) has, leaving the others
+// as they are. Returns false if the file can't be read.
+inline bool loadConfig(const std::string& path, Options& options)
+{
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if (!fs.isOpened()) {
+        std::cout << "Error reading config file " << path << std::endl;
+        return false;
+    }
+    auto read = [&fs](const char* key, int& value) {
+        if (!fs[key].empty())
+            value = static_cast<int>(fs[key]);
+    };
+    read("threshold", options.thresholdValue);
+    read("blur", options.blurSize);
+    read("fg_blur", options.fgMaskBlurSize);
+    read("min_area", options.minContourSize);
+    read("max_area", options.maxContourSize);
+    read("aspect_ratio", options.aspectRatioThreshold);
+    read("min_side", options.minSide);
+    read("max_side", options.maxSide);
+    read("min_solidity", options.minSolidity);
+    read("min_circularity", options.minCircularity);
+    return true;
+}
+
+// Tracing parameters from the command line, the program adds the stages it uses
+inline TracingParams tracingParams(const Options& options)
+{
+    TracingParams params;
+    params.thresholdValue = options.thresholdValue;
+    params.blurSize = options.blurSize;
+    params.fgMaskBlurSize = options.fgMaskBlurSize;
+    params.minArea = options.minContourSize;
+    params.maxArea = options.maxContourSize;
+    params.aspectRatioThreshold = options.aspectRatioThreshold;
+    params.minSide = options.minSide;
+    params.maxSide = options.maxSide;
+    params.minSolidity = options.minSolidity;
+    params.minCircularity = options.minCircularity;
+    params.pyramidFactor = options.headless ? options.pyramid : 1;
+    return params;
+}
+
+// Headless run settings from the command line
+inline HeadlessSettings headlessSettings(const Options& options)
+{
+    HeadlessSettings settings;
+    settings.output = options.output;
+    settings.threads = options.threads;
+    settings.latencyBudget = options.latencyBudget;
+    settings.latencyLogPath = options.latencyLogPath;
+    settings.statsPath = options.statsPath;
+    return settings;
+}
+
+// Parse the command line into options, returns false if the program should exit
+inline bool parseOptions(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return false;
+        } else if (arg == "--headless") {
+            options.headless = true;
+        } else if ((arg == "-i" || arg == "--input") && hasValue) {
+            options.input = argv[++i];
+        } else if ((arg == "-o" || arg == "--output") && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "--source" && hasValue) {
+            if (!parseSourceMode(argv[++i], options.sourceMode)) {
+                std::cout << "Unknown source: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--latency-budget" && hasValue) {
+            options.latencyBudget = std::atof(argv[++i]);
+        } else if (arg == "--latency-log" && hasValue) {
+            options.latencyLogPath = argv[++i];
+        } else if (arg == "--config" && hasValue) {
+            if (!loadConfig(argv[++i], options))
+                return false;
+        } else if (arg == "--threshold" && hasValue) {
+            options.thresholdValue = std::atoi(argv[++i]);
+        } else if (arg == "--blur" && hasValue) {
+            options.blurSize = std::atoi(argv[++i]);
+        } else if (arg == "--fg-blur" && hasValue) {
+            options.fgMaskBlurSize = std::atoi(argv[++i]);
+        } else if (arg == "--min-area" && hasValue) {
+            options.minContourSize = std::atoi(argv[++i]);
+        } else if (arg == "--max-area" && hasValue) {
+            options.maxContourSize = std::atoi(argv[++i]);
+        } else if (arg == "--aspect-ratio" && hasValue) {
+            options.aspectRatioThreshold = std::atoi(argv[++i]);
+        } else if (arg == "--min-side" && hasValue) {
+            options.minSide = std::atoi(argv[++i]);
+        } else if (arg == "--max-side" && hasValue) {
+            options.maxSide = std::atoi(argv[++i]);
+        } else if (arg == "--min-solidity" && hasValue) {
+            options.minSolidity = std::atoi(argv[++i]);
+        } else if (arg == "--min-circularity" && hasValue) {
+            options.minCircularity = std::atoi(argv[++i]);
+        } else if (arg == "--views" && hasValue) {
+            options.views = argv[++i];
+        } else if (arg == "--tail" && hasValue) {
+            options.tailSeconds = std::atof(argv[++i]);
+        } else if (arg == "--background" && hasValue) {
+            options.backgroundKind = argv[++i];
+        } else if (arg == "--bg-scale" && hasValue) {
+            options.backgroundScale = std::atoi(argv[++i]);
+        } else if (arg == "--bg-threshold" && hasValue) {
+            options.backgroundThreshold = std::atoi(argv[++i]);
+        } else if (arg == "--bg-history" && hasValue) {
+            options.backgroundHistory = std::atoi(argv[++i]);
+        } else if (arg == "--bg-model" && hasValue) {
+            options.backgroundPath = argv[++i];
+        } else if (arg == "--roi" && hasValue) {
+            options.roiPath = argv[++i];
+        } else if (arg == "--motion") {
+            options.motionGate = true;
+        } else if (arg == "--motion-tile" && hasValue) {
+            options.motionTile = std::atoi(argv[++i]);
+        } else if (arg == "--motion-threshold" && hasValue) {
+            options.motionThreshold = std::atoi(argv[++i]);
+        } else if (arg == "--motion-hold" && hasValue) {
+            options.motionHold = std::atoi(argv[++i]);
+        } else if (arg == "--pyramid" && hasValue) {
+            options.pyramid = std::atoi(argv[++i]);
+        } else if (arg == "--analytics" && hasValue) {
+            options.analyticsPath = argv[++i];
+        } else if (arg == "--analytics-interval" && hasValue) {
+            options.analyticsInterval = std::atof(argv[++i]);
+        } else if (arg == "--cache-mb" && hasValue) {
+            options.cacheMegabytes = std::atoi(argv[++i]);
+        } else if (arg == "--cache-file" && hasValue) {
+            options.cachePath = argv[++i];
+        } else if (arg == "--stats" && hasValue) {
+            options.statsPath = argv[++i];
+        } else if (arg == "--metrics" && hasValue) {
+            options.metricsPath = argv[++i];
+        } else if (arg == "--metrics-interval" && hasValue) {
+            options.metricsInterval = std::atof(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (!arg.empty() && arg[0] != '-') {
+            options.input = arg;
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    // Same constraints the blur trackbar callback enforces
+    if (options.blurSize % 2 == 0)
+        ++options.blurSize;
+    if (options.blurSize < 3)
+        options.blurSize = 3;
+    if (options.fgMaskBlurSize % 2 == 0)
+        ++options.fgMaskBlurSize;
+    if (options.fgMaskBlurSize < 3)
+        options.fgMaskBlurSize = 3;
+
+    if (options.pyramid != 1 && options.pyramid != 2 && options.pyramid != 4) {
+        std::cout << "--pyramid must be 1, 2 or 4" << std::endl;
+        return false;
+    }
+    if (options.pyramid > 1 && options.motionGate) {
+        // The candidate boxes would be cut by the tiles, see dropCutBlobs()
+        std::cout << "--motion has no effect with --pyramid" << std::endl;
+        options.motionGate = false;
+    }
+
+    if (options.latencyBudget > 0.0 && options.sourceMode == SourceMode::File) {
+        // A file is read as fast as it is processed, there is no latency to keep
+        std::cout << "--latency-budget needs --source replay or camera" << std::endl;
+        options.latencyBudget = 0.0;
+    }
+
+    if (options.headless && options.output.empty()) {
+        std::cout << "Headless mode needs an output file (--output)" << std::endl;
+        return false;
+    }
+
+    return true;
+}
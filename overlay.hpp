@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "blobs.hpp"
+#include "detection.hpp"
+#include "frame_context.hpp"
+#include "tracker.hpp"
+
+// Drawing of the interactive views, straight from the blobs.
+//
+// The frame is converted to BGR once per frame and copied for a second view. The detections
+// are then filled in by walking the runs of their blobs, the outlines of all of them drawn
+// by one polylines call and the centroids stamped. Views that draw on an overlay layer
+// (tail) only clear and blend the rectangles drawn into, never the whole frame, and a view
+// that is switched off costs nothing.
+
+// The windows of the interactive view that are drawn and shown
+struct OverlayViews
+{
+    bool segmented = true; // the frame with the detections filled in their colors
+    bool marked = true;    // outlines, centroids and track IDs over the frame
+    bool threshold = true; // the binary mask
+};
+
+// Views from a comma separated list of segmented, marked and threshold, false if one is unknown
+inline bool parseOverlayViews(const std::string& list, OverlayViews& views)
+{
+    views.segmented = views.marked = views.threshold = false;
+    std::istringstream stream(list);
+    std::string name;
+    while (std::getline(stream, name, ',')) {
+        if (name == "segmented")
+            views.segmented = true;
+        else if (name == "marked")
+            views.marked = true;
+        else if (name == "threshold")
+            views.threshold = true;
+        else if (!name.empty())
+            return false;
+    }
+    return true;
+}
+
+// Color of a track ID, trackColor() looked up in a table. IDs 256 apart share a color.
+inline const cv::Vec3b& paletteColor(int id)
+{
+    static const std::array<cv::Vec3b, 256> palette = [] {
+        std::array<cv::Vec3b, 256> colors;
+        for (int i = 0; i < 256; ++i) {
+            cv::Scalar color = trackColor(i);
+            colors[i] = cv::Vec3b(static_cast<uchar>(color[0]), static_cast<uchar>(color[1]),
+                                  static_cast<uchar>(color[2]));
+        }
+        return colors;
+    }();
+    return palette[static_cast<unsigned>(id) & 255u];
+}
+
+// The frame in BGR for the views that are on (not null): converted once into the first,
+// copied into the second
+inline void expandGray(const cv::Mat& gray, cv::Mat* first, cv::Mat* second)
+{
+    if (!first)
+        std::swap(first, second);
+    if (!first)
+        return;
+    cv::cvtColor(gray, *first, cv::COLOR_GRAY2BGR);
+    if (second)
+        first->copyTo(*second);
+}
+
+// Blend the pixels of every detection half and half with its color, track colors when
+// byTrack and the color of the detection's index otherwise. Only the runs of the blobs are
+// visited, the rest of image is left as it is.
+inline void fillDetections(cv::Mat& image, const cv::Mat& gray, const FrameContext& context, bool byTrack)
+{
+    for (size_t i = 0; i < context.detections.size(); ++i) {
+        const Detection& detection = context.detections[i];
+        const cv::Vec3b& color = paletteColor(byTrack ? detection.trackId : static_cast<int>(i));
+        const Blob& blob = context.blobs[detection.blobIndex];
+        for (int r = blob.firstRun; r >= 0; r = context.blobScratch.runs[r].next) {
+            const BlobRun& run = context.blobScratch.runs[r];
+            const uchar* src = gray.ptr<uchar>(run.y);
+            uchar* dst = image.ptr<uchar>(run.y);
+            for (int x = run.x0; x < run.x1; ++x) {
+                dst[3 * x] = static_cast<uchar>((src[x] + color[0] + 1) >> 1);
+                dst[3 * x + 1] = static_cast<uchar>((src[x] + color[1] + 1) >> 1);
+                dst[3 * x + 2] = static_cast<uchar>((src[x] + color[2] + 1) >> 1);
+            }
+        }
+    }
+}
+
+// Draw the outlines of all detections with a single polylines call. The outlines must have
+// been traced by context.buildOutlines().
+inline void drawOutlines(cv::Mat& image, FrameContext& context, const cv::Scalar& color, int thickness,
+                         int lineType)
+{
+    size_t startCapacity = context.outlineStarts.capacity();
+    size_t countCapacity = context.outlineCounts.capacity();
+    context.outlineStarts.clear();
+    context.outlineCounts.clear();
+    for (const auto& detection : context.detections) {
+        const std::vector<cv::Point>& outline = context.contours[detection.contourIndex];
+        if (outline.empty())
+            continue;
+        context.outlineStarts.push_back(outline.data());
+        context.outlineCounts.push_back(static_cast<int>(outline.size()));
+    }
+    context.trackCapacity(context.outlineStarts, startCapacity);
+    context.trackCapacity(context.outlineCounts, countCapacity);
+    if (!context.outlineCounts.empty())
+        cv::polylines(image, context.outlineStarts.data(), context.outlineCounts.data(),
+                      static_cast<int>(context.outlineCounts.size()), true, color, thickness, lineType);
+}
+
+// Stamp a filled dot of radius 3 in color on every centroid
+inline void stampCentroids(cv::Mat& image, const std::vector<Detection>& detections, const cv::Vec3b& color)
+{
+    static constexpr int kHalfWidths[7] = {1, 2, 3, 3, 3, 2, 1};
+    for (const auto& detection : detections) {
+        cv::Point centroid(detection.centroid);
+        for (int dy = -3; dy <= 3; ++dy) {
+            int y = centroid.y + dy;
+            if (y < 0 || y >= image.rows)
+                continue;
+            int x0 = std::max(0, centroid.x - kHalfWidths[dy + 3]);
+            int x1 = std::min(image.cols - 1, centroid.x + kHalfWidths[dy + 3]);
+            cv::Vec3b* row = image.ptr<cv::Vec3b>(y);
+            for (int x = x0; x <= x1; ++x)
+                row[x] = color;
+        }
+    }
+}
+
+// Where a frame draws on an overlay layer, padded for the line width and the dots: the
+// bounding boxes of the detections and the box around the tails (if not empty)
+inline void overlayRects(const FrameContext& context, const cv::Rect& tailBounds, cv::Size size,
+                         std::vector<cv::Rect>& rects)
+{
+    static constexpr int kPadding = 4;
+    cv::Rect frame(0, 0, size.width, size.height);
+    rects.clear();
+    for (const auto& detection : context.detections) {
+        cv::Rect box = context.blobs[detection.blobIndex].bbox;
+        rects.push_back(cv::Rect(box.x - kPadding, box.y - kPadding, box.width + 2 * kPadding,
+                                 box.height + 2 * kPadding) & frame);
+    }
+    if (tailBounds.width > 0 && tailBounds.height > 0)
+        rects.push_back(cv::Rect(tailBounds.x - kPadding, tailBounds.y - kPadding, tailBounds.width + 2 * kPadding,
+                                 tailBounds.height + 2 * kPadding) & frame);
+}
+
+// Clear the rects of layer drawn into by the previous frame, (re)allocating it if needed
+inline void clearLayer(FrameContext& context, cv::Mat& layer, cv::Size size)
+{
+    const uchar* data = layer.data;
+    context.buffer(layer, size, CV_8UC3);
+    if (layer.data != data) {
+        layer.setTo(cv::Scalar::all(0));
+        context.overlayRects.clear();
+    }
+    for (const auto& rect : context.overlayRects)
+        layer(rect).setTo(cv::Scalar::all(0));
+}
+
+// image = gray + layer / 2, saturated, inside rects only. Computed from gray, so rects may
+// overlap; outside them image is left as it is.
+inline void addLayer(cv::Mat& image, const cv::Mat& gray, const cv::Mat& layer, const std::vector<cv::Rect>& rects)
+{
+    for (const auto& rect : rects) {
+        for (int y = rect.y; y < rect.y + rect.height; ++y) {
+            const uchar* src = gray.ptr<uchar>(y);
+            const uchar* over = layer.ptr<uchar>(y);
+            uchar* dst = image.ptr<uchar>(y);
+            for (int x = rect.x; x < rect.x + rect.width; ++x) {
+                for (int c = 0; c < 3; ++c)
+                    dst[3 * x + c] = static_cast<uchar>(std::min(255, src[x] + ((over[3 * x + c] + 1) >> 1)));
+            }
+        }
+    }
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "frame_context.hpp"
+#include "spsc_queue.hpp"
+
+// Everything the stages know about one video frame
+struct FrameJob
+{
+    int frameIndex = 0;
+    double positionMsec = 0.0;
+    std::chrono::steady_clock::time_point captureTime; // when the source got the frame
+    int pyramidFactor = 0; // pyramid factor the scheduler asks for, 0 for the pipeline's own
+    cv::Mat frame;
+    cv::Mat gray;
+    FrameContext context;
+};
+
+// Runs a chain of stages on their own threads, connected by bounded lock-free queues.
+//
+// A stage with several workers hands frame n to worker n % workers, and the next stage
+// collects from the workers in the same round-robin order, so every stage (and the sink)
+// sees the frames in source order. Stateful stages (tracking, background subtraction,
+// logging) must use a single worker.
+//
+// Jobs are recycled: once the sink is done with a job it goes back to the source, so the
+// buffers a job owns are reused for a later frame instead of being reallocated.
+template <typename Job>
+class Pipeline
+{
+public:
+    using SourceFn = std::function<bool(Job&)>;
+    using StageFn = std::function<void(Job&)>;
+
+    explicit Pipeline(size_t queueCapacity = 4) : m_queueCapacity(queueCapacity) {}
+
+    Pipeline& addStage(const std::string& name, StageFn fn, int workers = 1)
+    {
+        m_stages.push_back({name, std::move(fn), workers < 1 ? 1 : workers});
+        return *this;
+    }
+
+    // Time every call of the source, the stages and the sink during the next runs
+    void enableTiming(bool enabled = true) { m_timing = enabled; }
+
+    // Milliseconds per frame spent in one stage, in no particular order
+    struct StageTiming
+    {
+        std::string name;
+        std::vector<float> msec;
+    };
+
+    // Timings of the last run, "source" first and "sink" last, if timing was enabled
+    const std::vector<StageTiming>& timings() const { return m_timings; }
+
+    // Pull jobs from the source until it returns false. The sink runs on the calling
+    // thread (so it may use HighGUI) and returns false to stop early.
+    void run(const SourceFn& source, const std::function<bool(Job&)>& sink)
+    {
+        m_abort = false;
+        m_error = nullptr;
+
+        // lanes[s] connects the producers of stage s to its consumers, lanes[s][p][c]
+        // being the queue from producer worker p to consumer worker c
+        std::vector<int> widths{1};
+        for (const auto& stage : m_stages)
+            widths.push_back(stage.workers);
+        widths.push_back(1);
+
+        std::vector<std::vector<std::vector<std::unique_ptr<SpscQueue<Job>>>>> lanes(widths.size() - 1);
+        for (size_t s = 0; s + 1 < widths.size(); ++s) {
+            lanes[s].resize(widths[s]);
+            for (auto& producer : lanes[s])
+                for (int c = 0; c < widths[s + 1]; ++c)
+                    producer.push_back(std::make_unique<SpscQueue<Job>>(m_queueCapacity));
+        }
+
+        // Enough room for every job that can be in flight at once
+        size_t inFlight = 2;
+        for (size_t s = 0; s + 1 < widths.size(); ++s)
+            inFlight += widths[s] * widths[s + 1] * m_queueCapacity + widths[s + 1];
+        SpscQueue<Job> recycled(inFlight);
+
+        // samples[s][w] are the timings of worker w of stage s, the source being stage 0.
+        // Each worker only touches its own vector.
+        std::vector<std::vector<std::vector<float>>> samples(widths.size());
+        for (size_t s = 0; s < widths.size(); ++s)
+            samples[s].resize(widths[s]);
+
+        std::vector<std::thread> threads;
+        threads.emplace_back([&] {
+            guarded([&] {
+                auto& out = lanes[0][0];
+                for (long long n = 0;; ++n) {
+                    Job job;
+                    recycled.tryPop(job);
+                    if (!timed(samples[0][0], [&] { return source(job); }) ||
+                        !out[n % out.size()]->push(std::move(job), m_abort))
+                        break;
+                }
+            });
+            for (auto& queue : lanes[0][0])
+                queue->close();
+        });
+
+        for (size_t s = 0; s < m_stages.size(); ++s) {
+            for (int w = 0; w < m_stages[s].workers; ++w) {
+                threads.emplace_back([&, s, w] {
+                    guarded([&] {
+                        auto& in = lanes[s];
+                        auto& out = lanes[s + 1][w];
+                        long long stride = m_stages[s].workers;
+                        for (long long n = w;; n += stride) {
+                            Job job;
+                            if (!in[n % in.size()][w]->pop(job, m_abort))
+                                break;
+                            timed(samples[s + 1][w], [&] {
+                                m_stages[s].fn(job);
+                                return true;
+                            });
+                            if (!out[n % out.size()]->push(std::move(job), m_abort))
+                                break;
+                        }
+                    });
+                    for (auto& queue : lanes[s + 1][w])
+                        queue->close();
+                });
+            }
+        }
+
+        guarded([&] {
+            auto& in = lanes.back();
+            for (long long n = 0;; ++n) {
+                Job job;
+                if (!in[n % in.size()][0]->pop(job, m_abort))
+                    break;
+                if (!timed(samples.back()[0], [&] { return sink(job); }))
+                    break;
+                recycled.tryPush(std::move(job));
+            }
+        });
+        m_abort = true;
+
+        for (auto& thread : threads)
+            thread.join();
+
+        m_timings.clear();
+        if (m_timing) {
+            for (size_t s = 0; s < samples.size(); ++s) {
+                std::string name = s == 0 ? "source" : s == samples.size() - 1 ? "sink" : m_stages[s - 1].name;
+                m_timings.push_back({name, {}});
+                for (const auto& worker : samples[s])
+                    m_timings.back().msec.insert(m_timings.back().msec.end(), worker.begin(), worker.end());
+            }
+        }
+
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    struct Stage
+    {
+        std::string name;
+        StageFn fn;
+        int workers;
+    };
+
+    // Call fn, adding its duration to samples if timing is on
+    template <typename Fn>
+    bool timed(std::vector<float>& samples, Fn&& fn)
+    {
+        if (!m_timing)
+            return fn();
+        auto start = std::chrono::steady_clock::now();
+        bool result = fn();
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        samples.push_back(elapsed.count());
+        return result;
+    }
+
+    // Run a stage loop, stopping the whole pipeline if it throws
+    template <typename Fn>
+    void guarded(Fn&& fn)
+    {
+        try {
+            fn();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_errorMutex);
+            if (!m_error)
+                m_error = std::current_exception();
+            m_abort = true;
+        }
+    }
+
+    size_t m_queueCapacity;
+    std::vector<Stage> m_stages;
+    bool m_timing = false;
+    std::vector<StageTiming> m_timings;
+    std::atomic<bool> m_abort{false};
+    std::mutex m_errorMutex;
+    std::exception_ptr m_error;
+};
+
+// Source that reads the video frame by frame, stamping index and position
+inline std::function<bool(FrameJob&)> videoSource(cv::VideoCapture& video)
+{
+    auto frameIndex = std::make_shared<int>(0);
+    return [&video, frameIndex](FrameJob& job) {
+        job.context.beginFrame();
+        if (!video.read(job.frame))
+            return false;
+        job.frameIndex = (*frameIndex)++;
+        job.positionMsec = video.get(cv::CAP_PROP_POS_MSEC);
+        job.captureTime = std::chrono::steady_clock::now();
+        job.pyramidFactor = 0;
+        return true;
+    };
+}
+
+// Stage converting the decoded frame to 8-bit grayscale
+inline void convertToGray(FrameJob& job)
+{
+    cv::Mat& gray = job.context.buffer(job.gray, job.frame.size(), CV_8UC1);
+    cv::cvtColor(job.frame, gray, cv::COLOR_BGR2GRAY);
+}
+
+// Worker count for the parallel stages, 0 means one per core
+inline int pipelineWorkers(int requested)
+{
+    if (requested > 0)
+        return requested;
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    return cores > 0 ? cores : 1;
+}
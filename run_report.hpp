@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "frame_context.hpp"
+#include "heap_counter.hpp"
+#include "pipeline.hpp"
+
+// Latency distribution of one pipeline stage, in milliseconds per frame
+struct LatencySummary
+{
+    std::string name;
+    size_t samples = 0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+inline LatencySummary summarizeLatency(const std::string& name, std::vector<float> msec)
+{
+    LatencySummary summary;
+    summary.name = name;
+    summary.samples = msec.size();
+    if (msec.empty())
+        return summary;
+
+    std::sort(msec.begin(), msec.end());
+    double total = 0.0;
+    for (float value : msec)
+        total += value;
+    auto percentile = [&](double p) { return msec[static_cast<size_t>(p * (msec.size() - 1) + 0.5)]; };
+    summary.mean = total / msec.size();
+    summary.p50 = percentile(0.50);
+    summary.p90 = percentile(0.90);
+    summary.p99 = percentile(0.99);
+    summary.max = msec.back();
+    return summary;
+}
+
+// Throughput, stage latencies and allocations of one headless run
+struct RunReport
+{
+    std::string program;
+    size_t frames = 0;
+    double seconds = 0.0;
+    size_t bufferAllocations = 0; // FrameContext buffer (re)allocations
+    size_t heapAllocations = 0;   // every operator new during the run
+    std::vector<LatencySummary> stages;
+    LatencySummary latency; // from the source getting a frame to the sink, paced sources only
+    long long framesSkipped = 0;  // went by while the program was busy (replay)
+    long long framesDropped = 0;  // left out by the latency scheduler
+    long long framesDegraded = 0; // segmented at lower resolution by the latency scheduler
+
+    double fps() const { return seconds > 0.0 ? frames / seconds : 0.0; }
+
+    // Write the report as JSON (or YAML, depending on the extension)
+    bool write(const std::string& path) const
+    {
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened())
+            return false;
+        double perFrame = frames > 0 ? 1.0 / frames : 0.0;
+        fs << "program" << program;
+        fs << "frames" << static_cast<int>(frames);
+        fs << "seconds" << seconds;
+        fs << "fps" << fps();
+        fs << "buffer_allocations_per_frame" << bufferAllocations * perFrame;
+        fs << "heap_allocations_per_frame" << heapAllocations * perFrame;
+        fs << "stages" << "[";
+        for (const auto& stage : stages) {
+            fs << "{" << "name" << stage.name << "samples" << static_cast<int>(stage.samples) << "mean_ms"
+               << stage.mean << "p50_ms" << stage.p50 << "p90_ms" << stage.p90 << "p99_ms" << stage.p99 << "max_ms"
+               << stage.max << "}";
+        }
+        fs << "]";
+        if (latency.samples > 0) {
+            fs << "end_to_end" << "{" << "mean_ms" << latency.mean << "p50_ms" << latency.p50 << "p90_ms"
+               << latency.p90 << "p99_ms" << latency.p99 << "max_ms" << latency.max << "}";
+            fs << "frames_skipped" << static_cast<int>(framesSkipped);
+            fs << "frames_dropped" << static_cast<int>(framesDropped);
+            fs << "frames_degraded" << static_cast<int>(framesDegraded);
+        }
+        return true;
+    }
+};
+
+// Measures a headless run from construction until finish()
+class RunMeasurement
+{
+public:
+    RunMeasurement() : m_start(std::chrono::steady_clock::now()), m_heapStart(g_heapAllocations.load()) {}
+
+    template <typename Job>
+    RunReport finish(const std::string& program, const Pipeline<Job>& pipeline, const AllocationStats& allocations)
+    {
+        RunReport report;
+        report.program = program;
+        report.frames = allocations.frames;
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+        report.bufferAllocations = allocations.allocations;
+        report.heapAllocations = g_heapAllocations.load() - m_heapStart;
+        for (const auto& timing : pipeline.timings())
+            report.stages.push_back(summarizeLatency(timing.name, timing.msec));
+        return report;
+    }
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+    size_t m_heapStart;
+};
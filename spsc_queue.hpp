@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue with exactly one producer thread and one consumer thread.
+// The producer closes the queue once it has pushed its last item.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity = 8)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    size_t capacity() const { return m_slots.size(); }
+
+    // Push without waiting, returns false if the queue is full
+    bool tryPush(T&& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_headCache == m_slots.size()) {
+            m_headCache = m_head.load(std::memory_order_acquire);
+            if (tail - m_headCache == m_slots.size())
+                return false;
+        }
+        m_slots[tail & m_mask] = std::move(item);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Pop without waiting, returns false if the queue is empty
+    bool tryPop(T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tailCache) {
+            m_tailCache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tailCache)
+                return false;
+        }
+        item = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Push, waiting while the queue is full. Returns false if abort becomes true first.
+    bool push(T&& item, const std::atomic<bool>& abort)
+    {
+        for (int spins = 0; !tryPush(std::move(item)); ++spins) {
+            if (abort.load(std::memory_order_relaxed))
+                return false;
+            backoff(spins);
+        }
+        return true;
+    }
+
+    // Pop, waiting while the queue is empty. Returns false once the queue is closed and
+    // drained, or if abort becomes true.
+    bool pop(T& item, const std::atomic<bool>& abort)
+    {
+        for (int spins = 0; !tryPop(item); ++spins) {
+            if (m_closed.load(std::memory_order_acquire)) {
+                // Items pushed before close() are visible now, drain them first
+                return tryPop(item);
+            }
+            if (abort.load(std::memory_order_relaxed))
+                return false;
+            backoff(spins);
+        }
+        return true;
+    }
+
+    void close() { m_closed.store(true, std::memory_order_release); }
+
+private:
+    // Spin briefly, then yield, then sleep so idle stages don't burn a core
+    static void backoff(int spins)
+    {
+        if (spins < 64)
+            return;
+        if (spins < 1024)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    std::vector<T> m_slots;
+    size_t m_mask = 0;
+
+    // Consumer side
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_tailCache = 0;
+
+    // Producer side
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_headCache = 0;
+
+    alignas(64) std::atomic<bool> m_closed{false};
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// Stages of the interactive view with their dependencies and a dirty flag each.
+//
+// Every stage keeps its output (in the FrameContext) until something it depends on changes.
+// Trackbar callbacks only call invalidate(), which marks the stage and everything downstream
+// of it; update() then re-runs just the dirty stages, in dependency order. Since the main
+// loop calls update() once per iteration, a burst of slider events between two iterations
+// is coalesced into a single recomputation.
+class StageGraph
+{
+public:
+    // Add a stage running fn, which reads the outputs of the stages in dependsOn. Stages
+    // must be added after the ones they depend on. New stages start out dirty.
+    int addStage(const std::string& name, std::function<void()> fn, const std::vector<int>& dependsOn = {})
+    {
+        int index = static_cast<int>(m_stages.size());
+        for (int dependency : dependsOn) {
+            CV_Assert(dependency >= 0 && dependency < index);
+            m_stages[dependency].dependents.push_back(index);
+        }
+        m_stages.push_back({name, std::move(fn), {}, true});
+        return index;
+    }
+
+    // Mark a stage and everything that depends on it, directly or not, for recomputation
+    void invalidate(int stage)
+    {
+        markDirty(stage);
+        m_firstDirty = std::min(m_firstDirty, stage);
+    }
+
+    void invalidateAll()
+    {
+        for (auto& stage : m_stages)
+            stage.dirty = true;
+        m_firstDirty = 0;
+    }
+
+    // Run the dirty stages in order, returns how many ran
+    int update()
+    {
+        int ran = 0;
+        for (int i = m_firstDirty; i < static_cast<int>(m_stages.size()); ++i) {
+            if (!m_stages[i].dirty)
+                continue;
+            m_stages[i].fn();
+            m_stages[i].dirty = false;
+            ++ran;
+        }
+        m_firstDirty = static_cast<int>(m_stages.size());
+        return ran;
+    }
+
+private:
+    struct Stage
+    {
+        std::string name;
+        std::function<void()> fn;
+        std::vector<int> dependents;
+        bool dirty;
+    };
+
+    // A dirty stage already has all its dependents marked
+    void markDirty(int stage)
+    {
+        if (m_stages[stage].dirty)
+            return;
+        m_stages[stage].dirty = true;
+        for (int dependent : m_stages[stage].dependents)
+            markDirty(dependent);
+    }
+
+    std::vector<Stage> m_stages;
+    int m_firstDirty = 0;
+};
@@ -0,0 +1,519 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "blob_filters.hpp"
+#include "detection.hpp"
+#include "frame_context.hpp"
+#include "pipeline.hpp"
+#include "tracing.hpp"
+#include "tracker.hpp"
+#include "work_pool.hpp"
+
+// Parameter sweep: finds the threshold, blur and area limits that segment a video best and
+// writes them to a config file the tracing programs load with --config.
+//
+// A sample of consecutive frames is decoded once. Every task on the work-stealing pool takes
+// one blur size and a share of the threshold values, and goes through the sample in order:
+// each frame is blurred once, then thresholded, labelled and filtered for every threshold and
+// area combination in turn. Each combination has its own tracker, fed as the frames come, so
+// nothing is kept per frame. A combination is scored by how stable its result is:
+//   count CV     standard deviation / mean of the detections per frame, organisms don't
+//                appear and vanish from one frame to the next
+//   continuity   share of the detections that belong to a track lasting kMinTrackFrames
+//   IDs/object   track IDs per detected organism, 1 if every track lasts the whole sample
+//   score        continuity / ((1 + count CV) * IDs/object)
+// The grid search scores every combination. The adaptive one scores every kCoarseStep-th
+// threshold first, then halves the step around the best ones down to the step of --thresholds.
+
+struct SweepOptions
+{
+    std::string input;
+    std::string configPath = "sweep.yml";
+    std::string reportPath;
+    std::string search = "grid";
+    int start = 0;
+    int frames = 200;
+    int threads = 0;
+    std::vector<int> thresholds; // the values of the range below
+    std::vector<int> blurSizes = {3, 5, 7, 9, 11};
+    std::vector<int> minAreas = {20, 50, 100};
+    std::vector<int> maxAreas = {10000};
+    int thresholdFrom = 60;
+    int thresholdTo = 200;
+    int thresholdStep = 4;
+    int trackGate = 40;
+    double minCount = 1.0;
+};
+
+void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " [options] INPUT\n"
+              << "  -o, --output PATH       config file for the best parameters (default sweep.yml, JSON or YAML)\n"
+              << "      --report PATH       write the score of every combination to PATH (CSV)\n"
+              << "      --search grid|adaptive  score every combination (default), or refine the thresholds\n"
+              << "                          around the best ones\n"
+              << "      --start N           first frame of the sample (default 0)\n"
+              << "      --frames N          frames in the sample (default 200), kept decoded in memory\n"
+              << "      --thresholds FROM:TO:STEP  threshold values (default 60:200:4)\n"
+              << "      --blurs LIST        Gaussian blur sizes, comma separated (default 3,5,7,9,11)\n"
+              << "      --min-areas LIST    minimum contour areas (default 20,50,100)\n"
+              << "      --max-areas LIST    maximum contour areas, 0 for no limit (default 10000)\n"
+              << "      --track-gate PX     tracking gate in pixels (default 40)\n"
+              << "      --min-count N       reject combinations with fewer detections per frame (default 1)\n"
+              << "      --threads N         worker threads (default: all cores)\n"
+              << "  -h, --help              show this message\n";
+}
+
+// Comma separated integers, false if one isn't
+bool parseList(const std::string& text, std::vector<int>& values)
+{
+    values.clear();
+    std::istringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char* end = nullptr;
+        long value = std::strtol(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0')
+            return false;
+        values.push_back(static_cast<int>(value));
+    }
+    return !values.empty();
+}
+
+// FROM:TO:STEP, STEP may be left out
+bool parseRange(const std::string& text, int& from, int& to, int& step)
+{
+    std::vector<int> values;
+    std::string list = text;
+    std::replace(list.begin(), list.end(), ':', ',');
+    if (!parseList(list, values) || values.size() < 2 || values.size() > 3)
+        return false;
+    from = values[0];
+    to = values[1];
+    step = values.size() == 3 ? values[2] : 1;
+    return step > 0 && from <= to;
+}
+
+bool parseSweepOptions(int argc, char** argv, SweepOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return false;
+        } else if ((arg == "-o" || arg == "--output") && hasValue) {
+            options.configPath = argv[++i];
+        } else if (arg == "--report" && hasValue) {
+            options.reportPath = argv[++i];
+        } else if (arg == "--search" && hasValue) {
+            options.search = argv[++i];
+        } else if (arg == "--start" && hasValue) {
+            options.start = std::atoi(argv[++i]);
+        } else if (arg == "--frames" && hasValue) {
+            options.frames = std::atoi(argv[++i]);
+        } else if (arg == "--thresholds" && hasValue) {
+            if (!parseRange(argv[++i], options.thresholdFrom, options.thresholdTo, options.thresholdStep)) {
+                std::cout << "Invalid threshold range: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--blurs" && hasValue) {
+            if (!parseList(argv[++i], options.blurSizes)) {
+                std::cout << "Invalid blur sizes: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--min-areas" && hasValue) {
+            if (!parseList(argv[++i], options.minAreas)) {
+                std::cout << "Invalid minimum areas: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--max-areas" && hasValue) {
+            if (!parseList(argv[++i], options.maxAreas)) {
+                std::cout << "Invalid maximum areas: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (arg == "--track-gate" && hasValue) {
+            options.trackGate = std::atoi(argv[++i]);
+        } else if (arg == "--min-count" && hasValue) {
+            options.minCount = std::atof(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (!arg.empty() && arg[0] != '-') {
+            options.input = arg;
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    // Same constraints the blur trackbar callback enforces, without repeating a size
+    for (int& size : options.blurSizes) {
+        if (size % 2 == 0)
+            ++size;
+        size = std::max(size, 3);
+    }
+    std::sort(options.blurSizes.begin(), options.blurSizes.end());
+    options.blurSizes.erase(std::unique(options.blurSizes.begin(), options.blurSizes.end()),
+                            options.blurSizes.end());
+
+    options.thresholdFrom = std::clamp(options.thresholdFrom, 0, 255);
+    options.thresholdTo = std::clamp(options.thresholdTo, options.thresholdFrom, 255);
+    for (int t = options.thresholdFrom; t <= options.thresholdTo; t += options.thresholdStep)
+        options.thresholds.push_back(t);
+
+    if (options.search != "grid" && options.search != "adaptive") {
+        std::cout << "Unknown search: " << options.search << std::endl;
+        return false;
+    }
+    if (options.frames < 2) {
+        std::cout << "--frames must be at least 2" << std::endl;
+        return false;
+    }
+    if (options.input.empty()) {
+        printUsage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+// Decode frames [start, start + count) of the video as gray, false if none could be read
+bool readSample(const std::string& input, int start, int count, std::vector<cv::Mat>& frames)
+{
+    cv::VideoCapture video(input);
+    if (!video.isOpened())
+        return false;
+    if (start > 0)
+        video.set(cv::CAP_PROP_POS_FRAMES, start);
+    cv::Mat decoded;
+    while (static_cast<int>(frames.size()) < count && video.read(decoded)) {
+        frames.emplace_back();
+        cv::cvtColor(decoded, frames.back(), cv::COLOR_BGR2GRAY);
+    }
+    return !frames.empty();
+}
+
+// One parameter combination and how well it did
+struct SweepResult
+{
+    int threshold = 0;
+    int blurSize = 0;
+    int minArea = 0;
+    int maxArea = 0;
+    double meanCount = 0.0;
+    double countCV = 0.0;
+    double continuity = 0.0;
+    double idsPerObject = 0.0;
+    double score = 0.0;
+};
+
+// The running statistics of one combination over the sample, in frame order
+class SweepStats
+{
+public:
+    explicit SweepStats(float trackGate) : m_tracker(trackGate) {}
+
+    void add(std::vector<Detection>& detections, int frameIndex)
+    {
+        m_tracker.update(detections, frameIndex);
+        double count = static_cast<double>(detections.size());
+        m_sum += count;
+        m_sumSquares += count * count;
+        ++m_frames;
+        for (const auto& detection : detections)
+            ++m_trackFrames[detection.trackId];
+    }
+
+    // Score the combination, 0 when it finds fewer than minCount organisms per frame
+    void score(SweepResult& result, double minCount) const
+    {
+        if (m_frames == 0)
+            return;
+        double mean = m_sum / m_frames;
+        double variance = std::max(0.0, m_sumSquares / m_frames - mean * mean);
+        result.meanCount = mean;
+        result.countCV = mean > 0.0 ? std::sqrt(variance) / mean : 0.0;
+        if (mean <= 0.0)
+            return;
+
+        // Short samples can't have long tracks
+        int minTrack = std::max(2, std::min(kMinTrackFrames, m_frames / 2));
+        double continuous = 0.0;
+        for (const auto& track : m_trackFrames) {
+            if (track.second >= minTrack)
+                continuous += track.second;
+        }
+        result.continuity = continuous / m_sum;
+        result.idsPerObject = m_trackFrames.size() / mean;
+        if (mean >= minCount)
+            result.score = result.continuity / ((1.0 + result.countCV) * result.idsPerObject);
+    }
+
+private:
+    static constexpr int kMinTrackFrames = 10;
+
+    Tracker m_tracker;
+    double m_sum = 0.0;
+    double m_sumSquares = 0.0;
+    int m_frames = 0;
+    std::unordered_map<int, int> m_trackFrames; // frames each track ID was detected in
+};
+
+// Scores the combinations of blur sizes and thresholds it is given on a sample, with all the
+// area limits, on a work-stealing pool
+class Sweeper
+{
+public:
+    Sweeper(const SweepOptions& options, const std::vector<cv::Mat>& frames, int workers)
+        : m_options(options), m_frames(frames), m_contexts(workers), m_pool(workers)
+    {
+    }
+
+    // Score the (blur size, threshold) pairs not scored before, adding them to results()
+    void evaluate(const std::vector<std::pair<int, int>>& pairs)
+    {
+        std::map<int, std::vector<int>> thresholdsByBlur;
+        for (const auto& pair : pairs) {
+            if (m_scored.insert(pair).second)
+                thresholdsByBlur[pair.first].push_back(pair.second);
+        }
+
+        // Enough tasks for every worker, each blurring the sample once for its thresholds
+        int workers = static_cast<int>(m_contexts.size());
+        for (const auto& blur : thresholdsByBlur) {
+            const std::vector<int>& thresholds = blur.second;
+            size_t shares = std::max<size_t>(1, (workers + thresholdsByBlur.size() - 1) / thresholdsByBlur.size());
+            size_t shareSize = (thresholds.size() + shares - 1) / std::min(shares, thresholds.size());
+            for (size_t first = 0; first < thresholds.size(); first += shareSize) {
+                std::vector<int> share(thresholds.begin() + first,
+                                       thresholds.begin() + std::min(thresholds.size(), first + shareSize));
+                int blurSize = blur.first;
+                m_pool.submit([this, blurSize, share] { evaluateShare(blurSize, share); });
+            }
+        }
+        m_pool.wait();
+    }
+
+    const std::vector<SweepResult>& results() const { return m_results; }
+
+private:
+    void evaluateShare(int blurSize, const std::vector<int>& thresholds)
+    {
+        FrameContext& context = m_contexts[m_pool.currentWorker()];
+        const std::vector<int>& minAreas = m_options.minAreas;
+        const std::vector<int>& maxAreas = m_options.maxAreas;
+        size_t areaCount = minAreas.size() * maxAreas.size();
+        SweepStats empty(static_cast<float>(m_options.trackGate));
+        std::vector<SweepStats> stats(thresholds.size() * areaCount, empty);
+
+        for (size_t f = 0; f < m_frames.size(); ++f) {
+            const cv::Mat& gray = m_frames[f];
+            context.beginFrame();
+            context.blur(gray, blurSize);
+            for (size_t t = 0; t < thresholds.size(); ++t) {
+                context.threshold(thresholds[t], cv::THRESH_BINARY_INV);
+                context.labelBlobs(context.thresholded, gray);
+                for (size_t a = 0; a < areaCount; ++a) {
+                    float minArea = static_cast<float>(minAreas[a / maxAreas.size()]);
+                    float maxArea = static_cast<float>(maxAreas[a % maxAreas.size()]);
+                    filterBlobs(context, AreaFilter{minArea, maxArea});
+                    stats[t * areaCount + a].add(context.detections, static_cast<int>(f));
+                }
+            }
+        }
+
+        std::vector<SweepResult> results(stats.size());
+        for (size_t i = 0; i < stats.size(); ++i) {
+            SweepResult& result = results[i];
+            result.threshold = thresholds[i / areaCount];
+            result.blurSize = blurSize;
+            result.minArea = minAreas[i % areaCount / maxAreas.size()];
+            result.maxArea = maxAreas[i % maxAreas.size()];
+            stats[i].score(result, m_options.minCount);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_results.insert(m_results.end(), results.begin(), results.end());
+    }
+
+    const SweepOptions& m_options;
+    const std::vector<cv::Mat>& m_frames;
+    std::vector<FrameContext> m_contexts; // one per worker
+    std::set<std::pair<int, int>> m_scored;
+    std::mutex m_mutex;
+    std::vector<SweepResult> m_results;
+    WorkStealingPool m_pool;
+};
+
+bool betterResult(const SweepResult& a, const SweepResult& b)
+{
+    if (a.score != b.score)
+        return a.score > b.score;
+    return a.meanCount > b.meanCount;
+}
+
+// Every threshold of options with every blur size
+void gridSearch(Sweeper& sweeper, const SweepOptions& options)
+{
+    std::vector<std::pair<int, int>> pairs;
+    for (int blurSize : options.blurSizes) {
+        for (int threshold : options.thresholds)
+            pairs.emplace_back(blurSize, threshold);
+    }
+    sweeper.evaluate(pairs);
+}
+
+// Every kCoarseStep-th threshold, then the neighbours of the kRefine best pairs at half the
+// step, and so on down to the threshold step of options
+void adaptiveSearch(Sweeper& sweeper, const SweepOptions& options)
+{
+    static constexpr int kCoarseStep = 8;
+    static constexpr size_t kRefine = 3;
+    int from = options.thresholdFrom;
+    int to = options.thresholdTo;
+    int fine = options.thresholdStep;
+    int step = std::max(fine, kCoarseStep * fine);
+
+    std::vector<std::pair<int, int>> pairs;
+    for (int blurSize : options.blurSizes) {
+        for (int threshold = from; threshold <= to; threshold += step)
+            pairs.emplace_back(blurSize, threshold);
+    }
+    sweeper.evaluate(pairs);
+
+    while (step > fine) {
+        step = std::max(fine, step / 2);
+        std::vector<SweepResult> best = sweeper.results();
+        size_t count = std::min(kRefine, best.size());
+        std::partial_sort(best.begin(), best.begin() + count, best.end(), betterResult);
+        pairs.clear();
+        for (size_t i = 0; i < count; ++i) {
+            // Stay on the grid of the fine step
+            for (int threshold : {best[i].threshold - step, best[i].threshold + step}) {
+                threshold = from + (threshold - from) / fine * fine;
+                if (threshold >= from && threshold <= to)
+                    pairs.emplace_back(best[i].blurSize, threshold);
+            }
+        }
+        sweeper.evaluate(pairs);
+    }
+}
+
+bool writeReport(const std::vector<SweepResult>& results, const std::string& path)
+{
+    std::ofstream out(path);
+    if (!out.is_open())
+        return false;
+    out << "Threshold, Blur, Min Area, Max Area, Mean Count, Count CV, Continuity, IDs per Object, Score\n";
+    for (const auto& result : results) {
+        out << result.threshold << ", " << result.blurSize << ", " << result.minArea << ", " << result.maxArea
+            << ", " << result.meanCount << ", " << result.countCV << ", " << result.continuity << ", "
+            << result.idsPerObject << ", " << result.score << "\n";
+    }
+    return static_cast<bool>(out);
+}
+
+// The keys --config reads, plus how the parameters were found
+bool writeConfig(const SweepResult& best, const SweepOptions& options, int frames, const std::string& path)
+{
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened())
+        return false;
+    fs << "threshold" << best.threshold;
+    fs << "blur" << best.blurSize;
+    fs << "min_area" << best.minArea;
+    fs << "max_area" << best.maxArea;
+    fs << "sweep" << "{";
+    fs << "input" << options.input << "start" << options.start << "frames" << frames << "search" << options.search;
+    fs << "score" << best.score << "mean_count" << best.meanCount << "count_cv" << best.countCV << "continuity"
+       << best.continuity << "ids_per_object" << best.idsPerObject;
+    fs << "}";
+    return true;
+}
+
+void printResults(std::vector<SweepResult> results, size_t count)
+{
+    count = std::min(count, results.size());
+    std::partial_sort(results.begin(), results.begin() + count, results.end(), betterResult);
+    std::cout << std::right << std::setw(10) << "threshold" << std::setw(6) << "blur" << std::setw(10) << "min_area"
+              << std::setw(10) << "max_area" << std::setw(8) << "count" << std::setw(10) << "count_cv"
+              << std::setw(12) << "continuity" << std::setw(9) << "ids/obj" << std::setw(8) << "score" << std::endl;
+    for (size_t i = 0; i < count; ++i) {
+        const SweepResult& r = results[i];
+        std::cout << std::setw(10) << r.threshold << std::setw(6) << r.blurSize << std::setw(10) << r.minArea
+                  << std::setw(10) << r.maxArea << std::fixed << std::setprecision(1) << std::setw(8) << r.meanCount
+                  << std::setprecision(3) << std::setw(10) << r.countCV << std::setw(12) << r.continuity
+                  << std::setw(9) << r.idsPerObject << std::setw(8) << r.score << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    SweepOptions options;
+    if (!parseSweepOptions(argc, argv, options))
+        return -1;
+
+    std::vector<cv::Mat> frames;
+    if (!readSample(options.input, options.start, options.frames, frames)) {
+        std::cout << "Error opening video file!" << std::endl;
+        return -1;
+    }
+    if (frames.size() < 2) {
+        std::cout << "The sample needs at least 2 frames" << std::endl;
+        return -1;
+    }
+
+    // The pool is the only parallelism, as in batch
+    cv::setNumThreads(1);
+    int workers = pipelineWorkers(options.threads);
+    std::cout << "Sweeping " << frames.size() << " frames of " << options.input << " on " << workers << " threads"
+              << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    Sweeper sweeper(options, frames, workers);
+    try {
+        if (options.search == "adaptive")
+            adaptiveSearch(sweeper, options);
+        else
+            gridSearch(sweeper, options);
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+        return -1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const std::vector<SweepResult>& results = sweeper.results();
+    std::cout << "Scored " << results.size() << " combinations in " << std::fixed << std::setprecision(2) << seconds
+              << " s" << std::endl;
+    printResults(results, 10);
+
+    if (!options.reportPath.empty() && !writeReport(results, options.reportPath)) {
+        std::cout << "Error writing " << options.reportPath << std::endl;
+        return -1;
+    }
+    const SweepResult& best = *std::min_element(results.begin(), results.end(), betterResult);
+    if (best.score <= 0.0) {
+        std::cout << "No combination finds at least " << options.minCount << " organisms per frame" << std::endl;
+        return -1;
+    }
+    if (!writeConfig(best, options, static_cast<int>(frames.size()), options.configPath)) {
+        std::cout << "Error writing " << options.configPath << std::endl;
+        return -1;
+    }
+    std::cout << "Wrote threshold " << best.threshold << ", blur " << best.blurSize << ", area " << best.minArea
+              << " to " << best.maxArea << " to " << options.configPath << std::endl;
+    return 0;
+}
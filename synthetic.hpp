@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+// What a synthetic video looks like
+struct SyntheticSpec
+{
+    int width = 1280;
+    int height = 720;
+    int frames = 300;
+    double fps = 30.0;
+    int organisms = 50;
+    double length = 40.0; // major axis of an organism in pixels, the minor axis is 40% of it
+    double speed = 2.0;   // pixels per frame
+    double noise = 4.0;   // standard deviation of the pixel noise
+    uint64_t seed = 1;
+};
+
+// Deterministic stand-in for a paramecium recording: dark elongated ellipses swimming over
+// a bright, slightly uneven background, with Gaussian pixel noise. The same spec always
+// gives the same frames.
+class SyntheticVideo
+{
+public:
+    explicit SyntheticVideo(const SyntheticSpec& spec) : m_spec(spec), m_rng(spec.seed)
+    {
+        // Brighter in the middle, like a lit dish
+        m_background.create(spec.height, spec.width, CV_8UC3);
+        cv::Point2d center(spec.width / 2.0, spec.height / 2.0);
+        double radius = std::hypot(center.x, center.y);
+        for (int y = 0; y < spec.height; ++y) {
+            cv::Vec3b* row = m_background.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < spec.width; ++x) {
+                double falloff = std::hypot(x - center.x, y - center.y) / radius;
+                uchar level = cv::saturate_cast<uchar>(205.0 - 35.0 * falloff * falloff);
+                row[x] = cv::Vec3b(level, level, level);
+            }
+        }
+
+        for (int i = 0; i < spec.organisms; ++i) {
+            Organism organism;
+            organism.position = cv::Point2d(m_rng.uniform(0.0, static_cast<double>(spec.width)),
+                                            m_rng.uniform(0.0, static_cast<double>(spec.height)));
+            organism.heading = m_rng.uniform(0.0, 2.0 * CV_PI);
+            organism.speed = spec.speed * m_rng.uniform(0.5, 1.5);
+            organism.shade = m_rng.uniform(40, 90);
+            m_organisms.push_back(organism);
+        }
+    }
+
+    const SyntheticSpec& spec() const { return m_spec; }
+
+    // Render the next frame into frame (BGR), returns false after the last one
+    bool read(cv::Mat& frame)
+    {
+        if (m_frameIndex >= m_spec.frames)
+            return false;
+
+        m_background.copyTo(frame);
+        cv::Size2f size(static_cast<float>(m_spec.length), static_cast<float>(m_spec.length * 0.4));
+        for (const auto& organism : m_organisms) {
+            float angle = static_cast<float>(organism.heading * 180.0 / CV_PI);
+            cv::RotatedRect body(cv::Point2f(organism.position), size, angle);
+            cv::ellipse(frame, body, cv::Scalar::all(organism.shade), cv::FILLED, cv::LINE_AA);
+        }
+
+        if (m_spec.noise > 0.0) {
+            m_noise.create(frame.size(), CV_16SC3);
+            cv::randn(m_noise, cv::Scalar::all(0.0), cv::Scalar::all(m_spec.noise));
+            cv::add(frame, m_noise, frame, cv::noArray(), CV_8U);
+        }
+
+        move();
+        ++m_frameIndex;
+        return true;
+    }
+
+private:
+    struct Organism
+    {
+        cv::Point2d position;
+        double heading; // radians
+        double speed;
+        int shade;
+    };
+
+    // Swim forward, turning a little at random and bouncing off the edges
+    void move()
+    {
+        for (auto& organism : m_organisms) {
+            organism.heading += m_rng.gaussian(0.15);
+            organism.position += cv::Point2d(std::cos(organism.heading), std::sin(organism.heading)) * organism.speed;
+            if (organism.position.x < 0.0 || organism.position.x >= m_spec.width) {
+                organism.heading = CV_PI - organism.heading;
+                organism.position.x = std::min(std::max(organism.position.x, 0.0), m_spec.width - 1.0);
+            }
+            if (organism.position.y < 0.0 || organism.position.y >= m_spec.height) {
+                organism.heading = -organism.heading;
+                organism.position.y = std::min(std::max(organism.position.y, 0.0), m_spec.height - 1.0);
+            }
+        }
+    }
+
+    SyntheticSpec m_spec;
+    cv::RNG m_rng;
+    cv::Mat m_background;
+    cv::Mat m_noise;
+    std::vector<Organism> m_organisms;
+    int m_frameIndex = 0;
+};
+
+// Write a synthetic video as Motion JPEG, which every OpenCV build can encode and decode
+inline bool writeSyntheticVideo(const std::string& path, const SyntheticSpec& spec)
+{
+    cv::VideoWriter writer(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), spec.fps,
+                           cv::Size(spec.width, spec.height));
+    if (!writer.isOpened())
+        return false;
+    SyntheticVideo video(spec);
+    cv::Mat frame;
+    while (video.read(frame))
+        writer.write(frame);
+    return true;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "detection.hpp"
+
+// Recent positions of every track, for drawing their tails.
+//
+// Each track gets a ring buffer of fixed capacity, holding its positions together with the
+// video timestamp they were seen at. Points older than the tail length (in video time, so
+// pausing or a slow machine does not shorten the tails) are dropped as new frames come in.
+// Buffers of tracks that disappear are put back in a pool and reused, and a track finds its
+// buffer through an open addressing table sized for the most tracks seen, so once the number
+// of tracks has peaked no memory is allocated.
+class TrackTails
+{
+public:
+    // Tails cover tailMsec of video, capacity is the most points one tail can hold
+    TrackTails(double tailMsec = 4000.0, int capacity = 128) { configure(tailMsec, capacity); }
+
+    // Change the tail length, dropping all tails
+    void configure(double tailMsec, int capacity)
+    {
+        m_tailMsec = tailMsec;
+        m_capacity = std::max(2, capacity);
+        m_slots.clear();
+        m_free.clear();
+        m_active.clear();
+        m_table.clear();
+    }
+
+    // Capacity that holds tailMsec of video at the given frame rate
+    static int capacityFor(double tailMsec, double fps)
+    {
+        if (!(fps > 0.0))
+            fps = 30.0;
+        return static_cast<int>(std::ceil(tailMsec * fps / 1000.0)) + 1;
+    }
+
+    // Add the positions of the tracked detections of the frame at timeMsec. Adding the same
+    // frame again replaces its points, so a re-tracked paused frame is not drawn twice.
+    void update(const std::vector<Detection>& detections, double timeMsec)
+    {
+        for (auto& slot : m_slots) {
+            if (slot.count > 0 && slot.times[slot.newest()] >= timeMsec)
+                --slot.count;
+        }
+
+        for (const auto& detection : detections) {
+            if (detection.trackId < 0)
+                continue;
+            Slot& slot = m_slots[slotOf(detection.trackId)];
+            int index = (slot.first + slot.count) % m_capacity;
+            slot.times[index] = timeMsec;
+            slot.points[index] = cv::Point(detection.centroid);
+            if (slot.count < m_capacity)
+                ++slot.count;
+            else
+                slot.first = (slot.first + 1) % m_capacity;
+        }
+
+        // Expire old points, and release the tails left empty
+        for (size_t i = 0; i < m_active.size();) {
+            Slot& slot = m_slots[m_active[i]];
+            while (slot.count > 0 && slot.times[slot.first] < timeMsec - m_tailMsec) {
+                slot.first = (slot.first + 1) % m_capacity;
+                --slot.count;
+            }
+            if (slot.count == 0) {
+                eraseEntry(slot.trackId);
+                m_free.push_back(m_active[i]);
+                m_active[i] = m_active.back();
+                m_active.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // Draw every tail as a polyline, oldest point first, all in one call
+    void draw(cv::Mat& image, const cv::Scalar& color, int thickness = 2)
+    {
+        m_points.clear();
+        m_counts.clear();
+        for (int index : m_active) {
+            const Slot& slot = m_slots[index];
+            for (int i = 0; i < slot.count; ++i)
+                m_points.push_back(slot.points[(slot.first + i) % m_capacity]);
+            m_counts.push_back(slot.count);
+        }
+        if (m_counts.empty())
+            return;
+
+        m_lines.clear();
+        const cv::Point* line = m_points.data();
+        for (int count : m_counts) {
+            m_lines.push_back(line);
+            line += count;
+        }
+        cv::polylines(image, m_lines.data(), m_counts.data(), static_cast<int>(m_counts.size()), false, color,
+                      thickness, cv::LINE_AA);
+    }
+
+    // Bounding box of the points of the last draw(), empty if it drew nothing
+    cv::Rect drawnBounds() const
+    {
+        if (m_counts.empty())
+            return cv::Rect();
+        return cv::boundingRect(m_points);
+    }
+
+    size_t size() const { return m_active.size(); }
+
+private:
+    struct Slot
+    {
+        std::vector<double> times;
+        std::vector<cv::Point> points;
+        int trackId = -1;
+        int first = 0;
+        int count = 0;
+
+        int newest() const { return (first + count - 1) % static_cast<int>(times.size()); }
+    };
+
+    // Position of trackId in m_table, or of the empty entry where it would go
+    size_t findEntry(int trackId) const
+    {
+        size_t mask = m_table.size() - 1;
+        size_t i = (static_cast<uint32_t>(trackId) * 2654435761u) & mask;
+        while (m_table[i] >= 0 && m_slots[m_table[i]].trackId != trackId)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    // Remove trackId from m_table, moving the entries after it back so every entry stays
+    // reachable from its home position
+    void eraseEntry(int trackId)
+    {
+        size_t mask = m_table.size() - 1;
+        size_t hole = findEntry(trackId);
+        m_table[hole] = -1;
+        for (size_t i = (hole + 1) & mask; m_table[i] >= 0; i = (i + 1) & mask) {
+            size_t home = (static_cast<uint32_t>(m_slots[m_table[i]].trackId) * 2654435761u) & mask;
+            // Move it into the hole unless its home lies cyclically in (hole, i]
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                m_table[hole] = m_table[i];
+                m_table[i] = -1;
+                hole = i;
+            }
+        }
+    }
+
+    int slotOf(int trackId)
+    {
+        if (!m_table.empty()) {
+            int found = m_table[findEntry(trackId)];
+            if (found >= 0)
+                return found;
+        }
+
+        int slot;
+        if (!m_free.empty()) {
+            slot = m_free.back();
+            m_free.pop_back();
+        } else {
+            slot = static_cast<int>(m_slots.size());
+            m_slots.emplace_back();
+            m_slots.back().times.resize(m_capacity);
+            m_slots.back().points.resize(m_capacity);
+        }
+        m_slots[slot].trackId = trackId;
+        m_slots[slot].first = 0;
+        m_slots[slot].count = 0;
+        m_active.push_back(slot);
+
+        // At most half full; it only grows with the number of slots
+        if (m_table.size() < 2 * m_slots.size()) {
+            size_t size = 16;
+            while (size < 2 * m_slots.size())
+                size *= 2;
+            m_table.assign(size, -1);
+            for (int index : m_active)
+                m_table[findEntry(m_slots[index].trackId)] = index;
+        } else {
+            m_table[findEntry(trackId)] = slot;
+        }
+        return slot;
+    }
+
+    double m_tailMsec = 0.0;
+    int m_capacity = 0;
+    std::vector<Slot> m_slots;
+    std::vector<int> m_free;
+    std::vector<int> m_active; // slots holding a tail
+    std::vector<int> m_table;  // slot of each track ID, -1 where empty (open addressing)
+
+    // Drawing buffers
+    std::vector<cv::Point> m_points;
+    std::vector<int> m_counts;
+    std::vector<const cv::Point*> m_lines;
+};
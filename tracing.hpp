@@ -0,0 +1,544 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "background.hpp"
+#include "detection.hpp"
+#include "frame_context.hpp"
+#include "live_source.hpp"
+#include "metrics.hpp"
+#include "motion_gate.hpp"
+#include "overlay.hpp"
+#include "pipeline.hpp"
+#include "run_report.hpp"
+#include "stage_graph.hpp"
+#include "tails.hpp"
+#include "tracker.hpp"
+
+// The tracing shared by main, nocircle, coord and tail, as stages without global state.
+//
+// The stages are free functions of a grayscale frame, a FrameContext holding its buffers
+// and the parameters: segment (by threshold or background subtraction), filter the blobs,
+// track. A Tracer is one tracing pipeline, owning the parameters and the state that lives
+// across frames (motion gate, background model, tracker, tails); it chains the stages as
+// threads of a headless Pipeline, or as cached stages of the interactive view whose
+// trackbars point at its parameters. The programs are front ends that pick the stages and
+// add their sinks (CSV, trajectory log, display), and several Tracers can run side by side.
+// runHeadless() is the headless run they share.
+
+// How the foreground is found
+enum class Segmentation
+{
+    Threshold,  // dark objects on a bright background: blur, threshold
+    Background, // learn the background, threshold the difference and close it
+};
+
+// Parameters of a tracing pipeline
+struct TracingParams
+{
+    Segmentation segmentation = Segmentation::Threshold;
+    int thresholdValue = 132;
+    int blurSize = 7;
+    int fgMaskBlurSize = 13;  // foreground mask blur, background subtraction only
+    int minArea = 50;
+    int maxArea = 10000;      // 0 for no upper limit
+    bool aspectRatioFilter = false;
+    int aspectRatioThreshold = 80; // percent the aspect ratio of a kept blob differs from 1 by
+    int minSide = 0;          // bounding box side limits in pixels, 0 for none
+    int maxSide = 0;
+    int minSolidity = 0;      // percent of its convex hull a kept blob fills, 0 for any
+    int minCircularity = 0;   // percent circularity (4 pi area / perimeter^2) of a kept blob, 0 for any
+    int pyramidFactor = 1;    // scale of the candidate search of pyramid detection, 1 when off
+    bool tracking = false;
+    bool tails = false;       // keep the recent positions of every track, needs tracking
+    int trackGate = 40;
+};
+
+// Turn the blobs that pass every filter into detections. The filters (see blob_filters.hpp)
+// run cheapest first whatever order they are given in.
+template <typename... Filters>
+void filterBlobs(FrameContext& context, const Filters&... filters)
+{
+    METRICS_SCOPE("filter");
+    size_t detectionCapacity = context.detections.capacity();
+    size_t scratchCapacity = context.filterScratch.capacity();
+    runFilterChain(context.blobs, context.blobScratch, context.filterScratch, filters...);
+    context.detections.clear();
+    for (int i : context.filterScratch.candidates) {
+        const Blob& blob = context.blobs[i];
+        // Sub-pixel centroid weighted by darkness, summed while labelling
+        context.detections.push_back({blob.weightedCentroid(), static_cast<double>(blob.area), -1, i});
+    }
+    context.trackCapacity(context.detections, detectionCapacity);
+    context.trackCapacity(context.filterScratch, scratchCapacity);
+    METRICS_COUNT("detections_accepted", context.detections.size());
+}
+
+namespace filter_chain
+{
+    // Add the optional filters the parameters enable to chain, one decision per filter, so
+    // every combination gets its own specialized filterBlobs
+    template <int Optional, typename... Chain>
+    void filterEnabled(FrameContext& context, const TracingParams& params, const Chain&... chain)
+    {
+        if constexpr (Optional == 0) {
+            filterBlobs(context, chain...);
+        } else if constexpr (Optional == 1) {
+            if (params.minSide > 0 || params.maxSide > 0)
+                filterEnabled<0>(context, params, chain...,
+                                 BoxFilter{static_cast<float>(params.minSide), static_cast<float>(params.maxSide)});
+            else
+                filterEnabled<0>(context, params, chain...);
+        } else if constexpr (Optional == 2) {
+            if (params.aspectRatioFilter)
+                filterEnabled<1>(context, params, chain..., AspectRatioFilter{params.aspectRatioThreshold / 100.0});
+            else
+                filterEnabled<1>(context, params, chain...);
+        } else if constexpr (Optional == 3) {
+            if (params.minSolidity > 0)
+                filterEnabled<2>(context, params, chain..., SolidityFilter{params.minSolidity / 100.0});
+            else
+                filterEnabled<2>(context, params, chain...);
+        } else {
+            if (params.minCircularity > 0)
+                filterEnabled<3>(context, params, chain..., CircularityFilter{params.minCircularity / 100.0});
+            else
+                filterEnabled<3>(context, params, chain...);
+        }
+    }
+}
+
+// Filter the blobs by area, and by whichever of box size, aspect ratio, solidity and
+// circularity the parameters ask for
+inline void filterBlobs(FrameContext& context, const TracingParams& params)
+{
+    filter_chain::filterEnabled<4>(
+        context, params, AreaFilter{static_cast<float>(params.minArea), static_cast<float>(params.maxArea)});
+}
+
+// Blur and threshold a grayscale frame, label and filter its blobs. Blur and threshold are
+// one pass, the blurred frame itself is never written. With pyramid detection only the
+// boxes around the blobs of a downscaled frame are segmented, with an enabled gate only
+// context.regions. Only reads its arguments, so it can run on several frames in parallel.
+inline void segmentThreshold(const cv::Mat& gray, FrameContext& context, const TracingParams& params,
+                             const MotionGate& gate)
+{
+    if (params.pyramidFactor > 1) {
+        context.pyramidSegment(gray, params.pyramidFactor, params.blurSize, params.thresholdValue,
+                               cv::THRESH_BINARY_INV, params.minArea, params.maxArea, gate.roi());
+        filterBlobs(context, params);
+        return;
+    }
+    if (gate.enabled())
+        context.blurThreshold(gray, params.blurSize, params.thresholdValue, cv::THRESH_BINARY_INV, context.regions,
+                              gate.roi());
+    else
+        context.blurThreshold(gray, params.blurSize, params.thresholdValue, cv::THRESH_BINARY_INV);
+    context.labelBlobs(context.thresholded, gray);
+    filterBlobs(context, params);
+}
+
+// Blur the frame and update the background model with it into context.foreground. Keeps
+// state between frames, so it has to see the frames one at a time and in order.
+inline void subtractBackground(const cv::Mat& gray, FrameContext& context, const TracingParams& params,
+                               BackgroundModel& background)
+{
+    context.blur(gray, params.blurSize);
+    METRICS_SCOPE("background");
+    cv::Mat& foreground = context.buffer(context.foreground, gray.size(), CV_8UC1);
+    background.apply(context.blurred, foreground);
+}
+
+// Blur, threshold and close the foreground mask into thresholded
+inline void maskForeground(FrameContext& context, const TracingParams& params)
+{
+    cv::Mat& thresholded = context.buffer(context.thresholded, context.foreground.size(), CV_8UC1);
+    if (params.fgMaskBlurSize > 1)
+        context.blurThreshold(context.foreground, params.fgMaskBlurSize, params.thresholdValue, cv::THRESH_BINARY);
+    else
+        cv::threshold(context.foreground, thresholded, params.thresholdValue, 255, cv::THRESH_BINARY);
+
+    // Close to merge nearby regions, the kernel is built once
+    if (context.kernel.empty()) {
+        context.kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(15, 15));
+        context.countAllocation();
+    }
+    METRICS_SCOPE("close");
+    cv::morphologyEx(thresholded, thresholded, cv::MORPH_CLOSE, context.kernel);
+}
+
+// Threshold the foreground mask, label and filter its blobs, weighing them with the gray
+// frame. Only reads its arguments, so it can run on several frames in parallel.
+inline void segmentForeground(const cv::Mat& gray, FrameContext& context, const TracingParams& params)
+{
+    maskForeground(context, params);
+    context.labelBlobs(context.thresholded, gray);
+    filterBlobs(context, params);
+}
+
+// Blur sizes are odd and at least 3
+inline void fixBlurSize(int& size)
+{
+    if (size % 2 == 0)
+        ++size;
+    if (size < 3)
+        size = 3;
+}
+
+// One tracing pipeline: parameters, the state it keeps across frames and the buffers of the
+// frame on display
+class Tracer
+{
+public:
+    TracingParams params;
+    MotionGate gate;            // region of interest and motion gating, Threshold only
+    BackgroundModel background; // Background only
+    Tracker tracker;
+    TrackTails tails;
+    FrameContext context;       // the displayed frame of the interactive view
+    OverlayViews views;         // the windows showSegmentation() draws
+    std::string window = "Segmented Image"; // shows the results and holds the trackbars
+
+    Tracer() : Tracer(TracingParams()) {}
+    explicit Tracer(const TracingParams& tracingParams) : params(tracingParams)
+    {
+        tracker.setGate(static_cast<float>(params.trackGate));
+    }
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Segment one frame with the stages of this pipeline (its background must be up to date)
+    void segment(const cv::Mat& gray, FrameContext& frameContext) const
+    {
+        if (params.segmentation == Segmentation::Background)
+            segmentForeground(gray, frameContext, params);
+        else
+            segmentThreshold(gray, frameContext, params, gate);
+    }
+
+    // Give the detections of a frame their track IDs and extend the tails
+    void track(std::vector<Detection>& detections, int frameIndex, double timeMsec)
+    {
+        tracker.update(detections, frameIndex);
+        if (params.tails)
+            tails.update(detections, timeMsec);
+    }
+
+    // Pyramid factor the latency scheduler can fall back to, 0 if segmentation has none
+    int degradeFactor() const
+    {
+        return params.segmentation == Segmentation::Threshold && params.pyramidFactor == 1 ? 2 : 0;
+    }
+
+    // Add the stages up to the segmentation to a headless pipeline: grayscale conversion,
+    // the gate or the background model (a single worker each, they keep state) and the
+    // segmentation on workers threads. Tracking and the sinks are up to the caller, since
+    // they often go together with other per-frame work in the same stage.
+    void addStages(Pipeline<FrameJob>& pipeline, int workers)
+    {
+        pipeline.addStage("gray", convertToGray, std::max(1, workers / 4));
+        if (params.segmentation == Segmentation::Background) {
+            pipeline.addStage("background", [this](FrameJob& job) {
+                subtractBackground(job.gray, job.context, params, background);
+            }, 1);
+        } else if (gate.enabled()) {
+            pipeline.addStage("gate", [this](FrameJob& job) {
+                gate.update(job.gray, job.context.regions);
+            }, 1);
+        }
+        pipeline.addStage("segment", [this](FrameJob& job) {
+            // The latency scheduler may ask for cheaper, pyramid segmentation
+            if (job.pyramidFactor > 0 && params.segmentation == Segmentation::Threshold) {
+                TracingParams degraded = params;
+                degraded.pyramidFactor = job.pyramidFactor;
+                segmentThreshold(job.gray, job.context, degraded, gate);
+            } else {
+                segment(job.gray, job.context);
+            }
+        }, workers);
+    }
+
+    // Build the cached stages of the interactive view, ending in the display sink draw.
+    // Threshold: blur, threshold, label, filter. Background: background, mask, label, filter;
+    // the background model only learns from new frames, so only they invalidate it. Then
+    // track when tracking, re-running it on the same frame redoes that frame in the tracker.
+    void buildView(std::function<void()> draw)
+    {
+        int segmentStage;
+        if (params.segmentation == Segmentation::Background) {
+            m_blurStage = m_stages.addStage("background", [this] {
+                subtractBackground(m_frame, context, params, background);
+            });
+            segmentStage = m_stages.addStage("mask", [this] { maskForeground(context, params); }, {m_blurStage});
+        } else {
+            m_blurStage = m_stages.addStage("blur", [this] { context.blur(m_frame, params.blurSize); });
+            segmentStage = m_stages.addStage("threshold", [this] {
+                context.threshold(params.thresholdValue, cv::THRESH_BINARY_INV);
+                gate.maskRoi(context.thresholded);
+            }, {m_blurStage});
+        }
+        m_segmentStage = segmentStage;
+        int labelStage = m_stages.addStage("label", [this] { context.labelBlobs(context.thresholded, m_frame); },
+                                           {segmentStage});
+        m_filterStage = m_stages.addStage("filter", [this] { filterBlobs(context, params); }, {labelStage});
+        m_trackStage = m_filterStage;
+        if (params.tracking) {
+            m_trackStage = m_stages.addStage("track", [this] {
+                track(context.detections, m_frameIndex, m_frameTime);
+            }, {m_filterStage});
+        }
+        m_stages.addStage("draw", std::move(draw), {m_trackStage});
+    }
+
+    // Show a new frame, sharing gray, which must stay unchanged while it is displayed
+    void setFrame(const cv::Mat& gray, int frameIndex, double timeMsec)
+    {
+        m_frame = gray;
+        m_frameIndex = frameIndex;
+        m_frameTime = timeMsec;
+        m_stages.invalidateAll();
+    }
+
+    // Re-run whatever the new frame or the trackbars invalidated, once per iteration however
+    // many trackbar events came in
+    void update()
+    {
+        context.beginFrame();
+        m_stages.update();
+    }
+
+    const cv::Mat& frame() const { return m_frame; }
+    int frameIndex() const { return m_frameIndex; }
+    double frameTime() const { return m_frameTime; }
+
+    // Parameter changes of the interactive view, redoing the stages they affect
+    void thresholdChanged() { m_stages.invalidate(m_segmentStage); }
+    void filterChanged() { m_stages.invalidate(m_filterStage); }
+    void blurChanged()
+    {
+        fixBlurSize(params.blurSize);
+        // The frame blur feeds the background model, so there the new size applies from the next frame on
+        if (params.segmentation == Segmentation::Threshold)
+            m_stages.invalidate(m_blurStage);
+    }
+    void fgMaskBlurChanged()
+    {
+        fixBlurSize(params.fgMaskBlurSize);
+        // Without background subtraction there is no foreground mask, nothing to redo
+        if (params.segmentation == Segmentation::Background)
+            m_stages.invalidate(m_segmentStage);
+    }
+    void trackGateChanged()
+    {
+        tracker.setGate(static_cast<float>(params.trackGate));
+        m_stages.invalidate(m_trackStage);
+    }
+
+private:
+    cv::Mat m_frame;
+    int m_frameIndex = -1;
+    double m_frameTime = 0.0;
+    StageGraph m_stages;
+    int m_blurStage = 0;
+    int m_segmentStage = 0;
+    int m_filterStage = 0;
+    int m_trackStage = 0;
+};
+
+// Trackbar callbacks, the user data is the Tracer whose parameter the trackbar points at
+inline void onThresholdTrackbar(int, void* tracer)
+{
+    static_cast<Tracer*>(tracer)->thresholdChanged();
+}
+
+inline void onBlurTrackbar(int, void* data)
+{
+    Tracer* tracer = static_cast<Tracer*>(data);
+    tracer->blurChanged();
+    cv::setTrackbarPos("Blur Size", tracer->window, tracer->params.blurSize);
+}
+
+inline void onFgMaskBlurTrackbar(int, void* data)
+{
+    Tracer* tracer = static_cast<Tracer*>(data);
+    tracer->fgMaskBlurChanged();
+    cv::setTrackbarPos("Foreground Mask Blur Size", tracer->window, tracer->params.fgMaskBlurSize);
+}
+
+inline void onFilterTrackbar(int, void* tracer)
+{
+    static_cast<Tracer*>(tracer)->filterChanged();
+}
+
+inline void onTrackGateTrackbar(int, void* tracer)
+{
+    static_cast<Tracer*>(tracer)->trackGateChanged();
+}
+
+// Display sink of main, nocircle and coord: the detections filled in the colors of their
+// index (of their track with byTrack) blended with the frame, the mask, and the outlines and
+// centroids drawn on the frame, labelled with their track IDs with byTrack. Only the views
+// in tracer.views are drawn; the window stays without one, it holds the trackbars.
+inline void showSegmentation(Tracer& tracer, bool byTrack)
+{
+    FrameContext& context = tracer.context;
+    const cv::Mat& frame = tracer.frame();
+    const OverlayViews& views = tracer.views;
+    if (views.marked)
+        context.buildOutlines();
+    METRICS_STOPWATCH(watch);
+
+    // One conversion of the frame for both views, then only the pixels of the blobs
+    cv::Mat* result = views.segmented ? &context.buffer(context.result, frame.size(), CV_8UC3) : nullptr;
+    cv::Mat* marked = views.marked ? &context.buffer(context.outlinesImage, frame.size(), CV_8UC3) : nullptr;
+    expandGray(frame, result, marked);
+    if (result)
+        fillDetections(*result, frame, context, byTrack);
+    METRICS_LAP(watch, "blend");
+
+    if (marked) {
+        // Orange line along the outlines and a red dot on the centroids
+        drawOutlines(*marked, context, cv::Scalar(0, 165, 255), 2, cv::LINE_8);
+        stampCentroids(*marked, context.detections, cv::Vec3b(0, 0, 255));
+        if (byTrack) {
+            for (const auto& detection : context.detections) {
+                cv::Point label = cv::Point(detection.centroid) + cv::Point(5, -5);
+                cv::putText(*marked, std::to_string(detection.trackId), label, cv::FONT_HERSHEY_SIMPLEX, 0.4,
+                            cv::Scalar(0, 0, 255));
+            }
+        }
+    }
+    METRICS_LAP(watch, "draw");
+
+    if (result) {
+        drawMetricsOverlay(*result);
+        cv::imshow(tracer.window, *result);
+    }
+    if (views.threshold)
+        cv::imshow("Threshold", context.thresholded);
+    if (marked)
+        cv::imshow("marked", *marked);
+    METRICS_LAP(watch, "imshow");
+}
+
+// Display sink of tail: the outlines and centroids of the detections and the tails of the
+// tracks over the frame. They are drawn on an overlay layer, which is only cleared and
+// blended where this and the previous frame drew.
+inline void showTails(Tracer& tracer)
+{
+    FrameContext& context = tracer.context;
+    const cv::Mat& frame = tracer.frame();
+    context.buildOutlines();
+    METRICS_STOPWATCH(watch);
+
+    cv::Mat& layer = context.contourImage;
+    clearLayer(context, layer, frame.size());
+    drawOutlines(layer, context, cv::Scalar(0, 165, 255), 2, cv::LINE_AA); // Orange outlines
+    stampCentroids(layer, context.detections, cv::Vec3b(0, 0, 255));      // Red centroids
+
+    // Draw the previous positions of every organism as a green tail
+    tracer.tails.draw(layer, cv::Scalar(0, 255, 0));
+
+    size_t rectCapacity = context.overlayRects.capacity();
+    overlayRects(context, tracer.tails.drawnBounds(), frame.size(), context.overlayRects);
+    context.trackCapacity(context.overlayRects, rectCapacity);
+    METRICS_LAP(watch, "draw");
+
+    cv::Mat& result = context.buffer(context.result, frame.size(), CV_8UC3);
+    expandGray(frame, &result, nullptr);
+    addLayer(result, frame, layer, context.overlayRects);
+    METRICS_LAP(watch, "blend");
+    drawMetricsOverlay(result);
+
+    cv::imshow(tracer.window, result);
+    METRICS_LAP(watch, "imshow");
+}
+
+// Where a headless run writes and how it is scheduled, see headlessSettings() in options.hpp
+struct HeadlessSettings
+{
+    std::string output;
+    int threads = 0;
+    double latencyBudget = 0.0;
+    std::string latencyLogPath;
+    std::string statsPath;
+};
+
+// What a program adds to the headless run: stages after the tracer's, where the detections
+// of a frame go (the CSV output file if not set) and what to do once every frame is through,
+// which returns false if the run failed after all (e.g. the output could not be written)
+struct HeadlessHooks
+{
+    std::function<void(Pipeline<FrameJob>&)> addStages;
+    std::function<void(const FrameJob&)> write;
+    std::function<bool()> finish;
+};
+
+// Process every frame without any HighGUI calls and write the detections, by default to a
+// CSV file. Decoding, grayscale conversion, the tracer's stages and the program's run as a
+// threaded pipeline; the detections are written in frame order from this thread. program
+// names the run in the --stats report.
+inline int runHeadless(const char* program, PacedSource& source, Tracer& tracer, const HeadlessSettings& settings,
+                       const HeadlessHooks& hooks = HeadlessHooks())
+{
+    std::ofstream output;
+    if (!hooks.write) {
+        output.open(settings.output);
+        if (!output.is_open()) {
+            std::cout << "Error opening output file!" << std::endl;
+            return -1;
+        }
+        output << "Frame, X, Y, Area\n";
+    }
+
+    Pipeline<FrameJob> pipeline;
+    int workers = pipelineWorkers(settings.threads);
+    tracer.addStages(pipeline, workers);
+    if (hooks.addStages)
+        hooks.addStages(pipeline);
+
+    // Behind a paced source, frames are left out or segmented cheaper to keep the latency budget
+    LatencyScheduler scheduler;
+    scheduler.configure(settings.latencyBudget, tracer.degradeFactor(), 2 * workers + 2);
+    if (!settings.latencyLogPath.empty() && !scheduler.openLog(settings.latencyLogPath)) {
+        std::cout << "Error opening " << settings.latencyLogPath << std::endl;
+        return -1;
+    }
+
+    pipeline.enableTiming(!settings.statsPath.empty());
+    RunMeasurement measurement;
+    AllocationStats allocationStats;
+    pipeline.run(pacedSource(source, scheduler), [&](FrameJob& job) {
+        if (hooks.write)
+            hooks.write(job);
+        else
+            writeDetections(output, job.frameIndex, job.context.detections);
+        allocationStats.add(job.context);
+        scheduler.finished(job.frameIndex, job.captureTime);
+        METRICS_TICK();
+        return true;
+    });
+    RunReport report = measurement.finish(program, pipeline, allocationStats);
+    dumpMetrics();
+    bool finished = !hooks.finish || hooks.finish();
+
+    std::cout << "Processed " << allocationStats.frames << " frames" << std::endl;
+    if (tracer.gate.enabled() && tracer.params.pyramidFactor == 1)
+        std::cout << "Segmented " << static_cast<int>(tracer.gate.activeFraction() * 100.0 + 0.5) << "% of the tiles"
+                  << std::endl;
+    allocationStats.print(std::cout);
+
+    if (!finishLatency(report, source, scheduler) || !finished)
+        return -1;
+
+    if (!settings.statsPath.empty() && !report.write(settings.statsPath)) {
+        std::cout << "Error writing " << settings.statsPath << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "detection.hpp"
+
+// Motion statistics of the tracks, updated online from the tracked detections of every
+// frame, so nothing has to re-read the trajectory log afterwards.
+//
+// Every track keeps a fixed amount of state however long it lives: a running mean and
+// variance of its speed (Welford), the time-averaged mean squared displacement (MSD) at
+// lags of 1 to 32 frames, read from a ring of its last 32 positions, and a histogram of
+// its turning angles. A track that is no longer tracked is folded into the totals of the
+// run and its slot reused. Summaries pool all tracks; the final one also lists every
+// track seen for at least kMinObservations frames.
+
+// Mean and variance of a stream of values, mergeable with another (Chan et al.)
+struct RunningStats
+{
+    int64_t count = 0;
+    double mean = 0.0;
+    double m2 = 0.0; // sum of squared differences from the mean
+
+    void add(double value)
+    {
+        ++count;
+        double delta = value - mean;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+
+    void merge(const RunningStats& other)
+    {
+        if (other.count == 0)
+            return;
+        int64_t total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * (static_cast<double>(count) * other.count / total);
+        count = total;
+    }
+
+    double variance() const { return count > 1 ? m2 / (count - 1) : 0.0; }
+    double stddev() const { return std::sqrt(variance()); }
+};
+
+// MSD lags in frames
+constexpr std::array<int, 6> kMsdLags = {1, 2, 4, 8, 16, 32};
+constexpr int kMaxMsdLag = 32;
+constexpr int kTurnBins = 36; // 10 degrees each, from -180 to 180
+
+// Motion statistics of one track, or pooled over several
+struct MotionStats
+{
+    int tracks = 0;
+    RunningStats speed; // pixels per second
+    std::array<double, kMsdLags.size()> msdSum{};
+    std::array<int64_t, kMsdLags.size()> msdCount{};
+    std::array<int64_t, kTurnBins> turns{};
+    double turnCos = 0.0; // sums over the turning angles, for their mean direction
+    double turnSin = 0.0;
+    double turnAbs = 0.0; // sum of the absolute turning angles, in radians
+
+    void merge(const MotionStats& other)
+    {
+        tracks += other.tracks;
+        speed.merge(other.speed);
+        for (size_t l = 0; l < kMsdLags.size(); ++l) {
+            msdSum[l] += other.msdSum[l];
+            msdCount[l] += other.msdCount[l];
+        }
+        for (int b = 0; b < kTurnBins; ++b)
+            turns[b] += other.turns[b];
+        turnCos += other.turnCos;
+        turnSin += other.turnSin;
+        turnAbs += other.turnAbs;
+    }
+
+    double msd(size_t lag) const { return msdCount[lag] > 0 ? msdSum[lag] / msdCount[lag] : 0.0; }
+
+    int64_t turnCount() const
+    {
+        int64_t count = 0;
+        for (int64_t n : turns)
+            count += n;
+        return count;
+    }
+
+    // Length of the mean turning direction, 1 for a straight path and near 0 for a random walk
+    double persistence() const
+    {
+        int64_t count = turnCount();
+        return count > 0 ? std::hypot(turnCos, turnSin) / count : 0.0;
+    }
+
+    double meanAbsTurnDegrees() const
+    {
+        int64_t count = turnCount();
+        return count > 0 ? turnAbs / count * 180.0 / CV_PI : 0.0;
+    }
+};
+
+// Statistics of one finished track, kept for the final summary
+struct TrackSummary
+{
+    int id = 0;
+    int firstFrame = 0;
+    int lastFrame = 0;
+    int observations = 0;
+    MotionStats stats;
+};
+
+class TrackAnalytics
+{
+public:
+    static constexpr int kMinObservations = 10;
+
+    // frameMsec is the frame period of the video. A track not seen for more than maxGap
+    // frames is finished. Summaries are printed and written to path (JSON or YAML, if not
+    // empty) every interval seconds of wall time, if interval > 0.
+    void configure(double frameMsec, int maxGap, const std::string& path, double interval)
+    {
+        m_frameSec = (frameMsec > 0.0 ? frameMsec : 1000.0 / 30.0) / 1000.0;
+        m_maxGap = std::max(0, maxGap);
+        m_path = path;
+        m_interval = interval;
+        m_enabled = true;
+        m_lastReport = std::chrono::steady_clock::now();
+    }
+
+    bool enabled() const { return m_enabled; }
+
+    // Add the tracked detections of a frame. Frames must come in order, a frame at or
+    // before the last one (a re-tracked paused frame) is ignored.
+    void update(const std::vector<Detection>& detections, int frameIndex)
+    {
+        if (!m_enabled || frameIndex <= m_lastFrame)
+            return;
+        m_lastFrame = frameIndex;
+
+        for (const auto& detection : detections) {
+            if (detection.trackId >= 0)
+                add(m_slots[slotOf(detection.trackId, frameIndex)], frameIndex, detection.centroid);
+        }
+
+        // Finish the tracks the tracker has given up on
+        for (auto it = m_slotOf.begin(); it != m_slotOf.end();) {
+            Slot& slot = m_slots[it->second];
+            if (frameIndex - slot.lastFrame > m_maxGap) {
+                finish(slot);
+                m_free.push_back(it->second);
+                it = m_slotOf.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Report if the interval has passed since the last report
+    void tick()
+    {
+        if (!m_enabled || m_interval <= 0.0)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - m_lastReport).count() < m_interval)
+            return;
+        m_lastReport = now;
+        report(false);
+    }
+
+    // Finish every track and write the final summary, with the per-track list
+    void close()
+    {
+        if (!m_enabled)
+            return;
+        for (const auto& entry : m_slotOf)
+            finish(m_slots[entry.second]);
+        m_slotOf.clear();
+        m_free.clear();
+        m_slots.clear();
+        report(true);
+        m_enabled = false;
+    }
+
+    // Statistics pooled over every track so far, finished or not
+    MotionStats pooled() const
+    {
+        MotionStats stats = m_finished;
+        for (const auto& entry : m_slotOf)
+            stats.merge(m_slots[entry.second].stats);
+        return stats;
+    }
+
+    // Human-readable summary of the pooled statistics
+    void print(std::ostream& out) const
+    {
+        MotionStats stats = pooled();
+        out << "Trajectory analytics at frame " << m_lastFrame << ": " << stats.tracks << " tracks, "
+            << m_slotOf.size() << " live\n";
+        out << std::fixed << std::setprecision(2);
+        out << "  speed " << stats.speed.mean << " +- " << stats.speed.stddev() << " px/s over "
+            << stats.speed.count << " steps\n";
+        out << "  MSD";
+        for (size_t l = 0; l < kMsdLags.size(); ++l)
+            out << "  " << kMsdLags[l] << "f: " << stats.msd(l);
+        out << " px^2\n";
+        out << "  turning " << stats.meanAbsTurnDegrees() << " deg mean, persistence " << stats.persistence()
+            << " over " << stats.turnCount() << " turns" << std::endl;
+        out << std::defaultfloat;
+    }
+
+    // Write the pooled statistics (and the finished tracks, if withTracks) as JSON or YAML
+    bool write(const std::string& path, bool withTracks) const
+    {
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened())
+            return false;
+        fs << "frame" << m_lastFrame;
+        fs << "frame_seconds" << m_frameSec;
+        fs << "live_tracks" << static_cast<int>(m_slotOf.size());
+        fs << "pooled" << "{";
+        writeStats(fs, pooled());
+        fs << "}";
+        if (withTracks) {
+            fs << "tracks" << "[";
+            for (const auto& track : m_tracks) {
+                fs << "{" << "id" << track.id << "first_frame" << track.firstFrame << "last_frame" << track.lastFrame
+                   << "observations" << track.observations;
+                writeStats(fs, track.stats);
+                fs << "}";
+            }
+            fs << "]";
+        }
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        int id = 0;
+        int firstFrame = 0;
+        int lastFrame = 0;
+        int observations = 0;
+        cv::Point2f position;
+        cv::Point2f step; // last step long enough to have a direction
+        bool hasStep = false;
+        std::array<int, kMaxMsdLag> recentFrame; // ring of the last positions, by frame % kMaxMsdLag
+        std::array<cv::Point2f, kMaxMsdLag> recent;
+        MotionStats stats;
+    };
+
+    // Steps shorter than this (in pixels) are jitter, not a heading
+    static constexpr float kMinTurnStep = 1.0f;
+
+    int slotOf(int trackId, int frameIndex)
+    {
+        auto it = m_slotOf.find(trackId);
+        if (it != m_slotOf.end())
+            return it->second;
+
+        int slot;
+        if (!m_free.empty()) {
+            slot = m_free.back();
+            m_free.pop_back();
+        } else {
+            slot = static_cast<int>(m_slots.size());
+            m_slots.emplace_back();
+        }
+        Slot& s = m_slots[slot];
+        s = Slot();
+        s.id = trackId;
+        s.firstFrame = frameIndex;
+        s.recentFrame.fill(-1);
+        s.stats.tracks = 1;
+        m_slotOf.emplace(trackId, slot);
+        return slot;
+    }
+
+    void add(Slot& slot, int frameIndex, cv::Point2f position)
+    {
+        MotionStats& stats = slot.stats;
+        if (slot.observations > 0) {
+            cv::Point2f step = position - slot.position;
+            float length = std::hypot(step.x, step.y);
+            stats.speed.add(length / ((frameIndex - slot.lastFrame) * m_frameSec));
+            if (length >= kMinTurnStep) {
+                if (slot.hasStep) {
+                    double angle = std::atan2(slot.step.x * step.y - slot.step.y * step.x, slot.step.dot(step));
+                    int bin = static_cast<int>((angle + CV_PI) / (2.0 * CV_PI) * kTurnBins);
+                    ++stats.turns[std::min(std::max(bin, 0), kTurnBins - 1)];
+                    stats.turnCos += std::cos(angle);
+                    stats.turnSin += std::sin(angle);
+                    stats.turnAbs += std::abs(angle);
+                }
+                slot.step = step;
+                slot.hasStep = true;
+            }
+        }
+
+        for (size_t l = 0; l < kMsdLags.size(); ++l) {
+            int past = frameIndex - kMsdLags[l];
+            int index = past % kMaxMsdLag;
+            if (past >= slot.firstFrame && slot.recentFrame[index] == past) {
+                cv::Point2f d = position - slot.recent[index];
+                stats.msdSum[l] += d.dot(d);
+                ++stats.msdCount[l];
+            }
+        }
+        slot.recentFrame[frameIndex % kMaxMsdLag] = frameIndex;
+        slot.recent[frameIndex % kMaxMsdLag] = position;
+
+        slot.position = position;
+        slot.lastFrame = frameIndex;
+        ++slot.observations;
+    }
+
+    void finish(const Slot& slot)
+    {
+        m_finished.merge(slot.stats);
+        if (slot.observations >= kMinObservations)
+            m_tracks.push_back({slot.id, slot.firstFrame, slot.lastFrame, slot.observations, slot.stats});
+    }
+
+    void report(bool final)
+    {
+        print(std::cout);
+        if (!m_path.empty() && !write(m_path, final))
+            std::cout << "Error writing " << m_path << std::endl;
+    }
+
+    void writeStats(cv::FileStorage& fs, const MotionStats& stats) const
+    {
+        fs << "tracks" << stats.tracks;
+        fs << "speed_mean" << stats.speed.mean << "speed_sd" << stats.speed.stddev()
+           << "speed_samples" << static_cast<double>(stats.speed.count);
+        fs << "msd" << "[";
+        for (size_t l = 0; l < kMsdLags.size(); ++l) {
+            fs << "{" << "lag_frames" << kMsdLags[l] << "lag_seconds" << kMsdLags[l] * m_frameSec << "msd_px2"
+               << stats.msd(l) << "samples" << static_cast<double>(stats.msdCount[l]) << "}";
+        }
+        fs << "]";
+        fs << "turn_mean_abs_deg" << stats.meanAbsTurnDegrees() << "turn_persistence" << stats.persistence();
+        fs << "turn_histogram" << "[:";
+        for (int64_t n : stats.turns)
+            fs << static_cast<double>(n);
+        fs << "]";
+    }
+
+    bool m_enabled = false;
+    double m_frameSec = 1.0 / 30.0;
+    int m_maxGap = 0;
+    int m_lastFrame = -1;
+    std::string m_path;
+    double m_interval = 0.0;
+    std::chrono::steady_clock::time_point m_lastReport;
+
+    std::vector<Slot> m_slots;
+    std::vector<int> m_free;
+    std::unordered_map<int, int> m_slotOf; // track ID to slot
+    MotionStats m_finished;                // pooled over the finished tracks
+    std::vector<TrackSummary> m_tracks;    // finished tracks with enough observations
+};
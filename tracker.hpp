@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "detection.hpp"
+
+// One organism followed across frames
+struct Track
+{
+    int id = 0;
+    cv::Point2f position;
+    cv::Point2f velocity; // pixels per frame, smoothed
+    int firstFrame = 0;
+    int lastFrame = 0;    // last frame it was detected in
+    int hits = 0;         // frames it was detected in
+    int missed = 0;       // video frames since it was last detected
+};
+
+// A bright color that stays the same for a track ID
+inline cv::Scalar trackColor(int id)
+{
+    unsigned hash = static_cast<unsigned>(id) * 2654435761u;
+    return cv::Scalar(64 + (hash & 0xbf), 64 + ((hash >> 8) & 0xbf), 64 + ((hash >> 16) & 0xbf));
+}
+
+// Frame-to-frame association of detections with persistent track IDs.
+//
+// Each track predicts its position from its velocity. Detections are bucketed in a uniform
+// grid with cells the size of the gate, so a track only looks at the 3x3 cells around its
+// prediction. All track/detection pairs within the gate are then assigned greedily,
+// closest first. Unmatched detections start new tracks, tracks undetected for more than
+// maxMissed video frames are dropped (frames that are not tracked count too). Everything is
+// linear in the number of detections apart from sorting the candidate pairs, and no memory
+// is allocated once the counts settle.
+class Tracker
+{
+public:
+    explicit Tracker(float gate = 40.0f, int maxMissed = 10) : m_gate(gate), m_maxMissed(maxMissed) {}
+
+    // Match the detections of a frame to the tracks and set their trackId. Frames must come
+    // in order; calling it again for the same frame (e.g. after re-filtering a paused frame)
+    // redoes that frame instead of advancing the tracks twice.
+    void update(std::vector<Detection>& detections, int frameIndex)
+    {
+        if (frameIndex == m_lastFrame) {
+            m_tracks.assign(m_before.begin(), m_before.end());
+            m_nextId = m_nextIdBefore;
+        } else {
+            m_before.assign(m_tracks.begin(), m_tracks.end());
+            m_nextIdBefore = m_nextId;
+            m_lastFrame = frameIndex;
+        }
+
+        buildGrid(detections);
+        findCandidates(detections, frameIndex);
+
+        // Closest pairs first, each track and detection used at most once
+        std::sort(m_candidates.begin(), m_candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.distance < b.distance;
+        });
+        m_trackMatch.assign(m_tracks.size(), -1);
+        for (auto& detection : detections)
+            detection.trackId = -1;
+        for (const auto& candidate : m_candidates) {
+            if (m_trackMatch[candidate.track] >= 0 || detections[candidate.detection].trackId >= 0)
+                continue;
+            m_trackMatch[candidate.track] = candidate.detection;
+            detections[candidate.detection].trackId = m_tracks[candidate.track].id;
+        }
+
+        // Matched tracks move to their detection, the others coast on their velocity
+        for (size_t t = 0; t < m_tracks.size(); ++t) {
+            Track& track = m_tracks[t];
+            int frames = std::max(1, frameIndex - track.lastFrame);
+            if (m_trackMatch[t] >= 0) {
+                cv::Point2f measured = detections[m_trackMatch[t]].centroid;
+                cv::Point2f step = (measured - track.position) * (1.0f / frames);
+                track.velocity = track.hits > 1 ? (track.velocity + step) * 0.5f : step;
+                track.position = measured;
+                track.lastFrame = frameIndex;
+                ++track.hits;
+                track.missed = 0;
+            } else {
+                track.missed = frameIndex - track.lastFrame;
+            }
+        }
+
+        m_tracks.erase(std::remove_if(m_tracks.begin(), m_tracks.end(),
+                                      [this](const Track& track) { return track.missed > m_maxMissed; }),
+                       m_tracks.end());
+
+        // Every detection left over starts a track
+        for (auto& detection : detections) {
+            if (detection.trackId >= 0)
+                continue;
+            Track track;
+            track.id = m_nextId++;
+            track.position = detection.centroid;
+            track.firstFrame = frameIndex;
+            track.lastFrame = frameIndex;
+            track.hits = 1;
+            m_tracks.push_back(track);
+            detection.trackId = track.id;
+        }
+    }
+
+    const std::vector<Track>& tracks() const { return m_tracks; }
+
+    // Largest distance (in pixels) between a track's predicted position and its detection
+    void setGate(float gate) { m_gate = std::max(1.0f, gate); }
+
+    // Frames a track may go undetected before it is dropped
+    void setMaxMissed(int maxMissed) { m_maxMissed = std::max(0, maxMissed); }
+    int maxMissed() const { return m_maxMissed; }
+
+private:
+    struct Candidate
+    {
+        float distance;
+        int track;
+        int detection;
+    };
+
+    // Bucket the detections by grid cell (counting sort), over their bounding box
+    void buildGrid(const std::vector<Detection>& detections)
+    {
+        m_gridOrigin = cv::Point2f(0.0f, 0.0f);
+        m_gridCols = m_gridRows = 0;
+        m_cellStart.assign(1, 0);
+        if (detections.empty())
+            return;
+
+        cv::Point2f low = detections[0].centroid;
+        cv::Point2f high = low;
+        for (const auto& detection : detections) {
+            low.x = std::min(low.x, detection.centroid.x);
+            low.y = std::min(low.y, detection.centroid.y);
+            high.x = std::max(high.x, detection.centroid.x);
+            high.y = std::max(high.y, detection.centroid.y);
+        }
+        // Cells at least as large as the gate, so the 3x3 neighbourhood covers it, but no
+        // more than about 512 of them across
+        m_gridOrigin = low;
+        m_cellSize = std::max(m_gate, std::max(high.x - low.x, high.y - low.y) / 512.0f);
+        m_gridCols = static_cast<int>((high.x - low.x) / m_cellSize) + 1;
+        m_gridRows = static_cast<int>((high.y - low.y) / m_cellSize) + 1;
+
+        m_cellStart.assign(static_cast<size_t>(m_gridCols) * m_gridRows + 1, 0);
+        m_detectionCell.resize(detections.size());
+        for (size_t i = 0; i < detections.size(); ++i) {
+            cv::Point cell = cellOf(detections[i].centroid);
+            m_detectionCell[i] = cell.y * m_gridCols + cell.x;
+            ++m_cellStart[m_detectionCell[i] + 1];
+        }
+        for (size_t c = 1; c < m_cellStart.size(); ++c)
+            m_cellStart[c] += m_cellStart[c - 1];
+        m_cellItems.resize(detections.size());
+        m_cellFill.assign(m_cellStart.begin(), m_cellStart.end() - 1);
+        for (size_t i = 0; i < detections.size(); ++i)
+            m_cellItems[m_cellFill[m_detectionCell[i]]++] = static_cast<int>(i);
+    }
+
+    // Grid cell of a point, clamped to one cell outside the grid for far away points
+    cv::Point cellOf(const cv::Point2f& p) const
+    {
+        float x = std::floor((p.x - m_gridOrigin.x) / m_cellSize);
+        float y = std::floor((p.y - m_gridOrigin.y) / m_cellSize);
+        return cv::Point(static_cast<int>(std::min(std::max(x, -2.0f), static_cast<float>(m_gridCols + 1))),
+                         static_cast<int>(std::min(std::max(y, -2.0f), static_cast<float>(m_gridRows + 1))));
+    }
+
+    // All track/detection pairs closer than the gate, searching the cells around each
+    // track's position predicted for frameIndex. Frames may be left out (e.g. by the latency
+    // scheduler), so the prediction and the tracks still open are counted in video frames:
+    // a track can be matched up to maxMissed + 1 frames after its last detection.
+    void findCandidates(const std::vector<Detection>& detections, int frameIndex)
+    {
+        m_candidates.clear();
+        if (detections.empty())
+            return;
+
+        float gate2 = m_gate * m_gate;
+        for (size_t t = 0; t < m_tracks.size(); ++t) {
+            const Track& track = m_tracks[t];
+            int frames = std::max(1, frameIndex - track.lastFrame);
+            if (frames > m_maxMissed + 1)
+                continue;
+            cv::Point2f predicted = track.position + track.velocity * static_cast<float>(frames);
+            cv::Point center = cellOf(predicted);
+            int x0 = std::max(center.x - 1, 0);
+            int x1 = std::min(center.x + 1, m_gridCols - 1);
+            int y0 = std::max(center.y - 1, 0);
+            int y1 = std::min(center.y + 1, m_gridRows - 1);
+            for (int cy = y0; cy <= y1; ++cy) {
+                for (int cx = x0; cx <= x1; ++cx) {
+                    int cell = cy * m_gridCols + cx;
+                    for (int k = m_cellStart[cell]; k < m_cellStart[cell + 1]; ++k) {
+                        int d = m_cellItems[k];
+                        cv::Point2f offset = detections[d].centroid - predicted;
+                        float distance = offset.dot(offset);
+                        if (distance <= gate2)
+                            m_candidates.push_back({distance, static_cast<int>(t), d});
+                    }
+                }
+            }
+        }
+    }
+
+    float m_gate;
+    int m_maxMissed;
+    int m_nextId = 1;
+    std::vector<Track> m_tracks;
+
+    // State before the last frame, to redo it
+    std::vector<Track> m_before;
+    int m_nextIdBefore = 1;
+    int m_lastFrame = -1;
+
+    cv::Point2f m_gridOrigin;
+    float m_cellSize = 1.0f;
+    int m_gridCols = 0;
+    int m_gridRows = 0;
+    std::vector<int> m_cellStart;
+    std::vector<int> m_cellFill;
+    std::vector<int> m_cellItems;
+    std::vector<int> m_detectionCell;
+    std::vector<Candidate> m_candidates;
+    std::vector<int> m_trackMatch;
+};
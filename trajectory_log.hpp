@@ -0,0 +1,225 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "detection.hpp"
+#include "spsc_queue.hpp"
+#include "trajectory_store.hpp"
+
+// Writes trajectory records to a CSV, binary or columnar file on a background thread.
+//
+// The processing thread only copies each record into a lock-free queue; the writer thread
+// formats them in batches and writes a batch whenever it has collected enough or the
+// queue runs dry. Nothing is flushed per record.
+//
+// The binary format is a 16-byte header, "PTRJ" followed by the version, the record size
+// and the header size as uint32, then one 32-byte record per detection: int32 frame,
+// int32 track ID, float64 time in ms, float32 x, y and area and 4 bytes of padding. Values
+// are in the byte order of the machine (little-endian on x86 and ARM). The columnar format
+// is described in trajectory_store.hpp.
+class TrajectoryLog
+{
+public:
+    enum class Format { Csv, Binary, Columnar };
+
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kHeaderSize = 16;
+    static constexpr uint32_t kRecordSize = 32;
+    static constexpr const char* kCsvHeader = "Frame, Time, ID, X, Y, Area";
+
+    TrajectoryLog() = default;
+    TrajectoryLog(const TrajectoryLog&) = delete;
+    TrajectoryLog& operator=(const TrajectoryLog&) = delete;
+    ~TrajectoryLog() { close(); }
+
+    // Files ending in .bin are binary, in .ptc columnar, everything else CSV
+    static Format formatFor(const std::string& path)
+    {
+        size_t dot = path.rfind('.');
+        std::string extension = dot != std::string::npos ? path.substr(dot) : std::string();
+        if (extension == ".bin")
+            return Format::Binary;
+        return extension == ".ptc" ? Format::Columnar : Format::Csv;
+    }
+
+    // Start writing path, from scratch or appending to it; echo also prints every record to
+    // std::cout (from the writer thread). Returns false if the file can't be opened, or is
+    // to be appended to and holds another format.
+    bool open(const std::string& path, WriteMode mode = WriteMode::Replace, bool echo = false)
+    {
+        close();
+        m_format = formatFor(path);
+        m_echo = echo;
+        if (m_format == Format::Columnar) {
+            if (!m_store.open(path, mode))
+                return false;
+        } else {
+            if (mode == WriteMode::Append && !canAppend(path, m_format)) {
+                std::cout << path << " is not a trajectory log of this format, not appending to it" << std::endl;
+                return false;
+            }
+            std::ios::openmode openMode = mode == WriteMode::Append ? std::ios::app : std::ios::trunc;
+            m_file.open(path, std::ios::out | std::ios::binary | openMode);
+            if (!m_file.is_open())
+                return false;
+        }
+
+        // Headers only go at the start of a new file
+        if (m_format != Format::Columnar && m_file.seekp(0, std::ios::end).tellp() == 0) {
+            if (m_format == Format::Csv) {
+                m_file << kCsvHeader << "\n";
+            } else {
+                char header[kHeaderSize];
+                uint32_t fields[3] = {kVersion, kRecordSize, kHeaderSize};
+                std::memcpy(header, "PTRJ", 4);
+                std::memcpy(header + 4, fields, sizeof(fields));
+                m_file.write(header, kHeaderSize);
+            }
+        }
+
+        m_records = 0;
+        m_abort = false;
+        m_writeFailed = false;
+        m_queue = std::make_unique<SpscQueue<TrajectoryRecord>>(kQueueCapacity);
+        m_writer = std::thread([this] { writeRecords(); });
+        return true;
+    }
+
+    bool isOpen() const { return m_writer.joinable(); }
+
+    // Write the remaining records and close the file. False if any write failed (e.g. the
+    // disk is full), the file is then incomplete.
+    bool close()
+    {
+        if (!m_writer.joinable())
+            return true;
+        m_queue->close();
+        m_writer.join();
+        bool written = !m_writeFailed;
+        if (m_file.is_open()) {
+            m_file.close();
+            written = written && !m_file.fail();
+        }
+        written = m_store.close() && written;
+        m_queue.reset();
+        return written;
+    }
+
+    // Queue the detections of one frame. Only waits if the writer falls a whole queue behind.
+    void log(int frameIndex, double timeMsec, const std::vector<Detection>& detections)
+    {
+        if (!isOpen())
+            return;
+        for (const auto& detection : detections) {
+            TrajectoryRecord record{frameIndex, detection.trackId, timeMsec, static_cast<float>(detection.centroid.x),
+                                    static_cast<float>(detection.centroid.y), static_cast<float>(detection.area)};
+            m_queue->push(std::move(record), m_abort);
+        }
+        m_records += detections.size();
+    }
+
+    // Records queued since the file was opened; all of them are in the file if close()
+    // succeeds
+    size_t records() const { return m_records; }
+
+private:
+    static constexpr size_t kQueueCapacity = 1 << 16;
+    static constexpr size_t kBatchBytes = 1 << 16;
+
+    // Whether path is missing, empty or a log of format with this header and whole records
+    static bool canAppend(const std::string& path, Format format)
+    {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open() || file.tellg() == 0)
+            return true;
+        std::streamoff size = file.tellg();
+        file.seekg(0);
+        if (format == Format::Csv) {
+            std::string line;
+            std::getline(file, line);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            return line == kCsvHeader;
+        }
+        char header[kHeaderSize] = {};
+        uint32_t fields[3] = {};
+        file.read(header, kHeaderSize);
+        std::memcpy(fields, header + 4, sizeof(fields));
+        return file && std::memcmp(header, "PTRJ", 4) == 0 && fields[0] == kVersion && fields[1] == kRecordSize &&
+               fields[2] == kHeaderSize && (size - kHeaderSize) % kRecordSize == 0;
+    }
+
+    void writeRecords()
+    {
+        std::string batch;
+        std::string echo;
+        batch.reserve(kBatchBytes + 256);
+        TrajectoryRecord record;
+        while (m_queue->pop(record, m_abort)) {
+            // Take whatever else is queued, up to a batch
+            do {
+                append(batch, echo, record);
+            } while (batch.size() < kBatchBytes && m_queue->tryPop(record));
+
+            if (!batch.empty())
+                m_file.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+            batch.clear();
+            // The queue is drained anyway, so the processing thread never waits on a failed file
+            if (m_format == Format::Columnar ? !m_store.good() : !m_file)
+                m_writeFailed = true;
+            if (!echo.empty()) {
+                std::cout << echo << std::flush;
+                echo.clear();
+            }
+        }
+        if (m_format == Format::Columnar ? !m_store.flush() : !m_file.flush())
+            m_writeFailed = true;
+    }
+
+    void append(std::string& batch, std::string& echo, const TrajectoryRecord& record)
+    {
+        char line[128];
+        if (m_format == Format::Csv) {
+            int length = std::snprintf(line, sizeof(line), "%d, %.3f, %d, %.2f, %.2f, %.0f\n", record.frameIndex,
+                                       record.timeMsec, record.trackId, record.x, record.y, record.area);
+            batch.append(line, length);
+        } else if (m_format == Format::Columnar) {
+            m_store.append(record);
+        } else {
+            char bytes[kRecordSize] = {};
+            std::memcpy(bytes, &record.frameIndex, 4);
+            std::memcpy(bytes + 4, &record.trackId, 4);
+            std::memcpy(bytes + 8, &record.timeMsec, 8);
+            std::memcpy(bytes + 16, &record.x, 4);
+            std::memcpy(bytes + 20, &record.y, 4);
+            std::memcpy(bytes + 24, &record.area, 4);
+            batch.append(bytes, kRecordSize);
+        }
+
+        if (m_echo) {
+            int length = std::snprintf(line, sizeof(line),
+                                       "Centroid logged: ID=%d, X=%.2f, Y=%.2f, Frame=%d, Time=%.3fs\n",
+                                       record.trackId, record.x, record.y, record.frameIndex,
+                                       record.timeMsec / 1000.0);
+            echo.append(line, length);
+        }
+    }
+
+    Format m_format = Format::Csv;
+    bool m_echo = false;
+    std::ofstream m_file;
+    TrajectoryStoreWriter m_store;
+    std::unique_ptr<SpscQueue<TrajectoryRecord>> m_queue;
+    std::thread m_writer;
+    std::atomic<bool> m_abort{false};
+    std::atomic<bool> m_writeFailed{false};
+    size_t m_records = 0;
+};
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// One logged detection
+struct TrajectoryRecord
+{
+    int32_t frameIndex;
+    int32_t trackId;
+    double timeMsec; // video position (CAP_PROP_POS_MSEC)
+    float x;
+    float y;
+    float area;
+};
+
+// Columnar trajectory files (.ptc), for range queries over long recordings.
+//
+// Records are stored in chunks of up to kChunkRecords, each column of a chunk contiguous:
+// time (float64), frame and track ID (int32), x, y and area (float32). Every chunk starts
+// with a header holding its record count and the min / max of each column, so a query
+// skips the chunks that can't match by looking at their headers only, and within a chunk
+// whose times are in order it finds the time range by binary search. Files are written a
+// chunk at a time and may be appended to; a reader maps the file and reads the columns in
+// place, ignoring a last chunk that is not complete yet.
+//
+// The file starts with "PTCS" followed by the version, the file header size and the chunk
+// header size as uint32. Values are in the byte order of the machine, like the binary log.
+
+struct TrajectoryChunkHeader
+{
+    char magic[4]; // "CHNK"
+    uint32_t count;
+    uint32_t flags; // kChunkTimeSorted
+    uint32_t reserved;
+    int32_t minFrame;
+    int32_t maxFrame;
+    int32_t minTrack;
+    int32_t maxTrack;
+    double minTime;
+    double maxTime;
+    float minX;
+    float maxX;
+    float minY;
+    float maxY;
+    float minArea;
+    float maxArea;
+};
+
+constexpr uint32_t kTrajectoryStoreVersion = 1;
+constexpr uint32_t kTrajectoryStoreHeaderSize = 16;
+constexpr uint32_t kChunkRecords = 16384;
+constexpr uint32_t kChunkTimeSorted = 1; // times never decrease within the chunk
+constexpr size_t kColumnBytes = 8 + 4 + 4 + 4 + 4 + 4; // of one record, over all columns
+
+// Whether opening a trajectory file for writing starts it anew or adds to what it holds
+enum class WriteMode
+{
+    Replace,
+    Append,
+};
+
+// Bytes of a chunk of count records, header included, padded to 8
+inline size_t trajectoryChunkSize(uint32_t count)
+{
+    size_t bytes = sizeof(TrajectoryChunkHeader) + count * kColumnBytes;
+    return (bytes + 7) & ~static_cast<size_t>(7);
+}
+
+// Writes records to a columnar file, one chunk at a time
+class TrajectoryStoreWriter
+{
+public:
+    TrajectoryStoreWriter() = default;
+    TrajectoryStoreWriter(const TrajectoryStoreWriter&) = delete;
+    TrajectoryStoreWriter& operator=(const TrajectoryStoreWriter&) = delete;
+    ~TrajectoryStoreWriter() { close(); }
+
+    // Start writing path, from scratch or after the chunks it holds. Returns false if the
+    // file can't be opened, or is to be appended to and is not a trajectory store of this
+    // version whose chunks are all complete.
+    bool open(const std::string& path, WriteMode mode = WriteMode::Replace)
+    {
+        close();
+        std::ios::openmode openMode = std::ios::in | std::ios::out | std::ios::binary;
+        m_file.open(path, openMode | (mode == WriteMode::Append ? std::ios::app : std::ios::trunc));
+        if (!m_file.is_open())
+            return false;
+        m_file.seekg(0, std::ios::end);
+        std::streamoff size = m_file.tellg();
+        if (size == 0) {
+            char header[kTrajectoryStoreHeaderSize];
+            uint32_t fields[3] = {kTrajectoryStoreVersion, kTrajectoryStoreHeaderSize,
+                                  static_cast<uint32_t>(sizeof(TrajectoryChunkHeader))};
+            std::memcpy(header, "PTCS", 4);
+            std::memcpy(header + 4, fields, sizeof(fields));
+            m_file.write(header, sizeof(header));
+        } else if (!validFile(size)) {
+            std::cout << path << " is not a complete trajectory store of this version, not appending to it"
+                      << std::endl;
+            m_file.close();
+            return false;
+        }
+        reserve();
+        return true;
+    }
+
+    bool isOpen() const { return m_file.is_open(); }
+
+    void append(const TrajectoryRecord& record)
+    {
+        m_time.push_back(record.timeMsec);
+        m_frame.push_back(record.frameIndex);
+        m_track.push_back(record.trackId);
+        m_x.push_back(record.x);
+        m_y.push_back(record.y);
+        m_area.push_back(record.area);
+        if (m_time.size() == kChunkRecords)
+            writeChunk();
+    }
+
+    // Write the records of the unfinished chunk, false if writing the file has failed
+    bool flush()
+    {
+        if (!m_time.empty())
+            writeChunk();
+        m_file.flush();
+        return good();
+    }
+
+    // Whether every write so far succeeded
+    bool good() const { return !m_file.fail(); }
+
+    // Write the unfinished chunk and close the file, false if writing it failed
+    bool close()
+    {
+        if (!m_file.is_open())
+            return true;
+        bool written = flush();
+        m_file.close();
+        return written && !m_file.fail();
+    }
+
+private:
+    // The header matches this version and the chunks end exactly at the end of the file
+    bool validFile(std::streamoff size)
+    {
+        char header[kTrajectoryStoreHeaderSize] = {};
+        uint32_t fields[3] = {};
+        m_file.seekg(0);
+        m_file.read(header, sizeof(header));
+        std::memcpy(fields, header + 4, sizeof(fields));
+        if (!m_file || std::memcmp(header, "PTCS", 4) != 0 || fields[0] != kTrajectoryStoreVersion ||
+            fields[1] != kTrajectoryStoreHeaderSize || fields[2] != sizeof(TrajectoryChunkHeader))
+            return false;
+
+        std::streamoff offset = kTrajectoryStoreHeaderSize;
+        while (offset < size) {
+            TrajectoryChunkHeader chunk;
+            m_file.seekg(offset);
+            m_file.read(reinterpret_cast<char*>(&chunk), sizeof(chunk));
+            if (!m_file || std::memcmp(chunk.magic, "CHNK", 4) != 0)
+                return false;
+            offset += static_cast<std::streamoff>(trajectoryChunkSize(chunk.count));
+        }
+        m_file.clear();
+        return offset == size;
+    }
+
+    void reserve()
+    {
+        m_time.reserve(kChunkRecords);
+        m_frame.reserve(kChunkRecords);
+        m_track.reserve(kChunkRecords);
+        m_x.reserve(kChunkRecords);
+        m_y.reserve(kChunkRecords);
+        m_area.reserve(kChunkRecords);
+    }
+
+    void writeChunk()
+    {
+        uint32_t count = static_cast<uint32_t>(m_time.size());
+        TrajectoryChunkHeader header = {};
+        std::memcpy(header.magic, "CHNK", 4);
+        header.count = count;
+        header.flags = std::is_sorted(m_time.begin(), m_time.end()) ? kChunkTimeSorted : 0;
+        header.minFrame = *std::min_element(m_frame.begin(), m_frame.end());
+        header.maxFrame = *std::max_element(m_frame.begin(), m_frame.end());
+        header.minTrack = *std::min_element(m_track.begin(), m_track.end());
+        header.maxTrack = *std::max_element(m_track.begin(), m_track.end());
+        header.minTime = *std::min_element(m_time.begin(), m_time.end());
+        header.maxTime = *std::max_element(m_time.begin(), m_time.end());
+        header.minX = *std::min_element(m_x.begin(), m_x.end());
+        header.maxX = *std::max_element(m_x.begin(), m_x.end());
+        header.minY = *std::min_element(m_y.begin(), m_y.end());
+        header.maxY = *std::max_element(m_y.begin(), m_y.end());
+        header.minArea = *std::min_element(m_area.begin(), m_area.end());
+        header.maxArea = *std::max_element(m_area.begin(), m_area.end());
+
+        m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        writeColumn(m_time);
+        writeColumn(m_frame);
+        writeColumn(m_track);
+        writeColumn(m_x);
+        writeColumn(m_y);
+        writeColumn(m_area);
+        size_t padding = trajectoryChunkSize(count) - sizeof(header) - count * kColumnBytes;
+        const char zeros[8] = {};
+        m_file.write(zeros, static_cast<std::streamsize>(padding));
+
+        m_time.clear();
+        m_frame.clear();
+        m_track.clear();
+        m_x.clear();
+        m_y.clear();
+        m_area.clear();
+    }
+
+    template <typename T>
+    void writeColumn(const std::vector<T>& column)
+    {
+        auto bytes = static_cast<std::streamsize>(column.size() * sizeof(T));
+        m_file.write(reinterpret_cast<const char*>(column.data()), bytes);
+    }
+
+    std::fstream m_file;
+    std::vector<double> m_time;
+    std::vector<int32_t> m_frame;
+    std::vector<int32_t> m_track;
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_area;
+};
+
+// Read-only memory map of a whole file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path)
+    {
+        close();
+#if defined(_WIN32)
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        m_size = static_cast<size_t>(size.QuadPart);
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping == nullptr) {
+            close();
+            return false;
+        }
+        m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        m_size = static_cast<size_t>(info.st_size);
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        m_data = data == MAP_FAILED ? nullptr : static_cast<const char*>(data);
+#endif
+        if (m_data == nullptr) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#if defined(_WIN32)
+        if (m_data != nullptr)
+            UnmapViewOfFile(m_data);
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data != nullptr)
+            munmap(const_cast<char*>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+};
+
+// The columns of one chunk, pointing into the mapped file
+struct TrajectoryChunk
+{
+    const TrajectoryChunkHeader* header;
+    const double* time;
+    const int32_t* frame;
+    const int32_t* track;
+    const float* x;
+    const float* y;
+    const float* area;
+
+    uint32_t count() const { return header->count; }
+
+    TrajectoryRecord record(uint32_t i) const { return {frame[i], track[i], time[i], x[i], y[i], area[i]}; }
+};
+
+// Records to select, every bound inclusive. The defaults select everything.
+struct TrajectoryQuery
+{
+    static constexpr int kAnyTrack = std::numeric_limits<int>::min();
+
+    double timeBegin = -std::numeric_limits<double>::infinity(); // milliseconds
+    double timeEnd = std::numeric_limits<double>::infinity();
+    int frameBegin = std::numeric_limits<int>::min();
+    int frameEnd = std::numeric_limits<int>::max();
+    int track = kAnyTrack;
+    float xBegin = -std::numeric_limits<float>::infinity(); // region, in pixels
+    float xEnd = std::numeric_limits<float>::infinity();
+    float yBegin = -std::numeric_limits<float>::infinity();
+    float yEnd = std::numeric_limits<float>::infinity();
+
+    // Whether a chunk may hold matching records
+    bool overlaps(const TrajectoryChunkHeader& h) const
+    {
+        return h.maxTime >= timeBegin && h.minTime <= timeEnd && h.maxFrame >= frameBegin && h.minFrame <= frameEnd &&
+               (track == kAnyTrack || (h.minTrack <= track && h.maxTrack >= track)) && h.maxX >= xBegin &&
+               h.minX <= xEnd && h.maxY >= yBegin && h.minY <= yEnd;
+    }
+
+    bool matches(const TrajectoryChunk& chunk, uint32_t i) const
+    {
+        return chunk.time[i] >= timeBegin && chunk.time[i] <= timeEnd && chunk.frame[i] >= frameBegin &&
+               chunk.frame[i] <= frameEnd && (track == kAnyTrack || chunk.track[i] == track) &&
+               chunk.x[i] >= xBegin && chunk.x[i] <= xEnd && chunk.y[i] >= yBegin && chunk.y[i] <= yEnd;
+    }
+};
+
+// Read access to a columnar trajectory file, without copying it
+class TrajectoryStore
+{
+public:
+    // Map path and index its chunks. Returns false if it can't be read or is not a store.
+    bool open(const std::string& path)
+    {
+        m_chunks.clear();
+        m_records = 0;
+        if (!m_map.open(path))
+            return false;
+        const char* data = m_map.data();
+        size_t size = m_map.size();
+        uint32_t fields[3];
+        if (size < kTrajectoryStoreHeaderSize || std::memcmp(data, "PTCS", 4) != 0)
+            return false;
+        std::memcpy(fields, data + 4, sizeof(fields));
+        if (fields[0] != kTrajectoryStoreVersion || fields[2] != sizeof(TrajectoryChunkHeader))
+            return false;
+
+        size_t offset = fields[1];
+        while (offset + sizeof(TrajectoryChunkHeader) <= size) {
+            const auto* header = reinterpret_cast<const TrajectoryChunkHeader*>(data + offset);
+            if (std::memcmp(header->magic, "CHNK", 4) != 0 || offset + trajectoryChunkSize(header->count) > size)
+                break; // a chunk still being written
+            uint32_t count = header->count;
+            const char* column = data + offset + sizeof(TrajectoryChunkHeader);
+            TrajectoryChunk chunk;
+            chunk.header = header;
+            chunk.time = reinterpret_cast<const double*>(column);
+            chunk.frame = reinterpret_cast<const int32_t*>(column + count * 8);
+            chunk.track = reinterpret_cast<const int32_t*>(column + count * 12);
+            chunk.x = reinterpret_cast<const float*>(column + count * 16);
+            chunk.y = reinterpret_cast<const float*>(column + count * 20);
+            chunk.area = reinterpret_cast<const float*>(column + count * 24);
+            m_chunks.push_back(chunk);
+            m_records += count;
+            offset += trajectoryChunkSize(count);
+        }
+        return true;
+    }
+
+    size_t records() const { return m_records; }
+    const std::vector<TrajectoryChunk>& chunks() const { return m_chunks; }
+
+    // Call visit(chunk, index) for every record matching query, in file order. Returns the
+    // number of matches.
+    template <typename Visitor>
+    size_t query(const TrajectoryQuery& query, Visitor&& visit) const
+    {
+        size_t matches = 0;
+        for (const auto& chunk : m_chunks) {
+            if (!query.overlaps(*chunk.header))
+                continue;
+            uint32_t begin = 0;
+            uint32_t end = chunk.count();
+            if (chunk.header->flags & kChunkTimeSorted) {
+                begin = static_cast<uint32_t>(std::lower_bound(chunk.time, chunk.time + end, query.timeBegin) -
+                                              chunk.time);
+                end = static_cast<uint32_t>(std::upper_bound(chunk.time + begin, chunk.time + end, query.timeEnd) -
+                                            chunk.time);
+            }
+            for (uint32_t i = begin; i < end; ++i) {
+                if (query.matches(chunk, i)) {
+                    visit(chunk, i);
+                    ++matches;
+                }
+            }
+        }
+        return matches;
+    }
+
+private:
+    MappedFile m_map;
+    std::vector<TrajectoryChunk> m_chunks;
+    size_t m_records = 0;
+};
@@ -0,0 +1,291 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "trajectory_store.hpp"
+
+// Columnar trajectory files (trajectory_store.hpp) from the command line: convert the CSV
+// and binary logs into one, show what it holds, and print the records in a time range,
+// frame range, region and / or track.
+
+void printUsage(const char* program)
+{
+    std::cout << "Usage: " << program << " COMMAND ...\n"
+              << "  convert INPUT OUTPUT.ptc  convert a CSV log (coord, main or the old ID, X, Y, Time one) or a\n"
+              << "                            binary .bin log, appending to OUTPUT\n"
+              << "  info FILE.ptc             number of records and chunks, and the ranges they cover\n"
+              << "  query FILE.ptc [filters]  print the matching records as CSV\n"
+              << "      --time T0 T1        video time in seconds\n"
+              << "      --frames F0 F1      frame indices\n"
+              << "      --region X Y W H    positions in pixels\n"
+              << "      --track ID          one track\n"
+              << "      --count             only print the number of matches\n"
+              << "  -h, --help              show this message\n";
+}
+
+std::string trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r");
+    size_t end = text.find_last_not_of(" \t\r");
+    return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+}
+
+std::vector<std::string> splitFields(const std::string& line)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t comma = line.find(',', start);
+        fields.push_back(trim(line.substr(start, comma == std::string::npos ? std::string::npos : comma - start)));
+        if (comma == std::string::npos)
+            return fields;
+        start = comma + 1;
+    }
+}
+
+// Column of each record field in a CSV log, -1 if it has none
+struct CsvLayout
+{
+    int frame = 0;
+    int time = 1;
+    int track = 2;
+    int x = 3;
+    int y = 4;
+    int area = 5;
+};
+
+// Layout from a header line such as "Frame, Time, ID, X, Y, Area"
+CsvLayout parseHeader(const std::vector<std::string>& names)
+{
+    CsvLayout layout{-1, -1, -1, -1, -1, -1};
+    for (int i = 0; i < static_cast<int>(names.size()); ++i) {
+        std::string name = names[i];
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if (name == "frame")
+            layout.frame = i;
+        else if (name == "time")
+            layout.time = i;
+        else if (name == "id")
+            layout.track = i;
+        else if (name == "x")
+            layout.x = i;
+        else if (name == "y")
+            layout.y = i;
+        else if (name == "area")
+            layout.area = i;
+    }
+    return layout;
+}
+
+// Milliseconds of a time field: milliseconds, or minutes:seconds in the old log
+double parseTime(const std::string& field)
+{
+    size_t colon = field.find(':');
+    if (colon == std::string::npos)
+        return std::atof(field.c_str());
+    return (std::atof(field.substr(0, colon).c_str()) * 60.0 + std::atof(field.substr(colon + 1).c_str())) * 1000.0;
+}
+
+bool convertCsv(std::ifstream& input, TrajectoryStoreWriter& store, size_t& records)
+{
+    CsvLayout layout;
+    std::string line;
+    while (std::getline(input, line)) {
+        std::vector<std::string> fields = splitFields(line);
+        if (fields.empty() || fields[0].empty())
+            continue;
+        // Appended logs repeat their header, every one of them sets the layout
+        if (std::isalpha(static_cast<unsigned char>(fields[0][0]))) {
+            layout = parseHeader(fields);
+            continue;
+        }
+        auto field = [&](int column) {
+            return column >= 0 && column < static_cast<int>(fields.size()) ? fields[column] : std::string();
+        };
+        TrajectoryRecord record;
+        record.frameIndex = layout.frame >= 0 ? std::atoi(field(layout.frame).c_str()) : -1;
+        record.trackId = layout.track >= 0 ? std::atoi(field(layout.track).c_str()) : -1;
+        record.timeMsec = layout.time >= 0 ? parseTime(field(layout.time)) : 0.0;
+        record.x = static_cast<float>(std::atof(field(layout.x).c_str()));
+        record.y = static_cast<float>(std::atof(field(layout.y).c_str()));
+        record.area = static_cast<float>(std::atof(field(layout.area).c_str()));
+        store.append(record);
+        ++records;
+    }
+    return true;
+}
+
+bool convertBinary(std::ifstream& input, TrajectoryStoreWriter& store, size_t& records)
+{
+    char header[16];
+    uint32_t fields[3];
+    if (!input.read(header, sizeof(header)) || std::memcmp(header, "PTRJ", 4) != 0)
+        return false;
+    std::memcpy(fields, header + 4, sizeof(fields));
+    uint32_t recordSize = fields[1];
+    if (recordSize < 28 || fields[2] < sizeof(header))
+        return false;
+    input.seekg(fields[2]);
+
+    std::vector<char> bytes(recordSize);
+    while (input.read(bytes.data(), recordSize)) {
+        TrajectoryRecord record;
+        std::memcpy(&record.frameIndex, bytes.data(), 4);
+        std::memcpy(&record.trackId, bytes.data() + 4, 4);
+        std::memcpy(&record.timeMsec, bytes.data() + 8, 8);
+        std::memcpy(&record.x, bytes.data() + 16, 4);
+        std::memcpy(&record.y, bytes.data() + 20, 4);
+        std::memcpy(&record.area, bytes.data() + 24, 4);
+        store.append(record);
+        ++records;
+    }
+    return true;
+}
+
+int convert(const std::string& inputPath, const std::string& outputPath)
+{
+    std::ifstream input(inputPath, std::ios::binary);
+    if (!input.is_open()) {
+        std::cout << "Error opening " << inputPath << std::endl;
+        return -1;
+    }
+    TrajectoryStoreWriter store;
+    if (!store.open(outputPath, WriteMode::Append)) {
+        std::cout << "Error opening " << outputPath << std::endl;
+        return -1;
+    }
+
+    char magic[4] = {};
+    input.read(magic, 4);
+    input.seekg(0);
+    size_t records = 0;
+    bool binary = input.gcount() == 4 && std::memcmp(magic, "PTRJ", 4) == 0;
+    if (!(binary ? convertBinary(input, store, records) : convertCsv(input, store, records))) {
+        std::cout << "Error reading " << inputPath << std::endl;
+        return -1;
+    }
+    if (!store.close()) {
+        std::cout << "Error writing " << outputPath << std::endl;
+        return -1;
+    }
+    std::cout << "Converted " << records << " records" << std::endl;
+    return 0;
+}
+
+int info(const std::string& path)
+{
+    TrajectoryStore store;
+    if (!store.open(path)) {
+        std::cout << "Error reading " << path << std::endl;
+        return -1;
+    }
+    std::cout << store.records() << " records in " << store.chunks().size() << " chunks" << std::endl;
+    if (store.chunks().empty())
+        return 0;
+
+    TrajectoryChunkHeader range = *store.chunks().front().header;
+    for (const auto& chunk : store.chunks()) {
+        const TrajectoryChunkHeader& h = *chunk.header;
+        range.minFrame = std::min(range.minFrame, h.minFrame);
+        range.maxFrame = std::max(range.maxFrame, h.maxFrame);
+        range.minTrack = std::min(range.minTrack, h.minTrack);
+        range.maxTrack = std::max(range.maxTrack, h.maxTrack);
+        range.minTime = std::min(range.minTime, h.minTime);
+        range.maxTime = std::max(range.maxTime, h.maxTime);
+        range.minX = std::min(range.minX, h.minX);
+        range.maxX = std::max(range.maxX, h.maxX);
+        range.minY = std::min(range.minY, h.minY);
+        range.maxY = std::max(range.maxY, h.maxY);
+    }
+    std::cout << "  frames " << range.minFrame << " to " << range.maxFrame << "\n"
+              << "  time   " << range.minTime / 1000.0 << " to " << range.maxTime / 1000.0 << " s\n"
+              << "  tracks " << range.minTrack << " to " << range.maxTrack << "\n"
+              << "  x      " << range.minX << " to " << range.maxX << ", y " << range.minY << " to " << range.maxY
+              << std::endl;
+    return 0;
+}
+
+// Bytes of CSV output collected before writing them
+constexpr size_t kOutputBatch = 1 << 16;
+
+int query(int argc, char** argv)
+{
+    if (argc < 3) {
+        printUsage(argv[0]);
+        return -1;
+    }
+    TrajectoryQuery query;
+    bool countOnly = false;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--time" && i + 2 < argc) {
+            query.timeBegin = std::atof(argv[++i]) * 1000.0;
+            query.timeEnd = std::atof(argv[++i]) * 1000.0;
+        } else if (arg == "--frames" && i + 2 < argc) {
+            query.frameBegin = std::atoi(argv[++i]);
+            query.frameEnd = std::atoi(argv[++i]);
+        } else if (arg == "--region" && i + 4 < argc) {
+            query.xBegin = static_cast<float>(std::atof(argv[++i]));
+            query.yBegin = static_cast<float>(std::atof(argv[++i]));
+            query.xEnd = query.xBegin + static_cast<float>(std::atof(argv[++i]));
+            query.yEnd = query.yBegin + static_cast<float>(std::atof(argv[++i]));
+        } else if (arg == "--track" && i + 1 < argc) {
+            query.track = std::atoi(argv[++i]);
+        } else if (arg == "--count") {
+            countOnly = true;
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    TrajectoryStore store;
+    if (!store.open(argv[2])) {
+        std::cout << "Error reading " << argv[2] << std::endl;
+        return -1;
+    }
+
+    size_t matches;
+    if (countOnly) {
+        matches = store.query(query, [](const TrajectoryChunk&, uint32_t) {});
+        std::cout << matches << std::endl;
+    } else {
+        std::string out = "Frame, Time, ID, X, Y, Area\n";
+        char line[128];
+        matches = store.query(query, [&](const TrajectoryChunk& chunk, uint32_t i) {
+            int length = std::snprintf(line, sizeof(line), "%d, %.3f, %d, %.2f, %.2f, %.0f\n", chunk.frame[i],
+                                       chunk.time[i], chunk.track[i], chunk.x[i], chunk.y[i], chunk.area[i]);
+            out.append(line, length);
+            if (out.size() >= kOutputBatch) {
+                std::fwrite(out.data(), 1, out.size(), stdout);
+                out.clear();
+            }
+        });
+        std::fwrite(out.data(), 1, out.size(), stdout);
+    }
+    double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << matches << " of " << store.records() << " records in " << msec << " ms" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    std::string command = argc > 1 ? argv[1] : "";
+    if (command == "convert" && argc == 4)
+        return convert(argv[2], argv[3]);
+    if (command == "info" && argc == 3)
+        return info(argv[2]);
+    if (command == "query")
+        return query(argc, argv);
+    printUsage(argv[0]);
+    return command == "-h" || command == "--help" ? 0 : -1;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Thread pool where every worker has its own task deque and idle workers steal.
+//
+// A task submitted from a worker goes to the back of that worker's deque and the worker
+// pops from the back, so follow-up work stays on the thread that has its data in cache.
+// Tasks submitted from outside are dealt round-robin. A worker whose deque is empty takes
+// the oldest task from the front of another worker's deque, so uneven work (videos of
+// different length, say) spreads over all cores without any central queue.
+class WorkStealingPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(int workers)
+    {
+        workers = workers < 1 ? 1 : workers;
+        for (int w = 0; w < workers; ++w)
+            m_workers.push_back(std::make_unique<Worker>());
+        for (int w = 0; w < workers; ++w)
+            m_threads.emplace_back([this, w] { run(w); });
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    int workers() const { return static_cast<int>(m_workers.size()); }
+
+    // Index of the calling worker of this pool, -1 for other threads
+    int currentWorker() const { return t_pool == this ? t_worker : -1; }
+
+    // Queue a task, may be called from tasks
+    void submit(Task task)
+    {
+        int w = currentWorker();
+        if (w < 0)
+            w = static_cast<int>(m_next.fetch_add(1, std::memory_order_relaxed) % m_workers.size());
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(m_workers[w]->mutex);
+            m_workers[w]->tasks.push_back(std::move(task));
+        }
+        {
+            // Counted under the mutex the sleepers wait on, so none of them misses it
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_queued;
+        }
+        m_wake.notify_one();
+    }
+
+    // Wait until every submitted task (and every task they submitted) has finished.
+    // Rethrows the first exception a task threw.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_pending.load() == 0; });
+        if (m_error) {
+            std::exception_ptr error = m_error;
+            m_error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Newest task of worker w's own deque
+    bool popLocal(int w, Task& task)
+    {
+        Worker& worker = *m_workers[w];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty())
+            return false;
+        task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        return true;
+    }
+
+    // Oldest task of any other worker, starting with the next one
+    bool steal(int w, Task& task)
+    {
+        int count = static_cast<int>(m_workers.size());
+        for (int i = 1; i < count; ++i) {
+            Worker& victim = *m_workers[(w + i) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(int w)
+    {
+        t_pool = this;
+        t_worker = w;
+        while (true) {
+            Task task;
+            if (!popLocal(w, task) && !steal(w, task)) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+                if (m_stop && m_queued == 0)
+                    return;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_queued;
+            }
+
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_error)
+                    m_error = std::current_exception();
+            }
+            task = nullptr;
+
+            if (m_pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_idle.notify_all();
+            }
+        }
+    }
+
+    static inline thread_local const WorkStealingPool* t_pool = nullptr;
+    static inline thread_local int t_worker = -1;
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_next{0};
+    std::atomic<size_t> m_pending{0}; // submitted and not finished
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+    size_t m_queued = 0; // sitting in a deque, guarded by m_mutex
+    bool m_stop = false;
+    std::exception_ptr m_error;
+};